@@ -0,0 +1,170 @@
+/*
+ * acpi.c
+ *
+ * Just enough ACPI to find the interrupt controllers and CPUs: locate the
+ * RSDP in the BIOS area, walk the RSDT and parse the MADT into acpi_info.
+ * Firmware tables below DIRECT_MAP_SIZE are read through the direct map;
+ * only tables the firmware placed above it need an ioremap() window.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "acpi.h"
+#include "page.h"
+
+struct acpi_info acpi_info;
+
+static struct acpi_sdt_header *rsdt;
+
+static int checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        sum += b[i];
+    }
+    return sum == 0;
+}
+
+static int sig_equal(const char *a, const char *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Kernel address of len bytes of firmware memory at paddr
+static void *acpi_map(uint32_t paddr, uint32_t len) {
+    if (paddr < DIRECT_MAP_SIZE && len <= DIRECT_MAP_SIZE - paddr) {
+        return phys_to_virt(paddr);
+    }
+    return ioremap(paddr, len, 0);
+}
+
+// Scans [start, start+len) on 16-byte boundaries for a valid RSDP
+static struct acpi_rsdp *scan_rsdp(uint32_t start, uint32_t len) {
+    char *area = acpi_map(start, len);
+    if (area == NULL) {
+        return NULL;
+    }
+    for (uint32_t off = 0; off + sizeof(struct acpi_rsdp) <= len; off += 16) {
+        struct acpi_rsdp *rsdp = (struct acpi_rsdp *)(area + off);
+        if (sig_equal(rsdp->signature, "RSD PTR ", 8) &&
+            checksum_ok(rsdp, sizeof(struct acpi_rsdp))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+// Maps a whole table given its physical address
+static struct acpi_sdt_header *map_table(uint32_t paddr) {
+    struct acpi_sdt_header *h = acpi_map(paddr, sizeof(struct acpi_sdt_header));
+    if (h == NULL) {
+        return NULL;
+    }
+    h = acpi_map(paddr, h->length);
+    if (h == NULL || !checksum_ok(h, h->length)) {
+        return NULL;
+    }
+    return h;
+}
+
+struct acpi_sdt_header *acpi_find_table(const char *signature) {
+    if (rsdt == NULL) {
+        return NULL;
+    }
+
+    uint32_t n = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
+    uint32_t *entries = (uint32_t *)(rsdt + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        struct acpi_sdt_header *h = map_table(entries[i]);
+        if (h != NULL && sig_equal(h->signature, signature, 4)) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+static void parse_madt(struct acpi_madt *madt) {
+    uint8_t *p = (uint8_t *)(madt + 1);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+    acpi_info.lapic_address = madt->lapic_address;
+    while (p + sizeof(struct madt_entry_header) <= end) {
+        struct madt_entry_header *h = (struct madt_entry_header *)p;
+        if (h->length < sizeof(struct madt_entry_header)) {
+            break;
+        }
+
+        switch (h->type) {
+        case MADT_LAPIC: {
+            struct madt_lapic *e = (struct madt_lapic *)h;
+            if ((e->flags & 1) && acpi_info.ncpus < ACPI_MAX_CPUS) {
+                acpi_info.cpu_apic_ids[acpi_info.ncpus++] = e->apic_id;
+            }
+            break;
+        }
+        case MADT_IOAPIC: {
+            struct madt_ioapic *e = (struct madt_ioapic *)h;
+            if (acpi_info.nioapics < ACPI_MAX_IOAPICS) {
+                acpi_info.ioapics[acpi_info.nioapics].id = e->ioapic_id;
+                acpi_info.ioapics[acpi_info.nioapics].address = e->address;
+                acpi_info.ioapics[acpi_info.nioapics].gsi_base = e->gsi_base;
+                acpi_info.nioapics++;
+            }
+            break;
+        }
+        case MADT_ISO: {
+            struct madt_iso *e = (struct madt_iso *)h;
+            if (e->bus == 0 && acpi_info.noverrides < ACPI_MAX_OVERRIDES) {
+                acpi_info.overrides[acpi_info.noverrides].irq = e->source;
+                acpi_info.overrides[acpi_info.noverrides].gsi = e->gsi;
+                acpi_info.overrides[acpi_info.noverrides].flags = e->flags;
+                acpi_info.noverrides++;
+            }
+            break;
+        }
+        case MADT_LAPIC_OVERRIDE: {
+            struct madt_lapic_override *e = (struct madt_lapic_override *)h;
+            acpi_info.lapic_address = (uint32_t)e->address;
+            break;
+        }
+        }
+        p += h->length;
+    }
+}
+
+/*
+ * Finds the MADT and fills in acpi_info. Returns -1 if the firmware has no
+ * usable ACPI tables, in which case the legacy PIC stays in charge.
+ */
+int acpi_init(void) {
+    // The EBDA segment is stored at 0x40E in the BIOS data area
+    uint16_t *ebda_seg = acpi_map(0x40E, 2);
+    struct acpi_rsdp *rsdp = NULL;
+
+    if (ebda_seg != NULL && *ebda_seg != 0) {
+        rsdp = scan_rsdp((uint32_t)*ebda_seg << 4, 1024);
+    }
+    if (rsdp == NULL) {
+        rsdp = scan_rsdp(0xE0000, 0x20000);
+    }
+    if (rsdp == NULL) {
+        return -1;
+    }
+
+    rsdt = map_table(rsdp->rsdt_address);
+    if (rsdt == NULL) {
+        return -1;
+    }
+
+    struct acpi_madt *madt = (struct acpi_madt *)acpi_find_table("APIC");
+    if (madt == NULL) {
+        return -1;
+    }
+    parse_madt(madt);
+    return 0;
+}
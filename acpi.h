@@ -0,0 +1,102 @@
+#ifndef __ACPI_H__
+#define __ACPI_H__
+
+#include <stdint.h>
+
+#define ACPI_MAX_CPUS       16
+#define ACPI_MAX_IOAPICS    4
+#define ACPI_MAX_OVERRIDES  16
+
+// Root System Description Pointer, found in the BIOS area
+struct acpi_rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+// Common header of every system description table
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// Multiple APIC Description Table ("APIC")
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;             // Bit 0: 8259 pair present
+} __attribute__((packed));
+
+#define MADT_LAPIC           0
+#define MADT_IOAPIC          1
+#define MADT_ISO             2  // Interrupt source override
+#define MADT_LAPIC_OVERRIDE  5
+
+struct madt_entry_header {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_lapic {
+    struct madt_entry_header h;
+    uint8_t acpi_cpu_id;
+    uint8_t apic_id;
+    uint32_t flags;             // Bit 0: enabled
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry_header h;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_iso {
+    struct madt_entry_header h;
+    uint8_t bus;
+    uint8_t source;             // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;             // Polarity in bits 0-1, trigger mode in bits 2-3
+} __attribute__((packed));
+
+struct madt_lapic_override {
+    struct madt_entry_header h;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed));
+
+// What the kernel needs to know from the MADT
+struct acpi_info {
+    uint32_t lapic_address;
+    int ncpus;
+    uint8_t cpu_apic_ids[ACPI_MAX_CPUS];
+    int nioapics;
+    struct {
+        uint8_t id;
+        uint32_t address;
+        uint32_t gsi_base;
+    } ioapics[ACPI_MAX_IOAPICS];
+    int noverrides;
+    struct {
+        uint8_t irq;
+        uint32_t gsi;
+        uint16_t flags;
+    } overrides[ACPI_MAX_OVERRIDES];
+};
+
+extern struct acpi_info acpi_info;
+
+int acpi_init(void);
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+
+#endif
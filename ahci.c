@@ -0,0 +1,527 @@
+/*
+ * ahci.c
+ *
+ * AHCI SATA driver. Each disk gets a blk_queue whose depth is the number of
+ * commands the drive can queue, and every merged group is sent as one
+ * READ FPDMA QUEUED (NCQ) command in its own command slot, so the drive can
+ * reorder and overlap them. Drives without NCQ get READ DMA EXT, one at a
+ * time. Completions come in through MSI when there is a local APIC, and
+ * through the legacy INTx line otherwise. A command the drive has not
+ * finished within AHCI_TIMEOUT_MS fails, together with everything else
+ * outstanding on the port, and the port is restarted. Restarts wait on the
+ * HBA for up to a few seconds, so they run in ahci_eh_thread rather than
+ * in the interrupt or timer that found the error.
+ *
+ * Only reads are implemented. The block layer has no write path for any
+ * driver yet, so WRITE FPDMA QUEUED and WRITE DMA EXT are not sent.
+ */
+
+#include "ahci.h"
+#include "sd.h"
+#include "pci.h"
+#include "page.h"
+#include "timer.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+extern int putc(int data);
+extern void memset(char *s, char c, unsigned int n);
+
+#define AHCI_PORT_PAGES 8   // Command list, received FISes and 32 command tables
+#define AHCI_FIS_OFFSET 0x400
+#define AHCI_CT_OFFSET  0x800
+
+struct ahci_port ahci_ports[AHCI_MAX_PORTS];
+int ahci_nports;
+
+static volatile uint32_t *abar;
+
+// ahci_eh_thread() sleeps here until a port needs a restart or has failed slots
+static struct wait_queue ahci_eh_wq;
+
+#define HBA_REG(r)      abar[(r) / 4]
+#define PORT_REG(p, r)  (p)->regs[(r) / 4]
+
+// Spins until (reg & mask) == value or ms milliseconds pass
+static int ahci_wait(volatile uint32_t *reg, uint32_t mask, uint32_t value, uint32_t ms) {
+    uint64_t deadline = ktime_ns() + (uint64_t)ms * 1000000;
+    while ((*reg & mask) != value) {
+        if (ktime_ns() > deadline) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void ahci_port_stop(struct ahci_port *p) {
+    PORT_REG(p, PX_CMD) &= ~PX_CMD_ST;
+    ahci_wait(&PORT_REG(p, PX_CMD), PX_CMD_CR, 0, 500);
+    PORT_REG(p, PX_CMD) &= ~PX_CMD_FRE;
+    ahci_wait(&PORT_REG(p, PX_CMD), PX_CMD_FR, 0, 500);
+}
+
+static void ahci_port_start(struct ahci_port *p) {
+    PORT_REG(p, PX_SERR) = 0xFFFFFFFF;
+    PORT_REG(p, PX_IS) = 0xFFFFFFFF;
+    PORT_REG(p, PX_CMD) |= PX_CMD_FRE;
+    // The drive must not be busy when the command engine starts
+    ahci_wait(&PORT_REG(p, PX_TFD), 0x88, 0, 1000);
+    PORT_REG(p, PX_CMD) |= PX_CMD_ST;
+}
+
+/*
+ * Stops the port, which drops every issued command, and starts it again.
+ * A drive left busy by a hung command gets a COMRESET first (AHCI 10.4.2).
+ * Runs in ahci_eh_thread() without p->lock; p->restarting keeps everything
+ * else off the port registers meanwhile.
+ */
+static void ahci_port_restart(struct ahci_port *p) {
+    ahci_port_stop(p);
+    if (PORT_REG(p, PX_TFD) & 0x88) {
+        PORT_REG(p, PX_SCTL) = (PORT_REG(p, PX_SCTL) & ~0xF) | 1;  // DET = 1: COMRESET
+        udelay(1000);
+        PORT_REG(p, PX_SCTL) &= ~0xF;
+        ahci_wait(&PORT_REG(p, PX_SSTS), 0xF, 3, 1000);
+    }
+    ahci_port_start(p);
+}
+
+// Fills slot's command table with an H2D register FIS and a PRD list for
+// the buffers of every request in the group. Returns -1 if they do not fit.
+static int ahci_build(struct ahci_port *p, int slot, uint8_t command, uint32_t lba,
+                      uint32_t count, struct blk_request *group) {
+    struct ahci_cmd_table *t = &p->tables[slot];
+    struct ahci_cmd_header *h = &p->cl[slot];
+    uint8_t *fis = t->cfis;
+    int nprd = 0;
+
+    memset((char *)fis, 0, 20);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80;                  // Command, not control
+    fis[2] = command;
+    fis[4] = lba;
+    fis[5] = lba >> 8;
+    fis[6] = lba >> 16;
+    fis[7] = 0x40;                  // LBA mode
+    fis[8] = lba >> 24;
+    if (command == ATA_CMD_READ_FPDMA_QUEUED) {
+        fis[3] = count;             // NCQ moves the count to the features field
+        fis[11] = count >> 8;
+        fis[12] = slot << 3;        // and puts the tag in the count field
+    } else {
+        fis[12] = count;
+        fis[13] = count >> 8;
+    }
+    if (command == ATA_CMD_IDENTIFY) {
+        fis[7] = 0;
+    }
+
+    // One PRD per page touched, since the buffers are only virtually contiguous
+    for (struct blk_request *r = group; r != NULL; r = r->chain) {
+        char *buf = r->buf;
+        uint32_t left = r->count * 512;
+        while (left > 0) {
+            uint32_t n = PAGE_SIZE - ((uint32_t)buf & (PAGE_SIZE - 1));
+            if (n > left) {
+                n = left;
+            }
+            if (nprd == AHCI_PRDS) {
+                return -1;
+            }
+            t->prdt[nprd].dba = virt_to_phys(buf);
+            t->prdt[nprd].dbau = 0;
+            t->prdt[nprd].reserved = 0;
+            t->prdt[nprd].dbc = n - 1;
+            nprd++;
+            buf += n;
+            left -= n;
+        }
+    }
+
+    h->flags = 5;                   // FIS length in dwords; a read, so W is clear
+    h->prdtl = nprd;
+    h->prdbc = 0;
+    return 0;
+}
+
+// Hands a built slot to the HBA. Called with p->lock held.
+static void ahci_issue(struct ahci_port *p, int slot) {
+    if (p->busy == 0) {
+        mod_timer(&p->timer, jiffies + msecs_to_jiffies(AHCI_TIMEOUT_MS));
+    }
+    p->busy |= 1u << slot;
+    p->slot_deadline[slot] = jiffies + msecs_to_jiffies(AHCI_TIMEOUT_MS);
+    if (p->ncq) {
+        PORT_REG(p, PX_SACT) = 1u << slot;
+    }
+    PORT_REG(p, PX_CI) = 1u << slot;
+}
+
+/*
+ * blk_queue start hook; called with the queue lock held, so a group that
+ * cannot be sent is left for ahci_eh_thread() to fail rather than being
+ * completed here.
+ */
+static void ahci_start(struct blk_queue *q, struct blk_request *group) {
+    struct ahci_port *p = (struct ahci_port *)q->driver_data;
+    uint32_t flags = spin_lock_irqsave(&p->lock);
+    int slot;
+    int wake = 0;
+
+    // The queue depth never exceeds the slot count, so one is free
+    asm("bsf %1, %0" : "=r"(slot) : "rm"(~(p->busy | p->held | p->failed)));
+    p->slot_req[slot] = group;
+    // The queue's max_segments keeps every group within AHCI_PRDS
+    uint8_t command = p->ncq ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_READ_DMA_EXT;
+    if (ahci_build(p, slot, command, group->lba, group->group_count, group) < 0) {
+        p->failed |= 1u << slot;
+        wake = 1;
+    } else if (p->restarting) {
+        p->held |= 1u << slot;
+    } else {
+        ahci_issue(p, slot);
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    if (wake) {
+        wait_queue_wake_all(&ahci_eh_wq);
+    }
+}
+
+/*
+ * Completes every command the port has finished. A command is done once its
+ * bit is clear in both PxCI and PxSACT. On a task file or bus error all
+ * outstanding commands are failed and the port is handed to
+ * ahci_eh_thread() for a restart.
+ */
+static void ahci_port_service(struct ahci_port *p) {
+    struct blk_request *done[32];
+    int ndone = 0;
+    int status = 0;
+    int wake = 0;
+
+    uint32_t flags = spin_lock_irqsave(&p->lock);
+    if (p->restarting) {
+        // Nothing is issued; the restart clears PxIS itself
+        spin_unlock_irqrestore(&p->lock, flags);
+        return;
+    }
+    uint32_t is = PORT_REG(p, PX_IS);
+    PORT_REG(p, PX_IS) = is;
+
+    uint32_t finished;
+    if (is & PX_IS_ERRORS) {
+        finished = p->busy;
+        status = -1;
+        p->restarting = 1;
+        wake = 1;
+    } else {
+        finished = p->busy & ~(PORT_REG(p, PX_CI) | PORT_REG(p, PX_SACT));
+    }
+    p->busy &= ~finished;
+    if (p->busy == 0) {
+        del_timer(&p->timer);
+    }
+    while (finished != 0) {
+        int slot;
+        asm("bsf %1, %0" : "=r"(slot) : "rm"(finished));
+        finished &= ~(1u << slot);
+        done[ndone++] = p->slot_req[slot];
+        p->slot_req[slot] = NULL;
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    if (wake) {
+        esp_printf(putc, "ahci: error on %s, %d commands failed\r\n", p->model, ndone);
+        wait_queue_wake_all(&ahci_eh_wq);
+    }
+    for (int i = 0; i < ndone; i++) {
+        blk_complete(&p->queue, done[i], status);
+    }
+}
+
+/*
+ * Runs while commands are issued. If one of them is past its deadline the
+ * drive has dropped it: fail every issued command and have ahci_eh_thread()
+ * restart the port, since NCQ cannot abort a single tag. Otherwise wait for
+ * the earliest deadline.
+ */
+static void ahci_timeout(void *data) {
+    struct ahci_port *p = (struct ahci_port *)data;
+    struct blk_request *failed[32];
+    int nfailed = 0;
+
+    uint32_t flags = spin_lock_irqsave(&p->lock);
+    if (p->restarting) {
+        spin_unlock_irqrestore(&p->lock, flags);
+        return;
+    }
+    uint32_t expired = 0;
+    uint32_t next = jiffies + msecs_to_jiffies(AHCI_TIMEOUT_MS);  // No deadline is later
+    for (int slot = 0; slot < 32; slot++) {
+        if (!(p->busy & (1u << slot))) {
+            continue;
+        }
+        int32_t left = (int32_t)(p->slot_deadline[slot] - jiffies);
+        if (left <= 0) {
+            expired |= 1u << slot;
+        } else if ((int32_t)(p->slot_deadline[slot] - next) < 0) {
+            next = p->slot_deadline[slot];
+        }
+    }
+
+    if (expired != 0) {
+        p->restarting = 1;
+        for (int slot = 0; slot < 32; slot++) {
+            if (p->busy & (1u << slot)) {
+                failed[nfailed++] = p->slot_req[slot];
+                p->slot_req[slot] = NULL;
+            }
+        }
+        p->busy = 0;
+    } else if (p->busy != 0) {
+        mod_timer(&p->timer, next);
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    if (nfailed > 0) {
+        esp_printf(putc, "ahci: timeout on %s, %d commands failed\r\n", p->model, nfailed);
+        wait_queue_wake_all(&ahci_eh_wq);
+    }
+    for (int i = 0; i < nfailed; i++) {
+        blk_complete(&p->queue, failed[i], -1);
+    }
+}
+
+/*
+ * Restarts the port if it is marked restarting, then issues the groups
+ * that arrived meanwhile, and fails any group ahci_start() could not build.
+ */
+static void ahci_recover(struct ahci_port *p) {
+    struct blk_request *failed[32];
+    int nfailed = 0;
+
+    if (p->restarting) {
+        ahci_port_restart(p);
+    }
+
+    uint32_t flags = spin_lock_irqsave(&p->lock);
+    if (p->restarting) {
+        p->restarting = 0;
+        while (p->held != 0) {
+            int slot;
+            asm("bsf %1, %0" : "=r"(slot) : "rm"(p->held));
+            p->held &= ~(1u << slot);
+            ahci_issue(p, slot);
+        }
+    }
+    while (p->failed != 0) {
+        int slot;
+        asm("bsf %1, %0" : "=r"(slot) : "rm"(p->failed));
+        p->failed &= ~(1u << slot);
+        failed[nfailed++] = p->slot_req[slot];
+        p->slot_req[slot] = NULL;
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    for (int i = 0; i < nfailed; i++) {
+        blk_complete(&p->queue, failed[i], -1);
+    }
+}
+
+static int ahci_eh_pending(void) {
+    for (int i = 0; i < ahci_nports; i++) {
+        if (ahci_ports[i].restarting || ahci_ports[i].failed != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Error handler thread: does the port restarts, which may take seconds
+static void ahci_eh_thread(void *arg) {
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&ahci_eh_wq.lock);
+        while (!ahci_eh_pending()) {
+            wait_queue_sleep_locked(&ahci_eh_wq);
+        }
+        spin_unlock_irqrestore(&ahci_eh_wq.lock, flags);
+
+        for (int i = 0; i < ahci_nports; i++) {
+            ahci_recover(&ahci_ports[i]);
+        }
+    }
+}
+
+static int ahci_irq(struct regs *r, void *ctx) {
+    uint32_t is = HBA_REG(AHCI_IS);
+    if (is == 0) {
+        return IRQ_NONE;
+    }
+    for (int i = 0; i < ahci_nports; i++) {
+        if (is & (1u << ahci_ports[i].num)) {
+            ahci_port_service(&ahci_ports[i]);
+        }
+    }
+    HBA_REG(AHCI_IS) = is;
+    return IRQ_HANDLED;
+}
+
+static void ahci_poll(struct blk_queue *q) {
+    ahci_port_service((struct ahci_port *)q->driver_data);
+}
+
+// Copies an IDENTIFY string, which stores two bytes per word big-end first
+static void ahci_copy_string(char *dst, uint16_t *words, int nwords) {
+    int len = nwords * 2;
+    for (int i = 0; i < nwords; i++) {
+        dst[2 * i] = words[i] >> 8;
+        dst[2 * i + 1] = words[i] & 0xFF;
+    }
+    while (len > 0 && dst[len - 1] == ' ') {
+        len--;
+    }
+    dst[len] = '\0';
+}
+
+// Runs IDENTIFY DEVICE in slot 0 by polling, before interrupts are enabled
+static int ahci_identify(struct ahci_port *p, uint32_t hba_slots) {
+    uint16_t id[256];
+    struct blk_request req;
+
+    req.buf = (char *)id;
+    req.count = 1;
+    req.chain = NULL;
+    if (ahci_build(p, 0, ATA_CMD_IDENTIFY, 0, 0, &req) < 0) {
+        return -1;
+    }
+    PORT_REG(p, PX_CI) = 1;
+    if (ahci_wait(&PORT_REG(p, PX_CI), 1, 0, 1000) < 0 || (PORT_REG(p, PX_IS) & PX_IS_TFES)) {
+        return -1;
+    }
+    PORT_REG(p, PX_IS) = 0xFFFFFFFF;
+
+    if (id[83] & (1 << 10)) {
+        p->sectors = (id[102] || id[103]) ? 0xFFFFFFFF : id[100] | ((uint32_t)id[101] << 16);
+    } else {
+        p->sectors = id[60] | ((uint32_t)id[61] << 16);
+    }
+    ahci_copy_string(p->model, &id[27], 20);
+
+    // NCQ needs both the HBA and the drive; the drive reports its depth - 1
+    p->nslots = hba_slots;
+    if (p->ncq && (id[76] & (1 << 8))) {
+        uint32_t depth = (id[75] & 0x1F) + 1;
+        if (depth < p->nslots) {
+            p->nslots = depth;
+        }
+    } else {
+        p->ncq = 0;
+    }
+    return 0;
+}
+
+static int ahci_port_init(struct ahci_port *p, uint32_t cap) {
+    uint32_t ssts = PORT_REG(p, PX_SSTS);
+
+    // Device present with the link up, and an ATA disk rather than ATAPI
+    if ((ssts & 0xF) != 3 || ((ssts >> 8) & 0xF) != 1 || PORT_REG(p, PX_SIG) != AHCI_SIG_ATA) {
+        return -1;
+    }
+
+    ahci_port_stop(p);
+    char *mem = kpage_alloc(AHCI_PORT_PAGES);
+    if (mem == NULL) {
+        return -1;
+    }
+    memset(mem, 0, AHCI_PORT_PAGES * PAGE_SIZE);
+    p->cl = (struct ahci_cmd_header *)mem;
+    p->tables = (struct ahci_cmd_table *)(mem + AHCI_CT_OFFSET);
+    p->mem_phys = virt_to_phys(mem);  // kpage memory is physically contiguous
+
+    for (int i = 0; i < 32; i++) {
+        p->cl[i].ctba = p->mem_phys + AHCI_CT_OFFSET + i * sizeof(struct ahci_cmd_table);
+        p->cl[i].ctbau = 0;
+    }
+    PORT_REG(p, PX_CLB) = p->mem_phys;
+    PORT_REG(p, PX_CLBU) = 0;
+    PORT_REG(p, PX_FB) = p->mem_phys + AHCI_FIS_OFFSET;
+    PORT_REG(p, PX_FBU) = 0;
+    ahci_port_start(p);
+
+    p->ncq = (cap & AHCI_CAP_SNCQ) != 0;
+    if (ahci_identify(p, ((cap >> 8) & 0x1F) + 1) < 0) {
+        ahci_port_stop(p);
+        kpage_free(mem);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *ahci_names[AHCI_MAX_PORTS] = {
+    "sata0", "sata1", "sata2", "sata3", "sata4", "sata5", "sata6", "sata7",
+};
+
+// Finds the first AHCI controller and sets up every disk attached to it
+int ahci_init(void) {
+    struct pci_dev *dev = pci_find_class(0x01, 0x06, NULL);
+    if (dev == NULL || dev->prog_if != 0x01) {
+        return -1;
+    }
+
+    pci_enable(dev, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+    abar = ioremap(pci_bar(dev, 5), 0x1100, PAGE_RW | PAGE_NOCACHE);
+    if (abar == NULL) {
+        return -1;
+    }
+    HBA_REG(AHCI_GHC) |= AHCI_GHC_AE;
+
+    uint32_t cap = HBA_REG(AHCI_CAP);
+    uint32_t pi = HBA_REG(AHCI_PI);
+    for (int port = 0; port < 32 && ahci_nports < AHCI_MAX_PORTS; port++) {
+        if (!(pi & (1u << port))) {
+            continue;
+        }
+        struct ahci_port *p = &ahci_ports[ahci_nports];
+        p->num = port;
+        p->regs = abar + (AHCI_PORT_BASE + port * AHCI_PORT_SIZE) / 4;
+        spin_lock_init(&p->lock, ahci_names[ahci_nports]);
+        timer_setup(&p->timer, ahci_timeout, p);
+        if (ahci_port_init(p, cap) < 0) {
+            continue;
+        }
+
+        blk_queue_init(&p->queue, ahci_names[ahci_nports], AHCI_MAX_SECTORS, ahci_start, ahci_poll);
+        p->queue.driver_data = p;
+        p->queue.depth = p->nslots;
+        p->queue.max_segments = AHCI_PRDS;
+        blockdev_init_queue(&p->bdev, ahci_names[ahci_nports], &p->queue, p->sectors);
+        esp_printf(putc, "%s: %s, %d sectors, %s depth %d\r\n", ahci_names[ahci_nports],
+                   p->model, p->sectors, p->ncq ? "NCQ" : "no NCQ", p->nslots);
+        ahci_nports++;
+    }
+    if (ahci_nports == 0) {
+        return -1;
+    }
+
+    spin_lock_init(&ahci_eh_wq.lock, "ahci_eh");
+    ahci_eh_wq.head = NULL;
+    kthread_create(ahci_eh_thread, NULL, "ahci_eh");
+
+    // Prefer MSI; fall back to the INTx line the BIOS assigned
+    int vector = pci_alloc_vector();
+    if (vector >= 0 && pci_enable_msi(dev, vector) == 0) {
+        irq_register(vector, ahci_irq, NULL);
+    } else {
+        irq_register(IRQ_BASE + dev->irq_line, ahci_irq, NULL);
+    }
+    for (int i = 0; i < ahci_nports; i++) {
+        PORT_REG(&ahci_ports[i], PX_IS) = 0xFFFFFFFF;
+        PORT_REG(&ahci_ports[i], PX_IE) = PX_IS_DHRS | PX_IS_SDBS | PX_IS_ERRORS;
+    }
+    HBA_REG(AHCI_IS) = 0xFFFFFFFF;
+    HBA_REG(AHCI_GHC) |= AHCI_GHC_IE;
+    return 0;
+}
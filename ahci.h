@@ -0,0 +1,114 @@
+#ifndef __AHCI_H__
+#define __AHCI_H__
+
+#include <stdint.h>
+#include "blk.h"
+#include "blockdev.h"
+#include "sync.h"
+#include "timer.h"
+
+// HBA registers (byte offsets from ABAR)
+#define AHCI_CAP        0x00
+#define AHCI_GHC        0x04
+#define AHCI_IS         0x08
+#define AHCI_PI         0x0C
+
+#define AHCI_CAP_SNCQ   (1u << 30)
+#define AHCI_GHC_AE     (1u << 31)   // AHCI enable
+#define AHCI_GHC_IE     (1u << 1)    // Interrupt enable
+
+// Port registers (byte offsets from the port's 0x80-byte block)
+#define AHCI_PORT_BASE  0x100
+#define AHCI_PORT_SIZE  0x80
+#define PX_CLB          0x00
+#define PX_CLBU         0x04
+#define PX_FB           0x08
+#define PX_FBU          0x0C
+#define PX_IS           0x10
+#define PX_IE           0x14
+#define PX_CMD          0x18
+#define PX_TFD          0x20
+#define PX_SIG          0x24
+#define PX_SSTS         0x28
+#define PX_SCTL         0x2C
+#define PX_SERR         0x30
+#define PX_SACT         0x34
+#define PX_CI           0x38
+
+#define PX_CMD_ST       (1u << 0)
+#define PX_CMD_FRE      (1u << 4)
+#define PX_CMD_FR       (1u << 14)
+#define PX_CMD_CR       (1u << 15)
+
+#define PX_IS_DHRS      (1u << 0)    // D2H register FIS: a non-queued command ended
+#define PX_IS_SDBS      (1u << 3)    // Set Device Bits FIS: NCQ commands ended
+#define PX_IS_IFS       (1u << 27)
+#define PX_IS_HBDS      (1u << 28)
+#define PX_IS_HBFS      (1u << 29)
+#define PX_IS_TFES      (1u << 30)
+#define PX_IS_ERRORS    (PX_IS_IFS | PX_IS_HBDS | PX_IS_HBFS | PX_IS_TFES)
+
+#define AHCI_SIG_ATA    0x00000101
+
+#define FIS_TYPE_REG_H2D    0x27
+
+// Reads only: the block layer has no write path yet (see blockdev.c)
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60
+
+#define AHCI_MAX_PORTS  8
+#define AHCI_PRDS       48           // PRD entries per command table
+#define AHCI_MAX_SECTORS 256         // Per command; fits AHCI_PRDS 4 KB segments
+#define AHCI_TIMEOUT_MS 5000         // A command still outstanding after this has been dropped
+
+struct ahci_cmd_header {
+    uint16_t flags;                  // CFL in bits 0-4, W in bit 6
+    uint16_t prdtl;                  // PRD entries used
+    volatile uint32_t prdbc;         // Bytes transferred, written by the HBA
+    uint32_t ctba;                   // Physical address of the command table
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;                    // Byte count - 1; bit 31 asks for an interrupt
+};
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDS];
+};
+
+struct ahci_port {
+    int num;
+    volatile uint32_t *regs;
+    spinlock_t lock;                 // Guards the slot masks, slot_req and slot_deadline
+    struct ahci_cmd_header *cl;      // 32 command headers
+    struct ahci_cmd_table *tables;   // One command table per slot
+    uint32_t mem_phys;               // Physical base of cl; fis and tables follow
+    uint32_t nslots;
+    int ncq;
+    uint32_t busy;                   // Slots with a command issued
+    uint32_t held;                   // Slots built during a restart, issued after it
+    uint32_t failed;                 // Slots that could not be built, for ahci_eh_thread to fail
+    volatile int restarting;         // ahci_eh_thread owns the port registers
+    struct blk_request *slot_req[32];
+    uint32_t slot_deadline[32];      // Jiffies by which each busy slot must finish
+    struct timer_list timer;         // Armed while any slot is issued
+    uint32_t sectors;
+    char model[41];
+    struct blk_queue queue;
+    struct blockdev bdev;
+};
+
+extern struct ahci_port ahci_ports[AHCI_MAX_PORTS];
+extern int ahci_nports;
+
+int ahci_init(void);
+
+#endif
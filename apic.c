@@ -0,0 +1,238 @@
+/*
+ * apic.c
+ *
+ * Local APIC and IOAPIC support. When the MADT describes an IOAPIC the
+ * 8259 pair is masked and every ISA line is routed through the IOAPIC to the
+ * same vector the PIC used (IRQ_BASE + n), so drivers keep registering on
+ * IRQ_BASE + n regardless of which controller is active. The system tick
+ * moves from the PIT to the local APIC timer, which is per-CPU and needs no
+ * port I/O to acknowledge.
+ *
+ * Without an APIC or ACPI tables the legacy PIC stays in charge.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "apic.h"
+#include "acpi.h"
+#include "interrupt.h"
+#include "page.h"
+#include "timer.h"
+
+volatile uint32_t *lapic;
+int apic_enabled = 0;
+uint32_t apic_timer_ticks = 0;
+
+static volatile uint32_t *ioapic;
+static uint32_t ioapic_gsi_base;
+static uint32_t ioapic_nr_pins;
+
+// GSI and redirection flags for each ISA IRQ after interrupt source overrides
+static uint32_t isa_gsi[16];
+static uint32_t isa_flags[16];
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4];  // Wait for the write to post
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+// Sends an inter-processor interrupt; icr is the low half of the ICR
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr) {
+    uint32_t flags = irq_save();
+
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        asm volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        asm volatile("pause");
+    }
+    irq_restore(flags);
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WIN / 4] = value;
+}
+
+static void ioapic_set_masked(int irq, int masked) {
+    uint32_t pin = isa_gsi[irq] - ioapic_gsi_base;
+    if (pin >= ioapic_nr_pins) {
+        return;
+    }
+
+    uint32_t low = ioapic_read(IOAPIC_REDTBL(pin));
+    if (masked) {
+        low |= IOAPIC_MASKED;
+    } else {
+        low &= ~IOAPIC_MASKED;
+    }
+    ioapic_write(IOAPIC_REDTBL(pin), low);
+}
+
+static void ioapic_mask(int irq) {
+    if (irq >= 0 && irq < 16) {
+        ioapic_set_masked(irq, 1);
+    }
+}
+
+static void ioapic_unmask(int irq) {
+    if (irq >= 0 && irq < 16) {
+        ioapic_set_masked(irq, 0);
+    }
+}
+
+static void ioapic_eoi(uint32_t vector) {
+    (void)vector;
+    lapic_eoi();
+}
+
+struct irq_chip ioapic_chip = {
+    .name = "IOAPIC",
+    .mask = ioapic_mask,
+    .unmask = ioapic_unmask,
+    .eoi = ioapic_eoi,
+};
+
+/*
+ * Builds the ISA IRQ to GSI table. ISA lines are edge triggered, active high
+ * unless the MADT overrides them (on QEMU the PIT moves to GSI 2).
+ */
+static void build_isa_routes(void) {
+    for (int irq = 0; irq < 16; irq++) {
+        isa_gsi[irq] = irq;
+        isa_flags[irq] = 0;
+    }
+    for (int i = 0; i < acpi_info.noverrides; i++) {
+        uint8_t irq = acpi_info.overrides[i].irq;
+        uint16_t flags = acpi_info.overrides[i].flags;
+        if (irq >= 16) {
+            continue;
+        }
+        isa_gsi[irq] = acpi_info.overrides[i].gsi;
+        if ((flags & 0x3) == 0x3) {
+            isa_flags[irq] |= IOAPIC_ACTIVE_LOW;
+        }
+        if (((flags >> 2) & 0x3) == 0x3) {
+            isa_flags[irq] |= IOAPIC_LEVEL;
+        }
+    }
+}
+
+static void ioapic_setup(void) {
+    ioapic_nr_pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+
+    // Everything masked until a handler is registered
+    for (uint32_t pin = 0; pin < ioapic_nr_pins; pin++) {
+        ioapic_write(IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+        ioapic_write(IOAPIC_REDTBL(pin) + 1, 0);
+    }
+
+    for (int irq = 0; irq < 16; irq++) {
+        uint32_t pin = isa_gsi[irq] - ioapic_gsi_base;
+        if (pin >= ioapic_nr_pins) {
+            continue;
+        }
+        // Fixed delivery, physical destination: the boot CPU
+        ioapic_write(IOAPIC_REDTBL(pin) + 1, lapic_id() << 24);
+        ioapic_write(IOAPIC_REDTBL(pin), IOAPIC_MASKED | isa_flags[irq] | (IRQ_BASE + irq));
+    }
+}
+
+/*
+ * Counts how far the APIC timer runs down in 10 ms of TSC time, and from
+ * that the initial count for one tick at timer_hz.
+ */
+static void apic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+
+    uint64_t start = ktime_ns();
+    while (ktime_ns() - start < 10000000ULL) {
+        asm volatile("pause");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    apic_timer_ticks = elapsed * 100 / timer_hz;
+}
+
+// Programs this CPU's APIC timer as a periodic tick at timer_hz
+void apic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, apic_timer_ticks);
+}
+
+// Enables the calling CPU's local APIC
+void lapic_init_cpu(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+/*
+ * Switches interrupt delivery to the IOAPIC and the tick to the local APIC
+ * timer. Must run after paging is enabled and timer_init() has calibrated
+ * the TSC. Returns -1 and leaves the PIC in place if there is no APIC.
+ */
+int apic_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & (1 << 9))) {
+        return -1;
+    }
+    if (acpi_init() < 0 || acpi_info.nioapics == 0) {
+        return -1;
+    }
+
+    // Hardware enable; the MSR also holds the LAPIC base the MADT reported
+    wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_ENABLE);
+
+    lapic = ioremap(acpi_info.lapic_address, PAGE_SIZE, PAGE_RW | PAGE_NOCACHE);
+    ioapic = ioremap(acpi_info.ioapics[0].address, PAGE_SIZE, PAGE_RW | PAGE_NOCACHE);
+    if (lapic == NULL || ioapic == NULL) {
+        return -1;
+    }
+    ioapic_gsi_base = acpi_info.ioapics[0].gsi_base;
+
+    lapic_init_cpu();
+    build_isa_routes();
+    ioapic_setup();
+
+    // Mask both 8259s and route everything through the IOAPIC
+    irq_set_chip(&ioapic_chip);
+
+    apic_timer_calibrate();
+    if (apic_timer_ticks != 0) {
+        uint32_t flags = irq_save();
+        irq_move(timer_vector, APIC_TIMER_VECTOR);
+        timer_vector = APIC_TIMER_VECTOR;
+        apic_timer_start();
+        irq_restore(flags);
+    }
+
+    apic_enabled = 1;
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef __APIC_H__
+#define __APIC_H__
+
+#include <stdint.h>
+
+// Local APIC register offsets
+#define LAPIC_ID            0x020
+#define LAPIC_VERSION       0x030
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV16   0x3
+
+// Interrupt command register (low half)
+#define ICR_FIXED           0x000
+#define ICR_INIT            0x500
+#define ICR_STARTUP         0x600
+#define ICR_DELIVERY_PENDING 0x1000
+#define ICR_LEVEL_ASSERT    0x4000
+
+#define IA32_APIC_BASE_MSR  0x1B
+#define IA32_APIC_BASE_ENABLE 0x800
+
+// IOAPIC indirect registers
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WIN          0x10
+#define IOAPIC_VER          0x01
+#define IOAPIC_REDTBL(n)    (0x10 + 2 * (n))
+
+#define IOAPIC_MASKED       0x10000
+#define IOAPIC_LEVEL        0x8000
+#define IOAPIC_ACTIVE_LOW   0x2000
+
+#define APIC_TIMER_VECTOR   0x40
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+extern volatile uint32_t *lapic;
+extern int apic_enabled;
+extern uint32_t apic_timer_ticks;   // Initial count for one tick at timer_hz
+
+int apic_init(void);
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_init_cpu(void);
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+void apic_timer_start(void);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * bench.c
+ *
+ * Runs every benchmark in the .data.bench section and reports to COM1.
+ */
+
+#include "bench.h"
+#include "serial.h"
+#include "timer.h"
+#include "rprintf.h"
+#include "perf.h"
+#include "sched.h"
+
+extern struct bench _start_bench[];
+extern struct bench _end_bench[];
+
+static uint32_t samples[BENCH_MAX_RUNS];
+
+static void sort_samples(uint32_t *s, uint32_t n) {
+    for (uint32_t i = 1; i < n; i++) {
+        uint32_t v = s[i];
+        uint32_t j = i;
+        while (j > 0 && s[j - 1] > v) {
+            s[j] = s[j - 1];
+            j--;
+        }
+        s[j] = v;
+    }
+}
+
+// Cycles two back-to-back bench_tsc() calls take, to subtract from every run
+static uint32_t bench_overhead(void) {
+    uint32_t best = 0xFFFFFFFF;
+    for (int i = 0; i < 32; i++) {
+        uint64_t start = bench_tsc();
+        uint64_t end = bench_tsc();
+        if ((uint32_t)(end - start) < best) {
+            best = end - start;
+        }
+    }
+    return best;
+}
+
+static void bench_run(struct bench *b, uint32_t overhead, func_ptr out) {
+    uint32_t runs = b->runs;
+    if (runs == 0 || runs > BENCH_MAX_RUNS) {
+        runs = BENCH_MAX_RUNS;
+    }
+
+    // The PMU counters are per CPU, so both reads must happen on the same
+    // one: keep this thread from being stolen while the runs are timed
+    struct thread *self = current_thread();
+    int was_pinned = self != NULL ? self->pinned : 0;
+    if (self != NULL) {
+        kthread_set_pinned(self, 1);
+    }
+
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        b->fn();
+    }
+    struct perf_hw_sample hw_start, hw_end;
+    perf_hw_read(&hw_start);
+    for (uint32_t i = 0; i < runs; i++) {
+        uint64_t start = bench_tsc();
+        b->fn();
+        uint64_t cycles = bench_tsc() - start;
+        if (cycles > 0xFFFFFFFF) {
+            cycles = 0xFFFFFFFF;
+        }
+        samples[i] = cycles > overhead ? (uint32_t)cycles - overhead : 0;
+    }
+    perf_hw_read(&hw_end);
+    if (self != NULL) {
+        kthread_set_pinned(self, was_pinned);
+    }
+    sort_samples(samples, runs);
+
+    uint32_t min = samples[0];
+    uint32_t median = samples[runs / 2];
+    uint32_t p99 = samples[(runs * 99) / 100 < runs ? (runs * 99) / 100 : runs - 1];
+    uint32_t ns = tsc_khz ? div64_32((uint64_t)median * 1000000, tsc_khz) : 0;
+
+    esp_printf(out, "BENCH %s runs=%d min=%d median=%d p99=%d ns=%d", b->name, runs,
+               min, median, p99, ns);
+    if (b->bytes != 0 && median != 0) {
+        // bytes per run / (median / tsc_khz ms) = KB/s, up to the 1000/1024 scale
+        uint32_t kbps = (div64_32((uint64_t)b->bytes * tsc_khz, median) * 1000) >> 10;
+        esp_printf(out, " kbps=%d", kbps);
+    }
+    // Hardware events per run, averaged over the timed runs
+    for (int i = 0; i < perf_hw_nr; i++) {
+        esp_printf(out, " %s=%d", perf_hw_names[perf_hw_events[i]],
+                   (uint32_t)div64_32(hw_end.count[i] - hw_start.count[i], runs));
+    }
+    esp_printf(out, "\r\n");
+}
+
+// Runs every registered benchmark; returns how many ran
+int bench_run_all(void) {
+    uint32_t overhead = bench_overhead();
+    int n = 0;
+
+    esp_printf(serial_putc, "BENCH-BEGIN tsc_khz=%d overhead=%d\r\n", tsc_khz, overhead);
+    for (struct bench *b = _start_bench; b < _end_bench; b++) {
+        bench_run(b, overhead, serial_putc);
+        n++;
+    }
+    esp_printf(serial_putc, "BENCH-END count=%d\r\n", n);
+    return n;
+}
+
+// Runs the benchmark called name, reporting to out; -1 if there is none
+int bench_run_one(const char *name, func_ptr out) {
+    for (struct bench *b = _start_bench; b < _end_bench; b++) {
+        const char *a = b->name, *n = name;
+        while (*a != '\0' && *a == *n) {
+            a++;
+            n++;
+        }
+        if (*a == '\0' && *n == '\0') {
+            bench_run(b, bench_overhead(), out);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void bench_list(func_ptr out) {
+    for (struct bench *b = _start_bench; b < _end_bench; b++) {
+        esp_printf(out, "%s\r\n", b->name);
+    }
+}
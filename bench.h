@@ -0,0 +1,56 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+/*
+ * Micro-benchmarks. BENCH(name) defines a function that performs the
+ * operation once. The harness warms it up, then times each run separately
+ * with a serialized TSC read. It reports min, median and p99 in cycles,
+ * minus the cost of the timing itself. Benchmarks live in a linker section
+ * (_start_bench to _end_bench), so any file can add one.
+ *
+ * Results go to the serial port, one line per benchmark:
+ *   BENCH <name> runs=<n> min=<cycles> median=<cycles> p99=<cycles> ns=<median ns> [kbps=<KB/s>]
+ *         [instr=<n> llc_miss=<n> ...]
+ *
+ * The trailing counts are the PMU events (perf.h) per run, averaged over
+ * the timed runs; they are only there when the CPU has a PMU.
+ */
+
+#define BENCH_WARMUP        4
+#define BENCH_RUNS          64
+#define BENCH_MAX_RUNS      256
+
+struct bench {
+    const char *name;
+    void (*fn)(void);
+    uint32_t runs;              // Timed runs
+    uint32_t bytes;             // Bytes moved per run, for a throughput figure; 0 if none
+};
+
+#define BENCH_DEFINE(_name, _runs, _bytes)                                      \
+    static void bench_fn_##_name(void);                                         \
+    struct bench bench_##_name __attribute__((section(".data.bench"), used)) = \
+        { #_name, bench_fn_##_name, _runs, _bytes };                            \
+    static void bench_fn_##_name(void)
+
+#define BENCH(_name)                        BENCH_DEFINE(_name, BENCH_RUNS, 0)
+#define BENCH_RUNS_N(_name, _runs)          BENCH_DEFINE(_name, _runs, 0)
+#define BENCH_THROUGHPUT(_name, _runs, _bytes) BENCH_DEFINE(_name, _runs, _bytes)
+
+// rdtsc that waits for every earlier instruction to finish
+static inline uint64_t bench_tsc(void) {
+    uint32_t lo, hi;
+    asm volatile("xor %%eax, %%eax\n"
+                 "cpuid\n"
+                 "rdtsc"
+                 : "=a"(lo), "=d"(hi) : : "ebx", "ecx", "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+int bench_run_all(void);
+int bench_run_one(const char *name, int (*out)(int));
+void bench_list(int (*out)(int));
+
+#endif
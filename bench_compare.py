@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+#
+# Compares the BENCH lines of a run against a stored baseline.
+#
+#   bench_compare.py <log> <baseline> [--threshold PCT] [--update]
+#
+# Both files hold lines as printed by bench.c:
+#   BENCH <name> runs=<n> min=<c> median=<c> p99=<c> ns=<ns> [kbps=<KB/s>]
+# The median cycle counts are compared. A benchmark more than PCT percent
+# slower than its baseline is a regression, and the exit status is 1. With
+# --update, or when there is no baseline yet, the log's results become
+# the baseline.
+
+import argparse
+import os
+import sys
+
+
+def parse(path):
+    results = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            words = line.split()
+            if len(words) < 2 or words[0] != "BENCH":
+                continue
+            fields = dict(w.split("=", 1) for w in words[2:] if "=" in w)
+            results[words[1]] = fields
+    return results
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("log")
+    ap.add_argument("baseline")
+    ap.add_argument("--threshold", type=float, default=10.0)
+    ap.add_argument("--update", action="store_true")
+    args = ap.parse_args()
+
+    current = parse(args.log)
+    if not current:
+        sys.exit("bench_compare: no BENCH results in %s" % args.log)
+
+    if args.update or not os.path.exists(args.baseline):
+        with open(args.baseline, "w") as out, open(args.log, errors="replace") as f:
+            out.writelines(l.strip() + "\n" for l in f if l.startswith("BENCH "))
+        print("bench_compare: baseline written to %s" % args.baseline)
+        return 0
+
+    baseline = parse(args.baseline)
+    regressions = 0
+    print("%-28s %12s %12s %8s" % ("benchmark", "baseline", "current", "change"))
+    for name, fields in current.items():
+        cur = int(fields.get("median", 0))
+        if name not in baseline:
+            print("%-28s %12s %12d %8s" % (name, "-", cur, "new"))
+            continue
+        base = int(baseline[name].get("median", 0))
+        change = (cur - base) * 100.0 / base if base else 0.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-28s %12d %12d %+7.1f%%%s" % (name, base, cur, change, flag))
+    for name in baseline:
+        if name not in current:
+            print("%-28s %12s %12s %8s" % (name, baseline[name].get("median", "-"), "-",
+                                           "missing"))
+
+    if regressions:
+        print("bench_compare: %d regression(s) above %.1f%%" % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,92 @@
+/*
+ * benchmarks.c
+ *
+ * Built-in benchmarks for the hot paths: disk reads, the FAT calls, the
+ * frame allocator, page mapping and console output. The FAT ones use
+ * whatever volume is mounted when bench_run_all() is called.
+ */
+
+#include "bench.h"
+#include "blockdev.h"
+#include "fat.h"
+#include "page.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+extern int putc(int data);
+extern struct page_directory_entry pd[1024];
+
+#define BENCH_READ_SECTORS  64
+
+static char *bench_buf;         // 64 KB, allocated by the first benchmark to need it
+
+static char *get_bench_buf(void) {
+    if (bench_buf == NULL) {
+        bench_buf = kpage_alloc(16);
+    }
+    return bench_buf;
+}
+
+BENCH(blockdev_read_1) {
+    blockdev_read(blockdev_boot(), 0, get_bench_buf(), 1);
+}
+
+BENCH_THROUGHPUT(blockdev_read_64, BENCH_RUNS, BENCH_READ_SECTORS * 512) {
+    blockdev_read(blockdev_boot(), 0, get_bench_buf(), BENCH_READ_SECTORS);
+}
+
+// Root directory lookup; the per-entry tracepoints are one branch each while tracing is off
+BENCH(fat_open_close) {
+    int fd = fatOpen("test.txt");
+    if (fd >= 0) {
+        fatClose(fd);
+    }
+}
+
+// Sequential 64 KB reads, starting over at the end of the file
+BENCH_THROUGHPUT(fat_read_64k, BENCH_RUNS, 64 * 1024) {
+    static int fd = -1;
+    if (fd < 0) {
+        fd = fatOpen("kernel");
+        if (fd < 0) {
+            return;
+        }
+    }
+    if (fatRead(fd, get_bench_buf(), 64 * 1024) < 64 * 1024) {
+        fatSeek(fd, 0);
+    }
+}
+
+BENCH(allocate_physical_pages) {
+    struct ppage *p = allocate_physical_pages(1);
+    if (p != NULL) {
+        free_physical_pages_list(p);
+    }
+}
+
+/*
+ * Maps a page of the buffer at a second address just past the ioremap
+ * window. The buffer itself sits in the direct map's large pages, where
+ * map_pages() would have nothing to do.
+ */
+BENCH(map_pages) {
+    char *buf = get_bench_buf();
+    struct ppage page;
+    page.next = NULL;
+    page.prev = NULL;
+    page.physical_addr = (void *)(virt_to_phys(buf) & ~(PAGE_SIZE - 1));
+    map_pages((void *)IOREMAP_END, &page, pd);
+}
+
+static int null_putc(int data) {
+    return data;
+}
+
+// Formatting cost alone, into a sink that drops the characters
+BENCH(esp_printf) {
+    esp_printf(null_putc, "%d %x %s %c %08x\r\n", 12345, 0xBEEF, "bench", 'x', 42);
+}
+
+BENCH(putc) {
+    putc('.');
+}
@@ -0,0 +1,206 @@
+/*
+ * blk.c
+ *
+ * Request queue and elevator shared by the block drivers. The driver
+ * supplies start(), which programs the device for a group of merged
+ * requests, and calls blk_complete() when that group is done. A device
+ * that queues commands itself (NCQ) raises q->depth to get several groups
+ * at once.
+ */
+
+#include "blk.h"
+#include "sched.h"
+#include <stddef.h>
+
+
+void blk_queue_init(struct blk_queue *q, const char *name, uint32_t max_sectors,
+                    void (*start)(struct blk_queue *, struct blk_request *),
+                    void (*poll)(struct blk_queue *)) {
+    spin_lock_init(&q->lock, name);
+    q->pending = NULL;
+    q->in_flight = 0;
+    q->depth = 1;
+    q->head_lba = 0;
+    q->max_sectors = max_sectors;
+    q->max_segments = 0xFFFFFFFF;
+    q->start = start;
+    q->poll = poll;
+    q->kick = NULL;
+    q->driver_data = NULL;
+    q->nr_submitted = q->nr_merged = q->nr_dispatched = 0;
+}
+
+// Adds req to a queued group it is adjacent to. Called with q->lock held.
+static int blk_try_merge(struct blk_queue *q, struct blk_request *req) {
+    for (struct blk_request **pp = &q->pending; *pp != NULL; pp = &(*pp)->next) {
+        struct blk_request *g = *pp;
+
+        if (g->group_count + req->count > q->max_sectors ||
+            g->group_segments + req->group_segments > q->max_segments) {
+            continue;
+        }
+        if (g->lba + g->group_count == req->lba) {
+            // Back merge: req continues the group
+            struct blk_request *tail = g;
+            while (tail->chain != NULL) {
+                tail = tail->chain;
+            }
+            tail->chain = req;
+            g->group_count += req->count;
+            g->group_segments += req->group_segments;
+            return 1;
+        }
+        if (req->lba + req->count == g->lba) {
+            // Front merge: req becomes the group head, keeping the sort order
+            req->chain = g;
+            req->group_count = req->count + g->group_count;
+            req->group_segments += g->group_segments;
+            req->next = g->next;
+            *pp = req;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void blk_insert(struct blk_queue *q, struct blk_request *req) {
+    struct blk_request **pp = &q->pending;
+    while (*pp != NULL && (*pp)->lba < req->lba) {
+        pp = &(*pp)->next;
+    }
+    req->next = *pp;
+    *pp = req;
+}
+
+// Starts groups while the device has room: each time the first one at or
+// past the end of the last transfer, wrapping around to the lowest LBA.
+static void blk_dispatch(struct blk_queue *q) {
+    int started = 0;
+
+    while (q->in_flight < q->depth && q->pending != NULL) {
+        struct blk_request **pp = &q->pending;
+        while (*pp != NULL && (*pp)->lba < q->head_lba) {
+            pp = &(*pp)->next;
+        }
+        if (*pp == NULL) {
+            pp = &q->pending;
+        }
+
+        struct blk_request *g = *pp;
+        *pp = g->next;
+        g->next = NULL;
+        q->in_flight++;
+        q->head_lba = g->lba + g->group_count;
+        q->nr_dispatched++;
+        q->start(q, g);
+        started = 1;
+    }
+    if (started && q->kick != NULL) {
+        q->kick(q);
+    }
+}
+
+// Queues req; callback runs when it completes. Returns -1 if req is too large.
+int blk_submit(struct blk_request *req, blk_callback_t callback) {
+    struct blk_queue *q = req->queue;
+
+    uint32_t offset = (uint32_t)req->buf & 4095;
+    req->group_segments = (offset + req->count * 512 + 4095) / 4096;
+    if (req->count == 0 || req->count > q->max_sectors || req->group_segments > q->max_segments) {
+        return -1;
+    }
+    req->callback = callback;
+    req->status = 0;
+    req->next = NULL;
+    req->chain = NULL;
+    req->group_count = req->count;
+
+    uint32_t flags = spin_lock_irqsave(&q->lock);
+    q->nr_submitted++;
+    if (blk_try_merge(q, req)) {
+        q->nr_merged++;
+    } else {
+        blk_insert(q, req);
+    }
+    blk_dispatch(q);
+    spin_unlock_irqrestore(&q->lock, flags);
+    return 0;
+}
+
+// Called by the driver when a started group has finished, successfully or not
+void blk_complete(struct blk_queue *q, struct blk_request *group, int status) {
+    struct blk_request *g = group;
+    uint32_t flags = spin_lock_irqsave(&q->lock);
+    q->in_flight--;
+    blk_dispatch(q);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    while (g != NULL) {
+        struct blk_request *next = g->chain;
+        g->status = status;
+        g->callback(g);
+        g = next;
+    }
+}
+
+struct blk_waiter {
+    struct wait_queue wq;
+    volatile int done;
+};
+
+static void blk_wake(struct blk_request *req) {
+    struct blk_waiter *w = (struct blk_waiter *)req->private;
+
+    spin_lock(&w->wq.lock);
+    w->done = 1;
+    wait_queue_wake_all_locked(&w->wq);
+    spin_unlock(&w->wq.lock);
+}
+
+// Synchronous read built on blk_submit(); sleeps until the data is in buf
+int blk_read(struct blk_queue *q, uint32_t lba, char *buf, uint32_t count) {
+    while (count > 0) {
+        uint32_t n = count < q->max_sectors ? count : q->max_sectors;
+        if (q->max_segments < 0x100000) {
+            // Stop where the buffer would cross into one page too many
+            uint32_t room = (q->max_segments * 4096 - ((uint32_t)buf & 4095)) / 512;
+            if (n > room) {
+                n = room;
+            }
+        }
+        struct blk_request req;
+        struct blk_waiter w;
+
+        spin_lock_init(&w.wq.lock, "blk_wait");
+        w.wq.head = NULL;
+        w.done = 0;
+        req.queue = q;
+        req.lba = lba;
+        req.count = n;
+        req.buf = buf;
+        req.private = &w;
+        if (blk_submit(&req, blk_wake) < 0) {
+            return -1;
+        }
+
+        uint32_t flags = spin_lock_irqsave(&w.wq.lock);
+        while (!w.done) {
+            if (sched_running) {
+                wait_queue_sleep_locked(&w.wq);
+            } else {
+                spin_unlock(&w.wq.lock);
+                q->poll(q);
+                spin_lock(&w.wq.lock);
+            }
+        }
+        spin_unlock_irqrestore(&w.wq.lock, flags);
+
+        if (req.status < 0) {
+            return -1;
+        }
+        lba += n;
+        buf += n * 512;
+        count -= n;
+    }
+    return 0;
+}
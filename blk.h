@@ -0,0 +1,61 @@
+#ifndef __BLK_H__
+#define __BLK_H__
+
+#include <stdint.h>
+#include "sync.h"
+
+/*
+ * Asynchronous block requests. A request is queued with blk_submit() and its
+ * callback runs once the transfer is done, usually from the disk interrupt.
+ * Pending requests are kept sorted by LBA and served in one direction
+ * (C-SCAN). A request that continues or precedes a queued one is merged
+ * into it, so the device sees one transfer for the whole run. Each queue
+ * sets its own transfer limit, max_sectors.
+ */
+
+struct blk_request;
+struct blk_queue;
+typedef void (*blk_callback_t)(struct blk_request *req);
+
+struct blk_request {
+    struct blk_queue *queue;    // Device the request is for
+    uint32_t lba;
+    uint32_t count;             // Sectors
+    char *buf;
+    int status;                 // 0 or -1, valid when the callback runs
+    blk_callback_t callback;
+    void *private;              // Owned by the submitter
+    struct blk_request *next;   // Next group in the queue (group heads only)
+    struct blk_request *chain;  // Next request merged into this group, in LBA order
+    uint32_t group_count;       // Sectors in the whole group (group heads only)
+    uint32_t group_segments;    // Pages the group's buffers touch (group heads only)
+};
+
+struct blk_queue {
+    spinlock_t lock;
+    struct blk_request *pending;    // Groups waiting, sorted by LBA
+    uint32_t in_flight;             // Groups the device is working on
+    uint32_t depth;                 // How many groups the device can take at once
+    uint32_t head_lba;              // End of the last dispatched group
+    uint32_t max_sectors;
+    uint32_t max_segments;          // Limit on pages per group, for scatter-gather DMA
+    // Starts a transfer for group; called with lock held
+    void (*start)(struct blk_queue *q, struct blk_request *group);
+    // Advances the device without interrupts, for waiting before the scheduler runs
+    void (*poll)(struct blk_queue *q);
+    // Optional: tells the device about everything start() queued in one go
+    void (*kick)(struct blk_queue *q);
+    void *driver_data;
+    uint32_t nr_submitted;
+    uint32_t nr_merged;
+    uint32_t nr_dispatched;
+};
+
+void blk_queue_init(struct blk_queue *q, const char *name, uint32_t max_sectors,
+                    void (*start)(struct blk_queue *, struct blk_request *),
+                    void (*poll)(struct blk_queue *));
+int blk_submit(struct blk_request *req, blk_callback_t callback);
+void blk_complete(struct blk_queue *q, struct blk_request *group, int status);
+int blk_read(struct blk_queue *q, uint32_t lba, char *buf, uint32_t count);
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * blockdev.c
+ *
+ * Block device registry, the ops for queue-backed disks, and MBR partitions.
+ */
+
+#include "blockdev.h"
+#include "rprintf.h"
+#include "sync.h"
+#include "perf.h"
+#include <stddef.h>
+
+extern int putc(int data);
+
+struct blockdev *blockdev_list;
+static struct blockdev **blockdev_tail = &blockdev_list;
+DEFINE_SPINLOCK(blockdev_lock);
+
+static struct blockdev partitions[BLOCKDEV_MAX_PARTITIONS];
+static int npartitions;
+
+static int name_equal(const char *a, const char *b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static void name_copy(char *dst, const char *src) {
+    int i = 0;
+    for (; i < BLOCKDEV_NAME_LEN - 1 && src[i] != '\0'; i++) {
+        dst[i] = src[i];
+    }
+    dst[i] = '\0';
+}
+
+// Devices are never removed, so the list can be walked without the lock
+void blockdev_register(struct blockdev *dev) {
+    uint32_t flags = spin_lock_irqsave(&blockdev_lock);
+    dev->next = NULL;
+    *blockdev_tail = dev;
+    blockdev_tail = &dev->next;
+    spin_unlock_irqrestore(&blockdev_lock, flags);
+}
+
+// Fills in a disk and registers it
+void blockdev_init(struct blockdev *dev, const char *name, const struct blockdev_ops *ops,
+                   uint32_t sectors, void *private) {
+    name_copy(dev->name, name);
+    dev->ops = ops;
+    dev->sectors = sectors;
+    dev->queue = NULL;
+    dev->parent = NULL;
+    dev->start = 0;
+    dev->type = 0;
+    dev->private = private;
+    blockdev_register(dev);
+}
+
+struct blockdev *blockdev_find(const char *name) {
+    for (struct blockdev *dev = blockdev_list; dev != NULL; dev = dev->next) {
+        if (name_equal(dev->name, name)) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+// First disk a driver registered; drivers probe the fastest controllers first
+struct blockdev *blockdev_boot(void) {
+    for (struct blockdev *dev = blockdev_list; dev != NULL; dev = dev->next) {
+        if (dev->parent == NULL) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+static int is_fat_type(uint8_t type) {
+    return type == MBR_TYPE_FAT12 || type == MBR_TYPE_FAT16_SMALL || type == MBR_TYPE_FAT16 ||
+           type == MBR_TYPE_FAT32 || type == MBR_TYPE_FAT32_LBA || type == MBR_TYPE_FAT16_LBA;
+}
+
+// Device to mount the root filesystem from: the boot disk's first FAT
+// partition, or the whole disk if it has no partition table
+struct blockdev *blockdev_root(void) {
+    struct blockdev *disk = blockdev_boot();
+    if (disk == NULL) {
+        return NULL;
+    }
+    for (struct blockdev *dev = blockdev_list; dev != NULL; dev = dev->next) {
+        if (dev->parent == disk && is_fat_type(dev->type)) {
+            return dev;
+        }
+    }
+    return disk;
+}
+
+// Rejects transfers that run past the end of the device
+static int blockdev_in_range(struct blockdev *dev, uint32_t lba, uint32_t count) {
+    return lba < dev->sectors && count <= dev->sectors - lba;
+}
+
+// Transfers are counted at the disk, not again for each partition they pass through
+#define blockdev_count(dev, counter, n)         \
+    do {                                        \
+        if ((dev)->parent == NULL) {            \
+            perf_count(counter, n);             \
+        }                                       \
+    } while (0)
+
+int blockdev_read(struct blockdev *dev, uint32_t lba, char *buf, uint32_t count) {
+    if (dev == NULL || !blockdev_in_range(dev, lba, count)) {
+        return -1;
+    }
+    blockdev_count(dev, PERF_SECTORS_READ, count);
+    return dev->ops->read(dev, lba, buf, count);
+}
+
+int blockdev_write(struct blockdev *dev, uint32_t lba, const char *buf, uint32_t count) {
+    if (dev == NULL || dev->ops->write == NULL || !blockdev_in_range(dev, lba, count)) {
+        return -1;
+    }
+    blockdev_count(dev, PERF_SECTORS_WRITTEN, count);
+    return dev->ops->write(dev, lba, buf, count);
+}
+
+int blockdev_flush(struct blockdev *dev) {
+    if (dev == NULL || dev->ops->flush == NULL) {
+        return 0;
+    }
+    return dev->ops->flush(dev);
+}
+
+int blockdev_submit(struct blockdev *dev, struct blk_request *req, blk_callback_t callback) {
+    if (dev == NULL || !blockdev_in_range(dev, req->lba, req->count)) {
+        return -1;
+    }
+    blockdev_count(dev, PERF_SECTORS_READ, req->count);
+    return dev->ops->submit(dev, req, callback);
+}
+
+uint32_t blockdev_queue_depth(struct blockdev *dev) {
+    if (dev == NULL || dev->ops->queue_depth == NULL) {
+        return 1;
+    }
+    return dev->ops->queue_depth(dev);
+}
+
+// Zero-copy access: NULL unless the device keeps its sectors in memory
+char *blockdev_map(struct blockdev *dev, uint32_t lba, uint32_t count) {
+    if (dev == NULL || dev->ops->map == NULL || !blockdev_in_range(dev, lba, count)) {
+        return NULL;
+    }
+    char *p = dev->ops->map(dev, lba, count);
+    if (p != NULL) {
+        blockdev_count(dev, PERF_SECTORS_MAPPED, count);
+    }
+    return p;
+}
+
+// Disks driven through a blk_queue
+
+static int queue_read(struct blockdev *dev, uint32_t lba, char *buf, uint32_t count) {
+    return blk_read(dev->queue, lba, buf, count);
+}
+
+static int queue_submit(struct blockdev *dev, struct blk_request *req, blk_callback_t callback) {
+    req->queue = dev->queue;
+    return blk_submit(req, callback);
+}
+
+static uint32_t queue_depth(struct blockdev *dev) {
+    return dev->queue->depth;
+}
+
+// None of the disk drivers write yet
+const struct blockdev_ops blk_queue_ops = {
+    .read = queue_read,
+    .write = NULL,
+    .flush = NULL,
+    .submit = queue_submit,
+    .queue_depth = queue_depth,
+    .map = NULL,
+};
+
+void blockdev_init_queue(struct blockdev *dev, const char *name, struct blk_queue *q,
+                         uint32_t sectors) {
+    blockdev_init(dev, name, &blk_queue_ops, sectors, NULL);
+    dev->queue = q;
+}
+
+// Partitions: the parent's sectors, shifted by start
+
+static int part_read(struct blockdev *dev, uint32_t lba, char *buf, uint32_t count) {
+    return blockdev_read(dev->parent, dev->start + lba, buf, count);
+}
+
+static int part_write(struct blockdev *dev, uint32_t lba, const char *buf, uint32_t count) {
+    return blockdev_write(dev->parent, dev->start + lba, buf, count);
+}
+
+static int part_flush(struct blockdev *dev) {
+    return blockdev_flush(dev->parent);
+}
+
+// The callback sees req->lba as the parent's sector
+static int part_submit(struct blockdev *dev, struct blk_request *req, blk_callback_t callback) {
+    req->lba += dev->start;
+    return blockdev_submit(dev->parent, req, callback);
+}
+
+static uint32_t part_queue_depth(struct blockdev *dev) {
+    return blockdev_queue_depth(dev->parent);
+}
+
+static char *part_map(struct blockdev *dev, uint32_t lba, uint32_t count) {
+    return blockdev_map(dev->parent, dev->start + lba, count);
+}
+
+static const struct blockdev_ops part_ops = {
+    .read = part_read,
+    .write = part_write,
+    .flush = part_flush,
+    .submit = part_submit,
+    .queue_depth = part_queue_depth,
+    .map = part_map,
+};
+
+/*
+ * Reads sector 0 of disk and registers a device for each primary partition,
+ * named after the disk ("ata0p1"). A FAT volume without a partition table
+ * also ends in 0xAA55, so the table is only trusted if every entry is
+ * plausible. Extended and GPT partitions are not followed. Returns the
+ * number of partitions added.
+ */
+int mbr_scan(struct blockdev *disk) {
+    uint8_t sector[512];
+    if (blockdev_read(disk, 0, (char *)sector, 1) < 0) {
+        return -1;
+    }
+    if (sector[MBR_SIGNATURE_OFFSET] != 0x55 || sector[MBR_SIGNATURE_OFFSET + 1] != 0xAA) {
+        return 0;
+    }
+
+    struct mbr_entry *table = (struct mbr_entry *)(sector + MBR_TABLE_OFFSET);
+    for (int i = 0; i < MBR_ENTRIES; i++) {
+        struct mbr_entry *e = &table[i];
+        if ((e->status != 0x00 && e->status != 0x80) ||
+            (e->type != MBR_TYPE_EMPTY &&
+             (e->lba_first == 0 || !blockdev_in_range(disk, e->lba_first, e->sectors)))) {
+            return 0;
+        }
+    }
+
+    int added = 0;
+    for (int i = 0; i < MBR_ENTRIES; i++) {
+        struct mbr_entry *e = &table[i];
+        if (e->type == MBR_TYPE_EMPTY || e->type == MBR_TYPE_EXTENDED ||
+            e->type == MBR_TYPE_EXTENDED_LBA || e->type == MBR_TYPE_GPT || e->sectors == 0) {
+            continue;
+        }
+        if (npartitions == BLOCKDEV_MAX_PARTITIONS) {
+            esp_printf(putc, "%s: too many partitions\r\n", disk->name);
+            break;
+        }
+
+        struct blockdev *part = &partitions[npartitions++];
+        name_copy(part->name, disk->name);
+        int len = 0;
+        while (part->name[len] != '\0') {
+            len++;
+        }
+        if (len > BLOCKDEV_NAME_LEN - 3) {
+            len = BLOCKDEV_NAME_LEN - 3;
+        }
+        part->name[len] = 'p';
+        part->name[len + 1] = '1' + i;
+        part->name[len + 2] = '\0';
+        part->ops = &part_ops;
+        part->sectors = e->sectors;
+        part->queue = disk->queue;
+        part->parent = disk;
+        part->start = e->lba_first;
+        part->type = e->type;
+        part->private = NULL;
+        blockdev_register(part);
+        esp_printf(putc, "%s: type 0x%02x, sectors %d-%d\r\n", part->name, e->type,
+                   e->lba_first, e->lba_first + e->sectors - 1);
+        added++;
+    }
+    return added;
+}
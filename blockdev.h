@@ -0,0 +1,94 @@
+#ifndef __BLOCKDEV_H__
+#define __BLOCKDEV_H__
+
+#include <stdint.h>
+#include "blk.h"
+
+/*
+ * Block devices. Nothing above the drivers touches a controller directly:
+ * the FAT code, partitions and anything stacked later (caches, RAM disks) go
+ * through a struct blockdev and its ops table. Drivers register each disk
+ * they find. mbr_scan() then adds one device per MBR partition, which
+ * forwards to the disk at an offset.
+ */
+
+#define BLOCKDEV_NAME_LEN       16
+#define BLOCKDEV_MAX_PARTITIONS 16
+
+// Master boot record layout
+#define MBR_TABLE_OFFSET        446
+#define MBR_ENTRIES             4
+#define MBR_SIGNATURE_OFFSET    510
+
+#define MBR_TYPE_EMPTY          0x00
+#define MBR_TYPE_FAT12          0x01
+#define MBR_TYPE_FAT16_SMALL    0x04
+#define MBR_TYPE_EXTENDED       0x05
+#define MBR_TYPE_FAT16          0x06
+#define MBR_TYPE_FAT32          0x0B
+#define MBR_TYPE_FAT32_LBA      0x0C
+#define MBR_TYPE_FAT16_LBA      0x0E
+#define MBR_TYPE_EXTENDED_LBA   0x0F
+#define MBR_TYPE_GPT            0xEE
+
+struct mbr_entry {
+    uint8_t status;             // 0x80 bootable, 0x00 not
+    uint8_t chs_first[3];
+    uint8_t type;
+    uint8_t chs_last[3];
+    uint32_t lba_first;
+    uint32_t sectors;
+} __attribute__((packed));
+
+struct blockdev;
+
+struct blockdev_ops {
+    int (*read)(struct blockdev *dev, uint32_t lba, char *buf, uint32_t count);
+    // NULL for read-only devices
+    int (*write)(struct blockdev *dev, uint32_t lba, const char *buf, uint32_t count);
+    // NULL when nothing is held back from the medium
+    int (*flush)(struct blockdev *dev);
+    // Queues req; its callback runs when the transfer is done
+    int (*submit)(struct blockdev *dev, struct blk_request *req, blk_callback_t callback);
+    // Requests worth keeping in flight at once
+    uint32_t (*queue_depth)(struct blockdev *dev);
+    // Pointer to the sectors themselves, for devices that are memory; else NULL
+    char *(*map)(struct blockdev *dev, uint32_t lba, uint32_t count);
+};
+
+struct blockdev {
+    char name[BLOCKDEV_NAME_LEN];
+    const struct blockdev_ops *ops;
+    uint32_t sectors;
+    struct blk_queue *queue;    // Request queue underneath, NULL if none
+    struct blockdev *parent;    // Disk a partition lives on, NULL for disks
+    uint32_t start;             // First sector on the parent
+    uint8_t type;               // MBR partition type, 0 for disks
+    void *private;              // Owned by the ops
+    struct blockdev *next;      // Registration order
+};
+
+// Every registered device; the first disk is the one we booted from
+extern struct blockdev *blockdev_list;
+// Ops for a disk driven through a blk_queue
+extern const struct blockdev_ops blk_queue_ops;
+
+void blockdev_register(struct blockdev *dev);
+void blockdev_init(struct blockdev *dev, const char *name, const struct blockdev_ops *ops,
+                   uint32_t sectors, void *private);
+void blockdev_init_queue(struct blockdev *dev, const char *name, struct blk_queue *q,
+                         uint32_t sectors);
+struct blockdev *blockdev_find(const char *name);
+struct blockdev *blockdev_boot(void);
+struct blockdev *blockdev_root(void);
+
+int blockdev_read(struct blockdev *dev, uint32_t lba, char *buf, uint32_t count);
+int blockdev_write(struct blockdev *dev, uint32_t lba, const char *buf, uint32_t count);
+int blockdev_flush(struct blockdev *dev);
+int blockdev_submit(struct blockdev *dev, struct blk_request *req, blk_callback_t callback);
+uint32_t blockdev_queue_depth(struct blockdev *dev);
+char *blockdev_map(struct blockdev *dev, uint32_t lba, uint32_t count);
+
+int mbr_scan(struct blockdev *disk);
+
+#endif
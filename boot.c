@@ -0,0 +1,70 @@
+/*
+ * boot.c
+ *
+ * Boot phase timestamps and the fast boot switch. See boot.h.
+ */
+
+#include "boot.h"
+#include "timer.h"
+#include "rprintf.h"
+
+extern int putc(int data);
+
+struct boot_mark {
+    const char *name;
+    uint64_t tsc;           // When the phase ended
+};
+
+int fast_boot;
+
+static struct boot_mark boot_marks[BOOT_MAX_PHASES];
+static int boot_nmarks;
+static int boot_has_tsc;
+static uint64_t boot_tsc_start;
+
+// First thing in main(): the closest the kernel gets to the loader's handoff
+void boot_start(void) {
+    boot_has_tsc = cpu_has_tsc();
+    if (boot_has_tsc) {
+        boot_tsc_start = rdtsc();
+    }
+}
+
+void boot_phase(const char *name) {
+    if (boot_nmarks < BOOT_MAX_PHASES) {
+        boot_marks[boot_nmarks].name = name;
+        boot_marks[boot_nmarks].tsc = boot_has_tsc ? rdtsc() : 0;
+        boot_nmarks++;
+    }
+}
+
+static uint32_t cycles_to_us(uint64_t cycles) {
+    return tsc_khz ? (uint32_t)div64_32(cycles * 1000, tsc_khz) : 0;
+}
+
+/*
+ * One line per phase, then the total:
+ *   BOOT <phase> us=<duration> at=<us since main>
+ *   BOOT-END total_us=<n> target_us=<n> <ok|over>
+ * The TSC counts from reset, so its value at main() is roughly the time the
+ * firmware and the boot loader took.
+ */
+void boot_report(void) {
+    if (!boot_has_tsc || tsc_khz == 0) {
+        esp_printf(putc, "BOOT-BEGIN no TSC, phases not timed\r\n");
+        return;
+    }
+
+    esp_printf(putc, "BOOT-BEGIN fastboot=%d before_main_ms=%d\r\n", fast_boot,
+               cycles_to_us(boot_tsc_start) / 1000);
+    uint64_t prev = boot_tsc_start;
+    for (int i = 0; i < boot_nmarks; i++) {
+        esp_printf(putc, "BOOT %-12s us=%d at=%d\r\n", boot_marks[i].name,
+                   cycles_to_us(boot_marks[i].tsc - prev),
+                   cycles_to_us(boot_marks[i].tsc - boot_tsc_start));
+        prev = boot_marks[i].tsc;
+    }
+    uint32_t total = cycles_to_us(prev - boot_tsc_start);
+    esp_printf(putc, "BOOT-END total_us=%d target_us=%d %s\r\n", total,
+               CONFIG_BOOT_TARGET_MS * 1000, total <= CONFIG_BOOT_TARGET_MS * 1000 ? "ok" : "over");
+}
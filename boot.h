@@ -0,0 +1,29 @@
+#ifndef __BOOT_H__
+#define __BOOT_H__
+
+#include <stdint.h>
+
+/*
+ * Boot-time profile. main() calls boot_phase() as each stage of bring-up
+ * finishes; boot_report() prints how long each one took, measured with the
+ * TSC from the entry to main(), and the total against the boot target.
+ * Phases can be marked before the TSC is calibrated; cycles are only turned
+ * into time when the report is printed.
+ *
+ * The "fastboot" boot option sets fast_boot: main() skips its demos and
+ * diagnostics and leaves mounting the filesystem to the first FAT call.
+ */
+
+#define BOOT_MAX_PHASES     24
+
+#ifndef CONFIG_BOOT_TARGET_MS
+#define CONFIG_BOOT_TARGET_MS 250   // main() to the shell prompt, fast boot
+#endif
+
+extern int fast_boot;
+
+void boot_start(void);
+void boot_phase(const char *name);
+void boot_report(void);
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * console.c
+ *
+ * Console multiplexing between the VGA screen (vga_putc, kernel_main.c)
+ * and the serial port.
+ */
+
+#include "console.h"
+#include "serial.h"
+
+volatile int console_targets = CONSOLE_VGA | CONSOLE_SERIAL;
+
+int putc(int data) {
+    int targets = console_targets;
+    if (targets & CONSOLE_VGA) {
+        vga_putc(data);
+    }
+    if (targets & CONSOLE_SERIAL) {
+        serial_putc(data);
+    }
+    return data;
+}
+
+void console_set_targets(int targets) {
+    console_targets = targets;
+}
@@ -0,0 +1,20 @@
+#ifndef __CONSOLE_H__
+#define __CONSOLE_H__
+
+/*
+ * The kernel console. putc() is what esp_printf() is handed nearly
+ * everywhere. It sends each character to the outputs selected in
+ * console_targets: the VGA text screen, COM1, or both. To print to one
+ * output only, pass vga_putc or serial_putc to esp_printf() instead.
+ */
+
+#define CONSOLE_VGA     0x1
+#define CONSOLE_SERIAL  0x2
+
+extern volatile int console_targets;
+
+int putc(int data);
+int vga_putc(int data);
+void console_set_targets(int targets);
+
+#endif
@@ -1,25 +1,28 @@
 #include "fat.h"
 #include "sd.h"
 #include "rprintf.h"
+#include "page.h"
+#include "sched.h"
+#include "smp.h"
+#include "trace.h"
+#include "perf.h"
 #include <stddef.h>
 
-// IMPORTANT: The FAT filesystem starts at sector 2048, not sector 0
-// Sector 0 contains the MBR with partition table
-#define PARTITION_START 2048
-
 // Global variables
+struct blockdev *fat_dev;  // Volume mounted by fatInit; sectors are relative to it
+int fat_verbose = 1;       // Print the boot sector details on mount
+static struct blockdev *fat_deferred;  // Volume to mount on first use
+static struct mutex fat_mount_lock;
 char bootSector[512];
-char fat_table[8*512];  // 8 sectors for FAT table
+char *fat_table;           // The whole first FAT, read at mount
+uint32_t fat_table_size;   // Bytes in fat_table
 struct boot_sector *bs;
 unsigned int root_sector;
 unsigned int data_region_start;
 
-// Storage for open file metadata
-struct file open_files[10];
-int num_open_files = 0;
-
 // External putc function from kernel
 extern int putc(int data);
+extern void memset(char *s, char c, unsigned int n);
 
 // Function to copy memory
 void *memcpy(void *dest, const void *src, int n) {
@@ -31,38 +34,211 @@ void *memcpy(void *dest, const void *src, int n) {
     return dest;
 }
 
-int fatInit(void) {
-    // Read boot sector from the partition start (sector 2048)
-    sd_readblock(PARTITION_START, bootSector, 1);
+/*
+ * Open file table. fd_table doubles when it fills up and fd_bitmap has a bit
+ * set for every fd in use, so a new fd is the first clear bit at or after
+ * the word fd_hint. struct file objects are carved out of kernel heap chunks
+ * and recycled through a free list.
+ */
+#define FD_INITIAL        32
+#define FD_MAX            1024
+#define FILE_CHUNK_PAGES  16
+
+static struct file *fd_initial_table[FD_INITIAL];
+static uint32_t fd_initial_bitmap[FD_INITIAL / 32];
+static struct file **fd_table = fd_initial_table;
+static uint32_t *fd_bitmap = fd_initial_bitmap;
+static int fd_capacity = FD_INITIAL;
+static int fd_hint;                // No free fd in the bitmap words below this
+DEFINE_RWLOCK(files_lock);         // Guards the fd table; readers look up fds
+
+static struct file *file_free_list;
+DEFINE_SPINLOCK(file_cache_lock);
+
+static struct file *file_alloc(void) {
+    uint32_t flags = spin_lock_irqsave(&file_cache_lock);
+    struct file *f = file_free_list;
+    if (f != NULL) {
+        file_free_list = f->next;
+    }
+    spin_unlock_irqrestore(&file_cache_lock, flags);
+
+    if (f == NULL) {
+        // Keep the first object of a new chunk and free the rest
+        struct file *chunk = kpage_alloc(FILE_CHUNK_PAGES);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        int n = FILE_CHUNK_PAGES * PAGE_SIZE / sizeof(struct file);
+        flags = spin_lock_irqsave(&file_cache_lock);
+        for (int i = 1; i < n; i++) {
+            chunk[i].next = file_free_list;
+            file_free_list = &chunk[i];
+        }
+        spin_unlock_irqrestore(&file_cache_lock, flags);
+        f = chunk;
+    }
+
+    memset((char *)f, 0, sizeof(struct file));
+    f->refcount = 1;
+    return f;
+}
+
+static void file_put(struct file *f) {
+    if (atomic_xadd(&f->refcount, -1) != 1) {
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&file_cache_lock);
+    f->next = file_free_list;
+    file_free_list = f;
+    spin_unlock_irqrestore(&file_cache_lock, flags);
+}
+
+// Returns the file behind fd with a reference held, or NULL
+static struct file *file_get(int fd) {
+    struct file *f = NULL;
+    uint32_t flags = read_lock_irqsave(&files_lock);
+    if (fd >= 0 && fd < fd_capacity && (fd_bitmap[fd / 32] & (1u << (fd % 32)))) {
+        f = fd_table[fd];
+        atomic_inc(&f->refcount);
+    }
+    read_unlock_irqrestore(&files_lock, flags);
+    return f;
+}
+
+// Doubles the fd table unless another thread already has. The allocation,
+// clearing and freeing happen outside files_lock, so readers only wait out
+// the copy and the pointer swap.
+static int fd_table_grow(int old_capacity) {
+    int capacity = old_capacity * 2;
+    if (capacity > FD_MAX) {
+        return -1;
+    }
+    uint32_t bytes = capacity * sizeof(struct file *) + capacity / 8;
+    void *mem = kpage_alloc((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (mem == NULL) {
+        return -1;
+    }
+    memset(mem, 0, bytes);
+    struct file **table = mem;
+    uint32_t *bitmap = (uint32_t *)(table + capacity);
+    void *old = NULL;
+
+    uint32_t flags = write_lock_irqsave(&files_lock);
+    if (fd_capacity == old_capacity) {
+        memcpy(table, fd_table, old_capacity * sizeof(struct file *));
+        memcpy(bitmap, fd_bitmap, old_capacity / 8);
+        if (fd_table != fd_initial_table) {
+            old = fd_table;
+        }
+        fd_table = table;
+        fd_bitmap = bitmap;
+        fd_capacity = capacity;
+        mem = NULL;
+    }
+    write_unlock_irqrestore(&files_lock, flags);
+
+    if (mem != NULL) {
+        kpage_free(mem);
+    }
+    if (old != NULL) {
+        kpage_free(old);
+    }
+    return 0;
+}
+
+// Gives f the lowest free fd, growing the table if it is full
+static int fd_install(struct file *f) {
+    for (;;) {
+        uint32_t flags = write_lock_irqsave(&files_lock);
+        int capacity = fd_capacity;
+        for (int w = fd_hint; w < capacity / 32; w++) {
+            if (fd_bitmap[w] == 0xFFFFFFFF) {
+                continue;
+            }
+            int bit;
+            asm("bsf %1, %0" : "=r"(bit) : "rm"(~fd_bitmap[w]));
+            int fd = w * 32 + bit;
+            fd_bitmap[w] |= 1u << bit;
+            fd_table[fd] = f;
+            fd_hint = w;
+            write_unlock_irqrestore(&files_lock, flags);
+            return fd;
+        }
+        fd_hint = capacity / 32;
+        write_unlock_irqrestore(&files_lock, flags);
+
+        if (fd_table_grow(capacity) < 0) {
+            return -1;
+        }
+    }
+}
+
+int fatClose(int fd) {
+    uint32_t flags = write_lock_irqsave(&files_lock);
+    if (fd < 0 || fd >= fd_capacity || !(fd_bitmap[fd / 32] & (1u << (fd % 32)))) {
+        write_unlock_irqrestore(&files_lock, flags);
+        return -1;
+    }
+    struct file *f = fd_table[fd];
+    fd_table[fd] = NULL;
+    fd_bitmap[fd / 32] &= ~(1u << (fd % 32));
+    if (fd / 32 < fd_hint) {
+        fd_hint = fd / 32;
+    }
+    write_unlock_irqrestore(&files_lock, flags);
+
+    file_put(f);  // Freed now, or when the last fatRead using it returns
+    return 0;
+}
+
+int fatInit(struct blockdev *dev) {
+    fat_deferred = NULL;
+    if (dev == NULL) {
+        esp_printf(putc, "ERROR: No device to mount\r\n");
+        return -1;
+    }
+    if (fat_verbose) {
+        esp_printf(putc, "Mounting %s\r\n", dev->name);
+    }
+
+    // Read the boot sector, the first sector of the volume
+    if (blockdev_read(dev, 0, bootSector, 1) < 0) {
+        esp_printf(putc, "ERROR: Could not read the boot sector\r\n");
+        return -1;
+    }
+    fat_dev = dev;
     
     // Point boot_sector struct to the boot sector
     bs = (struct boot_sector *)bootSector;
     
-    // Debug: print fs_type bytes
-    esp_printf(putc, "fs_type bytes: ");
-    for (int i = 0; i < 8; i++) {
-        esp_printf(putc, "%02x ", (unsigned char)bs->fs_type[i]);
-    }
-    esp_printf(putc, "\r\n");
-
-    esp_printf(putc, "fs_type chars: ");
-    for (int i = 0; i < 8; i++) {
-        char c = bs->fs_type[i];
-        if (c >= 32 && c <= 126) {
-            esp_printf(putc, "%c", c);
-        } else {
-            esp_printf(putc, "?");
+    if (fat_verbose) {
+        // Debug: print fs_type bytes
+        esp_printf(putc, "fs_type bytes: ");
+        for (int i = 0; i < 8; i++) {
+            esp_printf(putc, "%02x ", (unsigned char)bs->fs_type[i]);
         }
+        esp_printf(putc, "\r\n");
+
+        esp_printf(putc, "fs_type chars: ");
+        for (int i = 0; i < 8; i++) {
+            char c = bs->fs_type[i];
+            if (c >= 32 && c <= 126) {
+                esp_printf(putc, "%c", c);
+            } else {
+                esp_printf(putc, "?");
+            }
+        }
+        esp_printf(putc, "\r\n");
+
+        // Print boot sector info
+        esp_printf(putc, "Boot signature: 0x%x\r\n", bs->boot_signature);
+        esp_printf(putc, "Bytes per sector: %d\r\n", bs->bytes_per_sector);
+        esp_printf(putc, "Sectors per cluster: %d\r\n", bs->num_sectors_per_cluster);
+        esp_printf(putc, "Reserved sectors: %d\r\n", bs->num_reserved_sectors);
+        esp_printf(putc, "Number of FATs: %d\r\n", bs->num_fat_tables);
+        esp_printf(putc, "Sectors per FAT: %d\r\n", bs->num_sectors_per_fat);
     }
-    esp_printf(putc, "\r\n");
-    
-    // Print boot sector info
-    esp_printf(putc, "Boot signature: 0x%x\r\n", bs->boot_signature);
-    esp_printf(putc, "Bytes per sector: %d\r\n", bs->bytes_per_sector);
-    esp_printf(putc, "Sectors per cluster: %d\r\n", bs->num_sectors_per_cluster);
-    esp_printf(putc, "Reserved sectors: %d\r\n", bs->num_reserved_sectors);
-    esp_printf(putc, "Number of FATs: %d\r\n", bs->num_fat_tables);
-    esp_printf(putc, "Sectors per FAT: %d\r\n", bs->num_sectors_per_fat);
     
     // Validate boot signature (should be 0xAA55)
     if (bs->boot_signature != 0xAA55) {
@@ -84,35 +260,66 @@ int fatInit(void) {
         return -1;
     }
     
-    if (is_fat16) {
-        esp_printf(putc, "Filesystem type: FAT16\r\n");
-    } else {
-        esp_printf(putc, "Filesystem type: FAT12\r\n");
+    if (fat_verbose) {
+        esp_printf(putc, "Filesystem type: %s\r\n", is_fat16 ? "FAT16" : "FAT12");
     }
     
-    // Read FAT table from disk
-    int fat_start = PARTITION_START + bs->num_reserved_sectors;
-    int sectors_to_read = (bs->num_sectors_per_fat < 8) ? bs->num_sectors_per_fat : 8;
-    for (int i = 0; i < sectors_to_read; i++) {
-        sd_readblock(fat_start + i, fat_table + (i * 512), 1);
+    // Read the whole first FAT, which is at most 128 KB on FAT16
+    int fat_start = bs->num_reserved_sectors;
+    if (fat_table != NULL) {
+        kpage_free(fat_table);
+    }
+    fat_table_size = bs->num_sectors_per_fat * 512;
+    fat_table = kpage_alloc((fat_table_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (fat_table == NULL ||
+        blockdev_read(fat_dev, fat_start, fat_table, bs->num_sectors_per_fat) < 0) {
+        esp_printf(putc, "ERROR: Could not read the FAT\r\n");
+        fat_table_size = 0;
+        return -1;
     }
     
     // Compute root directory sector location
-    root_sector = PARTITION_START + bs->num_fat_tables * bs->num_sectors_per_fat + bs->num_reserved_sectors;
+    root_sector = bs->num_fat_tables * bs->num_sectors_per_fat + bs->num_reserved_sectors;
     
     // Compute data region start
     int root_dir_sectors = (bs->num_root_dir_entries * 32 + bs->bytes_per_sector - 1) / bs->bytes_per_sector;
     data_region_start = root_sector + root_dir_sectors;
     
-    esp_printf(putc, "Root directory at sector: %d\r\n", root_sector);
-    esp_printf(putc, "Data region starts at sector: %d\r\n", data_region_start);
+    if (fat_verbose) {
+        esp_printf(putc, "Root directory at sector: %d\r\n", root_sector);
+        esp_printf(putc, "Data region starts at sector: %d\r\n", data_region_start);
+    }
     
     return 0;  // Success
 }
 
+// Mounts dev the first time a file is looked up instead of now
+void fat_mount_deferred(struct blockdev *dev) {
+    fat_deferred = dev;
+}
+
+// Finishes a deferred mount; -1 if it fails
+static int fat_mount_pending(void) {
+    int ret = 0;
+
+    if (fat_deferred == NULL) {
+        return 0;
+    }
+    mutex_lock(&fat_mount_lock);
+    if (fat_deferred != NULL) {
+        ret = fatInit(fat_deferred);
+    }
+    mutex_unlock(&fat_mount_lock);
+    return ret;
+}
+
 int fatOpen(const char *filename) {
     char root_dir_buffer[512];
     struct root_directory_entry *entries;
+
+    if (fat_mount_pending() < 0) {
+        return -1;
+    }
     
     // Parse filename into name and extension
     char name[8];
@@ -146,30 +353,13 @@ int fatOpen(const char *filename) {
         }
     }
     
-    esp_printf(putc, "Looking for: '");
-    for (int k = 0; k < 8; k++) esp_printf(putc, "%c", name[k]);
-    esp_printf(putc, "' . '");
-    for (int k = 0; k < 3; k++) esp_printf(putc, "%c", ext[k]);
-    esp_printf(putc, "'\r\n");
-    
     // Calculate number of sectors in root directory
     int root_dir_sectors = (bs->num_root_dir_entries * 32 + bs->bytes_per_sector - 1) / bs->bytes_per_sector;
     
-    esp_printf(putc, "Searching %d sectors starting at sector %d\r\n", root_dir_sectors, root_sector);
-    
     // Search through root directory entries
     for (int sector = 0; sector < root_dir_sectors; sector++) {
-        sd_readblock(root_sector + sector, root_dir_buffer, 1);
+        blockdev_read(fat_dev, root_sector + sector, root_dir_buffer, 1);
         
-        if (sector == 0) {
-    esp_printf(putc, "\r\nFirst 128 bytes of root directory:\r\n");
-    for (int k = 0; k < 128; k++) {
-        esp_printf(putc, "%02x ", (unsigned char)root_dir_buffer[k]);
-        if ((k + 1) % 16 == 0) esp_printf(putc, "\r\n");
-    }
-    esp_printf(putc, "\r\n");
-}
-
         entries = (struct root_directory_entry *)root_dir_buffer;
         
         int entries_per_sector = bs->bytes_per_sector / 32;
@@ -177,38 +367,27 @@ int fatOpen(const char *filename) {
         for (int j = 0; j < entries_per_sector; j++) {
             // Check if entry is empty (first byte is 0x00)
             if (entries[j].file_name[0] == 0x00) {
-				esp_printf(putc, "  Entry %d: END OF DIRECTORY\r\n", j);
-				return -1;
-			}
+                esp_printf(putc, "ERROR: %s not found\r\n", filename);
+                return -1;
+            }
             
             // Check if entry is deleted (first byte is 0xE5)
             if ((unsigned char)entries[j].file_name[0] == 0xE5) {
-                esp_printf(putc, "  Entry %d: DELETED\r\n", j);
                 continue;
             }
-            
-            // Print the entry details
-            esp_printf(putc, "  Entry %d: '", j);
-            for (int k = 0; k < 8; k++) esp_printf(putc, "%c", entries[j].file_name[k]);
-            esp_printf(putc, "' . '");
-            for (int k = 0; k < 3; k++) esp_printf(putc, "%c", entries[j].file_extension[k]);
-            esp_printf(putc, "' attr=0x%02x cluster=%d size=%d\r\n", 
-                      entries[j].attribute, entries[j].cluster, entries[j].file_size);
+            TRACE(FAT_DIRENT, sector, j, entries[j].cluster);
             
             // Skip long filename entries FIRST
             if ((entries[j].attribute & 0x0F) == 0x0F) {
-                esp_printf(putc, "    -> Skipping (long filename entry)\r\n");
                 continue;
             }
             
             // Skip volume labels
             if (entries[j].attribute & 0x08) {
-                esp_printf(putc, "    -> Skipping (volume label)\r\n");
                 continue;
             }
             
             // Compare name
-            esp_printf(putc, "    -> Comparing... ");
             int name_match = 1;
             for (int k = 0; k < 8; k++) {
                 if (name[k] != entries[j].file_name[k]) {
@@ -226,21 +405,21 @@ int fatOpen(const char *filename) {
             }
             
             if (name_match && ext_match) {
-                esp_printf(putc, "MATCH!\r\n");
-                esp_printf(putc, "  Found file! Cluster: %d, Size: %d bytes\r\n", 
-                          entries[j].cluster, entries[j].file_size);
-                
-                if (num_open_files >= 10) {
+                struct file *f = file_alloc();
+                int fd = -1;
+                if (f != NULL) {
+                    memcpy(&f->rde, &entries[j], 32);
+                    f->start_cluster = entries[j].cluster;
+                    fd = fd_install(f);
+                    if (fd < 0) {
+                        file_put(f);
+                    }
+                }
+
+                if (fd < 0) {
                     esp_printf(putc, "ERROR: Too many open files\r\n");
-                    return -1;
                 }
-                
-                memcpy(&open_files[num_open_files].rde, &entries[j], 32);
-                open_files[num_open_files].start_cluster = entries[j].cluster;
-                
-                return num_open_files++;
-            } else {
-                esp_printf(putc, "no match (name=%d ext=%d)\r\n", name_match, ext_match);
+                return fd;
             }
         }
     }
@@ -249,6 +428,64 @@ int fatOpen(const char *filename) {
     return -1;
 }
 
+/*
+ * Calls fn for every file and subdirectory in the root directory, in
+ * directory order. Returns the number of entries passed to fn.
+ */
+int fat_readdir(void (*fn)(struct root_directory_entry *rde, void *ctx), void *ctx) {
+    char root_dir_buffer[512];
+    struct root_directory_entry *entries = (struct root_directory_entry *)root_dir_buffer;
+    int root_dir_sectors;
+    int entries_per_sector;
+    int n = 0;
+
+    if (fat_mount_pending() < 0 || bs == NULL) {
+        return 0;
+    }
+    root_dir_sectors = (bs->num_root_dir_entries * 32 + bs->bytes_per_sector - 1) / bs->bytes_per_sector;
+    entries_per_sector = bs->bytes_per_sector / 32;
+
+    for (int sector = 0; sector < root_dir_sectors; sector++) {
+        if (blockdev_read(fat_dev, root_sector + sector, root_dir_buffer, 1) < 0) {
+            return n;
+        }
+        for (int j = 0; j < entries_per_sector; j++) {
+            if (entries[j].file_name[0] == 0x00) {
+                return n;   // End of directory
+            }
+            if ((unsigned char)entries[j].file_name[0] == 0xE5 ||
+                (entries[j].attribute & 0x0F) == 0x0F || (entries[j].attribute & 0x08)) {
+                continue;   // Deleted, long filename or volume label
+            }
+            fn(&entries[j], ctx);
+            n++;
+        }
+    }
+    return n;
+}
+
+// Returns the size in bytes of an open file
+uint32_t fatSize(int fd) {
+    struct file *f = file_get(fd);
+    if (f == NULL) {
+        return 0;
+    }
+    uint32_t size = f->rde.file_size;
+    file_put(f);
+    return size;
+}
+
+// Copies out the directory entry of an open file
+int fatStat(int fd, struct root_directory_entry *rde) {
+    struct file *f = file_get(fd);
+    if (f == NULL) {
+        return -1;
+    }
+    memcpy(rde, &f->rde, sizeof(*rde));
+    file_put(f);
+    return 0;
+}
+
 // Helper function to get next cluster from FAT
 uint16_t get_next_cluster(uint16_t current_cluster) {
     uint16_t next_cluster;
@@ -265,6 +502,9 @@ uint16_t get_next_cluster(uint16_t current_cluster) {
     if (is_fat16) {
         // FAT16: each entry is 2 bytes
         uint16_t *fat16 = (uint16_t *)fat_table;
+        if ((uint32_t)current_cluster * 2 + 2 > fat_table_size) {
+            return 0xFFFF;
+        }
         next_cluster = fat16[current_cluster];
         
         // Check for end of chain
@@ -274,6 +514,9 @@ uint16_t get_next_cluster(uint16_t current_cluster) {
     } else {
         // FAT12: each entry is 12 bits
         int fat_offset = current_cluster + (current_cluster / 2);
+        if ((uint32_t)fat_offset + 2 > fat_table_size) {
+            return 0xFFFF;
+        }
         unsigned char *fat_ptr = (unsigned char *)&fat_table[fat_offset];
         
         if (current_cluster & 1) {
@@ -290,57 +533,446 @@ uint16_t get_next_cluster(uint16_t current_cluster) {
         }
     }
     
+    TRACE(FAT_CLUSTER, current_cluster, next_cluster, 0);
     return next_cluster;
 }
 
+/*
+ * Refills the readahead window starting at the sector that holds f->pos.
+ * The window starts at one cluster and doubles, up to FAT_RA_MAX_SECTORS,
+ * for as long as each fill picks up where the last one ended. A fill covers
+ * physically contiguous clusters only, so it is always a single disk
+ * request. On a device that is memory (a RAM disk) the window points into
+ * the device instead, and nothing is copied.
+ */
+static int file_fill(struct file *f) {
+    uint32_t spc = bs->num_sectors_per_cluster;
+    uint32_t csize = spc * SECTOR_SIZE;
+    uint32_t pos = f->pos & ~(SECTOR_SIZE - 1);
+
+    // Walk the chain from the cached cluster, or from the start after a seek back
+    if (f->cur_cluster == 0 || pos < f->cur_cluster_pos) {
+        f->cur_cluster = f->start_cluster;
+        f->cur_cluster_pos = 0;
+    }
+    while (pos >= f->cur_cluster_pos + csize) {
+        uint16_t next = get_next_cluster(f->cur_cluster);
+        if (next == 0xFFFF || next < 2) {
+            return -1;
+        }
+        f->cur_cluster = next;
+        f->cur_cluster_pos += csize;
+    }
+    if (f->cur_cluster < 2) {
+        return -1;
+    }
+
+    if (f->ra_len != 0 && pos == f->ra_pos + f->ra_len) {
+        f->ra_window *= 2;
+    } else {
+        f->ra_window = spc;
+    }
+    if (f->ra_window > FAT_RA_MAX_SECTORS) {
+        f->ra_window = FAT_RA_MAX_SECTORS;
+    }
+
+    uint32_t skip = (pos - f->cur_cluster_pos) / SECTOR_SIZE;
+    uint32_t sector = data_region_start + (f->cur_cluster - 2) * spc + skip;
+    uint32_t count = spc - skip;
+    uint16_t cluster = f->cur_cluster;
+    while (count < f->ra_window) {
+        uint16_t next = get_next_cluster(cluster);
+        if (next != cluster + 1) {
+            break;
+        }
+        cluster = next;
+        count += spc;
+    }
+    if (count > f->ra_window) {
+        count = f->ra_window;
+    }
+
+    f->ra_data = blockdev_map(fat_dev, sector, count);
+    if (f->ra_data == NULL) {
+        if (blockdev_read(fat_dev, sector, f->ra_buf, count) < 0) {
+            f->ra_len = 0;
+            return -1;
+        }
+        f->ra_data = f->ra_buf;
+    }
+    f->ra_pos = pos;
+    f->ra_len = count * SECTOR_SIZE;
+    return 0;
+}
+
+// Reads up to num_bytes from the file position, which is then advanced
 int fatRead(int fd, void *buffer, int num_bytes) {
-    if (fd < 0 || fd >= num_open_files) {
+    struct file *f = file_get(fd);
+    if (f == NULL) {
         esp_printf(putc, "ERROR: Invalid file descriptor\r\n");
         return -1;
     }
-    
-    struct file *f = &open_files[fd];
+
+    mutex_lock(&f->lock);
     uint32_t file_size = f->rde.file_size;
+    uint32_t left = f->pos < file_size ? file_size - f->pos : 0;
     
-    // Don't read more than file size
-    if (num_bytes > file_size) {
-        num_bytes = file_size;
+    // Don't read past the end of the file
+    if (num_bytes < 0) {
+        num_bytes = 0;
+    }
+    if ((uint32_t)num_bytes > left) {
+        num_bytes = left;
     }
     
-    esp_printf(putc, "Reading %d bytes from file (size: %d)\r\n", num_bytes, file_size);
+    TRACE(FAT_READ, fd, num_bytes, file_size);
     
     char *buf = (char *)buffer;
     int bytes_read = 0;
-    uint16_t current_cluster = f->start_cluster;
-    char cluster_buffer[512 * 4];  // Buffer for full cluster
     
-    while (bytes_read < num_bytes && current_cluster != 0xFFFF && current_cluster >= 2) {
-        // Convert cluster number to sector number
-        uint32_t sector = data_region_start + (current_cluster - 2) * bs->num_sectors_per_cluster;
-        
-        esp_printf(putc, "Reading cluster %d at sector %d\r\n", current_cluster, sector);
-        
-        // Read all sectors in this cluster
-        for (int i = 0; i < bs->num_sectors_per_cluster; i++) {
-            sd_readblock(sector + i, cluster_buffer + (i * 512), 1);
-        }
-        
-        // Calculate bytes to copy from this cluster
-        int cluster_size = bs->num_sectors_per_cluster * 512;
-        int bytes_to_copy = cluster_size;
-        if (bytes_read + bytes_to_copy > num_bytes) {
-            bytes_to_copy = num_bytes - bytes_read;
+    while (bytes_read < num_bytes) {
+        // Copy whatever the read-ahead window already holds
+        if (f->pos >= f->ra_pos && f->pos < f->ra_pos + f->ra_len) {
+            int bytes_to_copy = f->ra_pos + f->ra_len - f->pos;
+            if (bytes_to_copy > num_bytes - bytes_read) {
+                bytes_to_copy = num_bytes - bytes_read;
+            }
+            TRACE(RA_HIT, fd, f->pos, bytes_to_copy);
+            perf_count(PERF_RA_HITS, 1);
+            memcpy(buf + bytes_read, f->ra_data + (f->pos - f->ra_pos), bytes_to_copy);
+            bytes_read += bytes_to_copy;
+            f->pos += bytes_to_copy;
+            continue;
         }
-        
-        memcpy(buf + bytes_read, cluster_buffer, bytes_to_copy);
-        bytes_read += bytes_to_copy;
-        
-        // Get next cluster if needed
-        if (bytes_read < num_bytes) {
-            current_cluster = get_next_cluster(current_cluster);
+        TRACE(RA_MISS, fd, f->pos, f->ra_window);
+        perf_count(PERF_RA_MISSES, 1);
+        if (file_fill(f) < 0) {
+            break;
         }
     }
-    
-    esp_printf(putc, "Read %d bytes total\r\n", bytes_read);
+    mutex_unlock(&f->lock);
+    file_put(f);
     return bytes_read;
 }
+
+// Sets the file position for the next fatRead
+int fatSeek(int fd, uint32_t offset) {
+    struct file *f = file_get(fd);
+    if (f == NULL) {
+        return -1;
+    }
+    mutex_lock(&f->lock);
+    f->pos = offset;
+    mutex_unlock(&f->lock);
+    file_put(f);
+    return 0;
+}
+
+/*
+ * Memory-mapped files
+ *
+ * fat_mmap() only reserves a range of virtual addresses. Pages are filled in
+ * by fat_mmap_fault(), which is called from the page fault handler the first
+ * time each page is touched. Filled frames live in a small page cache keyed
+ * by the on-disk location of the page, so read-only mappings of the same
+ * file data share one frame.
+ */
+
+#define MMAP_MAX_MAPPINGS 16
+#define MMAP_CACHE_FRAMES 64
+
+extern struct page_directory_entry pd[1024];
+
+struct fat_mapping {
+    int in_use;
+    uint32_t vaddr;          // Page-aligned start of the mapping
+    uint32_t npages;
+    uint32_t file_offset;    // Page-aligned file offset that vaddr maps
+    uint32_t file_size;
+    uint16_t start_cluster;
+};
+
+struct mmap_frame {
+    struct ppage *frame;     // NULL if the slot is free
+    uint16_t cluster;        // Cluster holding the first byte of the page
+    uint32_t cluster_offset; // Byte offset of the page within that cluster
+    int refcount;            // Number of mapped pages using this frame
+};
+
+struct fat_mapping mappings[MMAP_MAX_MAPPINGS];
+struct mmap_frame mmap_cache[MMAP_CACHE_FRAMES];
+
+// Guards mappings[] and mmap_cache[]; held across the disk reads of a fault
+static struct mutex mmap_lock;
+
+static uint32_t cluster_bytes(void) {
+    return bs->num_sectors_per_cluster * bs->bytes_per_sector;
+}
+
+// Finds a free range of npages in the mmap window (first fit).
+static uint32_t mmap_reserve(uint32_t npages) {
+    uint32_t start = MMAP_BASE;
+    int moved = 1;
+
+    while (moved) {
+        moved = 0;
+        for (int i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+            if (!mappings[i].in_use) {
+                continue;
+            }
+            uint32_t end = mappings[i].vaddr + mappings[i].npages * PAGE_SIZE;
+            if (start < end && mappings[i].vaddr < start + npages * PAGE_SIZE) {
+                start = end;
+                moved = 1;
+            }
+        }
+    }
+    if (start + npages * PAGE_SIZE > MMAP_END || start + npages * PAGE_SIZE < start) {
+        return 0;
+    }
+    return start;
+}
+
+static void *mmap_locked(int fd, uint32_t offset, uint32_t len) {
+    struct file *f = len != 0 ? file_get(fd) : NULL;
+    if (f == NULL) {
+        return NULL;
+    }
+    uint32_t file_size = f->rde.file_size;
+    uint32_t start_cluster = f->start_cluster;
+    file_put(f);
+
+    if (offset >= file_size) {
+        return NULL;
+    }
+    if (len > file_size - offset) {
+        len = file_size - offset;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        if (!mappings[i].in_use) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        return NULL;
+    }
+
+    uint32_t page_offset = offset & (PAGE_SIZE - 1);
+    uint32_t npages = (page_offset + len + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t vaddr = mmap_reserve(npages);
+    if (vaddr == 0) {
+        return NULL;
+    }
+
+    mappings[slot].in_use = 1;
+    mappings[slot].vaddr = vaddr;
+    mappings[slot].npages = npages;
+    mappings[slot].file_offset = offset - page_offset;
+    mappings[slot].file_size = file_size;
+    mappings[slot].start_cluster = start_cluster;
+
+    return (void *)(vaddr + page_offset);
+}
+
+void *fat_mmap(int fd, uint32_t offset, uint32_t len) {
+    mutex_lock(&mmap_lock);
+    void *addr = mmap_locked(fd, offset, len);
+    mutex_unlock(&mmap_lock);
+    return addr;
+}
+
+// Looks up the frame caching the page at (cluster, cluster_offset).
+static struct mmap_frame *mmap_cache_lookup(uint16_t cluster, uint32_t cluster_offset) {
+    for (int i = 0; i < MMAP_CACHE_FRAMES; i++) {
+        if (mmap_cache[i].frame != NULL &&
+            mmap_cache[i].cluster == cluster &&
+            mmap_cache[i].cluster_offset == cluster_offset) {
+            return &mmap_cache[i];
+        }
+    }
+    return NULL;
+}
+
+// Gets a free cache slot, evicting an unreferenced frame if necessary.
+static struct mmap_frame *mmap_cache_slot(void) {
+    for (int i = 0; i < MMAP_CACHE_FRAMES; i++) {
+        if (mmap_cache[i].frame == NULL) {
+            return &mmap_cache[i];
+        }
+    }
+    for (int i = 0; i < MMAP_CACHE_FRAMES; i++) {
+        if (mmap_cache[i].refcount == 0) {
+            free_physical_pages_list(mmap_cache[i].frame);
+            mmap_cache[i].frame = NULL;
+            return &mmap_cache[i];
+        }
+    }
+    return NULL;
+}
+
+// Reads one page of file data, starting at file_off, into the page at vaddr.
+static void mmap_fill_page(struct fat_mapping *m, uint32_t file_off, uint16_t cluster, char *vaddr) {
+    uint32_t csize = cluster_bytes();
+    uint32_t cluster_off = file_off % csize;
+    uint32_t filled = 0;
+
+    while (filled < PAGE_SIZE && file_off + filled < m->file_size &&
+           cluster != 0xFFFF && cluster >= 2) {
+        uint32_t chunk = csize - cluster_off;
+        if (chunk > PAGE_SIZE - filled) {
+            chunk = PAGE_SIZE - filled;
+        }
+        uint32_t sector = data_region_start + (cluster - 2) * bs->num_sectors_per_cluster
+                          + cluster_off / bs->bytes_per_sector;
+        blockdev_read(fat_dev, sector, vaddr + filled, chunk / bs->bytes_per_sector);
+        filled += chunk;
+        cluster_off = 0;
+        cluster = get_next_cluster(cluster);
+    }
+
+    // Zero whatever lies past the end of the file
+    uint32_t valid = (file_off + PAGE_SIZE > m->file_size) ? m->file_size - file_off : PAGE_SIZE;
+    for (uint32_t i = valid; i < PAGE_SIZE; i++) {
+        vaddr[i] = 0;
+    }
+}
+
+/*
+ * Called by the page fault handler. Returns 0 if the fault was resolved by
+ * mapping in a page of a memory-mapped file, -1 otherwise.
+ */
+static int mmap_fault_locked(uint32_t addr) {
+    struct fat_mapping *m = NULL;
+    for (int i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        if (mappings[i].in_use && addr >= mappings[i].vaddr &&
+            addr < mappings[i].vaddr + mappings[i].npages * PAGE_SIZE) {
+            m = &mappings[i];
+            break;
+        }
+    }
+    if (m == NULL) {
+        return -1;
+    }
+
+    uint32_t page_vaddr = addr & ~(PAGE_SIZE - 1);
+    struct page *pte = get_pte(pd, page_vaddr);
+    if (pte != NULL && pte->present) {
+        return 0;   // Another CPU filled it while we waited for mmap_lock
+    }
+
+    // Walk the cluster chain up to the cluster holding this page
+    uint32_t file_off = m->file_offset + (page_vaddr - m->vaddr);
+    uint32_t csize = cluster_bytes();
+    uint16_t cluster = m->start_cluster;
+    for (uint32_t n = file_off / csize; n > 0 && cluster != 0xFFFF; n--) {
+        cluster = get_next_cluster(cluster);
+    }
+    if (cluster == 0xFFFF || cluster < 2) {
+        return -1;
+    }
+    uint32_t cluster_off = file_off % csize;
+
+    struct mmap_frame *cf = mmap_cache_lookup(cluster, cluster_off);
+    if (cf == NULL) {
+        cf = mmap_cache_slot();
+        if (cf == NULL) {
+            return -1;
+        }
+        struct ppage *frame = allocate_physical_pages(1);
+        if (frame == NULL) {
+            return -1;
+        }
+        cf->frame = frame;
+        cf->cluster = cluster;
+        cf->cluster_offset = cluster_off;
+        cf->refcount = 0;
+
+        // Fill through the direct map so no other CPU sees a partly read
+        // page, then map it read-only below
+        mmap_fill_page(m, file_off, cluster, phys_to_virt((uint32_t)frame->physical_addr));
+    }
+
+    cf->refcount++;
+    map_page(pd, page_vaddr, (uint32_t)cf->frame->physical_addr, 0);
+    return 0;
+}
+
+int fat_mmap_fault(uint32_t addr) {
+    mutex_lock(&mmap_lock);
+    int ret = mmap_fault_locked(addr);
+    mutex_unlock(&mmap_lock);
+    return ret;
+}
+
+static int munmap_locked(void *addr) {
+    uint32_t vaddr = (uint32_t)addr & ~(PAGE_SIZE - 1);
+
+    for (int i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        struct fat_mapping *m = &mappings[i];
+        if (!m->in_use || m->vaddr != vaddr) {
+            continue;
+        }
+        for (uint32_t p = 0; p < m->npages; p++) {
+            struct page *pte = get_pte(pd, vaddr + p * PAGE_SIZE);
+            if (pte == NULL || !pte->present) {
+                continue;
+            }
+            uint32_t paddr = pte->frame << 12;
+            for (int j = 0; j < MMAP_CACHE_FRAMES; j++) {
+                if (mmap_cache[j].frame != NULL &&
+                    (uint32_t)mmap_cache[j].frame->physical_addr == paddr) {
+                    mmap_cache[j].refcount--;
+                    break;
+                }
+            }
+            unmap_page(pd, vaddr + p * PAGE_SIZE);
+        }
+        m->in_use = 0;
+        tlb_shootdown();
+        return 0;
+    }
+    return -1;
+}
+
+int fat_munmap(void *addr) {
+    mutex_lock(&mmap_lock);
+    int ret = munmap_locked(addr);
+    mutex_unlock(&mmap_lock);
+    return ret;
+}
+
+/*
+ * Forgets cached file data so the next reads go to the disk: every open
+ * file's readahead window and every mmap cache frame no mapping is using.
+ * Returns the number of frames freed.
+ */
+int fat_drop_caches(void) {
+    int freed = 0;
+
+    for (int fd = 0; fd < fd_capacity; fd++) {
+        struct file *f = file_get(fd);
+        if (f == NULL) {
+            continue;
+        }
+        mutex_lock(&f->lock);
+        f->ra_len = 0;
+        mutex_unlock(&f->lock);
+        file_put(f);
+    }
+
+    mutex_lock(&mmap_lock);
+    for (int i = 0; i < MMAP_CACHE_FRAMES; i++) {
+        if (mmap_cache[i].frame != NULL && mmap_cache[i].refcount == 0) {
+            free_physical_pages_list(mmap_cache[i].frame);
+            mmap_cache[i].frame = NULL;
+            freed++;
+        }
+    }
+    mutex_unlock(&mmap_lock);
+
+    blockdev_flush(fat_dev);
+    return freed;
+}
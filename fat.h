@@ -2,6 +2,8 @@
 #define __FAT_H__
 
 #include <stdint.h>
+#include "sched.h"
+#include "blockdev.h"
 
 #define CLUSTER_SIZE 4096
 #define SECTORS_PER_CLUSTER (CLUSTER_SIZE/SECTOR_SIZE)
@@ -62,19 +64,45 @@ struct root_directory_entry {
     uint32_t file_size;
 } __attribute__((packed));
 
+#define FAT_RA_MAX_SECTORS 16   // Largest read-ahead window (8 KB)
+
 /*
- * Stores info about an open file
+ * Stores info about an open file. The fd table holds one reference and
+ * every fatRead/fatSize/fat_mmap call holds another while it runs.
  */
 struct file {
-    struct file *next;
-    struct file *prev;
+    struct file *next;             // Free list link while the struct is unused
     struct root_directory_entry rde;
     uint32_t start_cluster;
+    volatile uint32_t refcount;
+    struct mutex lock;             // Serializes reads through this file
+    uint32_t pos;                  // File offset of the next fatRead
+    uint16_t cur_cluster;          // Cluster holding pos, 0 if not looked up yet
+    uint32_t cur_cluster_pos;      // File offset of the start of cur_cluster
+    char *ra_data;                 // The readahead data: ra_buf, or the device's own memory
+    uint32_t ra_pos;               // File offset of the data in ra_data
+    uint32_t ra_len;               // Bytes valid in ra_data
+    uint32_t ra_window;            // Sectors to read next; doubles while reads are sequential
+    char ra_buf[FAT_RA_MAX_SECTORS * 512];
 };
 
+// Volume fatInit() mounted last
+extern struct blockdev *fat_dev;
+extern int fat_verbose;
+
 // Function declarations
-int fatInit(void);
+int fatInit(struct blockdev *dev);
+void fat_mount_deferred(struct blockdev *dev);
 int fatOpen(const char *filename);
 int fatRead(int fd, void *buffer, int num_bytes);
+int fatSeek(int fd, uint32_t offset);
+int fatClose(int fd);
+uint32_t fatSize(int fd);
+int fatStat(int fd, struct root_directory_entry *rde);
+int fat_readdir(void (*fn)(struct root_directory_entry *rde, void *ctx), void *ctx);
+int fat_drop_caches(void);
+void *fat_mmap(int fd, uint32_t offset, uint32_t len);
+int fat_munmap(void *addr);
+int fat_mmap_fault(uint32_t addr);
 
 #endif
@@ -14,7 +14,7 @@ void test_fat_filesystem() {
     
     // Initialize FAT filesystem
     esp_printf(putc, "Initializing FAT filesystem...\r\n");
-    if (fatInit() != 0) {
+    if (fatInit(blockdev_root()) != 0) {
         esp_printf(putc, "ERROR: FAT init failed\r\n");
         return;
     }
@@ -41,6 +41,7 @@ void test_fat_filesystem() {
     } else {
         esp_printf(putc, "ERROR: Read failed\r\n");
     }
+    fatClose(fd);
     
     esp_printf(putc, "\r\n=== Test Complete ===\r\n");
 }
@@ -21,49 +21,21 @@
 
 #include <stdint.h>
 #include "interrupt.h"
+#include "fat.h"
+#include "sched.h"
+#include "page.h"
+#include "proc.h"
+#include "syscall.h"
+#include "apic.h"
+#include "smp.h"
+#include "trace.h"
+#include "perf.h"
+#include "rprintf.h"
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
 struct tss_entry tss_ent;
 
-// Keyboard scancode to ASCII mapping
-unsigned char keyboard_map[128] = {
-   0,  27, '1', '2', '3', '4', '5', '6', '7', '8',
- '9', '0', '-', '=', '\b',
- '\t',
- 'q', 'w', 'e', 'r',
- 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
-   0,
- 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',
-'\'', '`',   0,
-'\\', 'z', 'x', 'c', 'v', 'b', 'n',
- 'm', ',', '.', '/',   0,
- '*',
-   0,
- ' ',
-   0,
-   0,   0,   0,   0,   0,   0,   0,   0,  
-   0,
-   0,
-   0,
-   0,
-   0,
- '-',
-   0,
-   0,  
-   0,
- '+',
-   0,
-   0,
-   0,
-   0,
-   0,
-   0,   0,   0,  
-   0,
-   0,
-   0,
-};
-
 // External reference to putc from kernel_main.c
 extern int putc(int data);
 
@@ -197,6 +169,22 @@ struct gdt_entry_bits gdt[] = {{
     .big = 0, //should leave zero according to manuals. No effect
     .gran = 0, //so that our computed GDT limit is in bytes, not pages
 //    .base_high = ((uint32_t)(&tss_ent) & 0xFF000000)>>24, //isolate top byte.
+},{ // Per-CPU data descriptor for %fs; each CPU's copy is based at its struct cpu
+    .limit_low = 0xffff,
+    .base_low = 0,
+    .accessed = 0,
+    .read_write = 1,
+    .conforming_expand_down = 0,
+    .code = 0,
+    .always_1 = 1,
+    .DPL = 0,
+    .present = 1,
+    .limit_high = 0xf,
+    .available = 0,
+    .always_0 = 0,
+    .big = 1,
+    .gran = 1,
+    .base_high = 0
 }
 };
 
@@ -263,6 +251,22 @@ void write_tss(struct gdt_entry_bits *g) {
 
 
 
+// Set by syscall_init() once the sysenter MSRs are programmed
+int sysenter_enabled = 0;
+
+/*
+ * Sets the stack the CPU switches to when entering the kernel from ring 3,
+ * through either an interrupt gate or sysenter.
+ */
+void tss_set_kernel_stack(uint32_t esp0) {
+    this_cpu()->tss.esp0 = esp0;
+    if (sysenter_enabled) {
+        wrmsr(MSR_SYSENTER_ESP, esp0);
+    }
+}
+
+
+
 void PIC_sendEOI(unsigned char irq) {
 	if(irq >= 8) {
 		outb(PIC_2_COMMAND,PIC_EOI);
@@ -306,158 +310,256 @@ void idt_flush(struct idt_ptr *idt){
 }
 
 
-__attribute__((interrupt)) void divide_error_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
-}
+/*
+ * Interrupt dispatch
+ *
+ * Every IDT entry except the system call gate points at a stub in
+ * src/isr.s, which saves the registers as a struct regs and calls
+ * irq_dispatch(). Handlers are registered per vector with irq_register() and
+ * chained, so several devices can share one line; each handler returns
+ * IRQ_HANDLED if its device raised the interrupt.
+ */
 
-__attribute__((interrupt)) void debug_exception_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+struct irq_action {
+    irq_handler_t fn;
+    void *ctx;
+    struct irq_action *next;
+};
 
-__attribute__((interrupt)) void breakpoint_exception_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+#define IRQ_MAX_ACTIONS 64
+struct irq_action irq_action_pool[IRQ_MAX_ACTIONS];
+struct irq_action *irq_actions[IDT_SIZE];
+
+static const char *exception_names[32] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow",
+    "bound range exceeded", "invalid opcode", "device not available",
+    "double fault", "coprocessor segment overrun", "invalid TSS",
+    "segment not present", "stack fault", "general protection fault",
+    "page fault", "reserved", "x87 floating point", "alignment check",
+    "machine check", "SIMD floating point", "virtualization",
+    "control protection", "reserved", "reserved", "reserved", "reserved",
+    "reserved", "reserved", "hypervisor injection", "VMM communication",
+    "security", "reserved",
+};
 
-__attribute__((interrupt)) void overflow_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+/*
+ * Interrupt controller operations. The 8259 pair is used until apic_init()
+ * switches to the IOAPIC.
+ */
+static void pic_mask(int irq) {
+    IRQ_set_mask(irq);
 }
 
-__attribute__((interrupt)) void bound_check_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+static void pic_unmask(int irq) {
+    IRQ_clear_mask(irq);
 }
 
-__attribute__((interrupt)) void invalid_opcode_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+static void pic_eoi(uint32_t vector) {
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + 16) {
+        PIC_sendEOI(vector - IRQ_BASE);
+    }
 }
 
-__attribute__((interrupt)) void coprocessor_not_available_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+struct irq_chip pic_chip = {
+    .name = "8259 PIC",
+    .mask = pic_mask,
+    .unmask = pic_unmask,
+    .eoi = pic_eoi,
+};
 
-__attribute__((interrupt)) void double_fault_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+struct irq_chip *irq_chip = &pic_chip;
 
+/*
+ * Switches to another interrupt controller. Every ISA line that has a
+ * handler is unmasked on the new controller, which must already route line n
+ * to vector IRQ_BASE + n.
+ */
+void irq_set_chip(struct irq_chip *chip) {
+    uint32_t flags = irq_save();
 
-__attribute__((interrupt)) void coprocessor_segment_overrun_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+    for (int irq = 0; irq < 16; irq++) {
+        irq_chip->mask(irq);
+    }
+    irq_chip = chip;
+    for (int irq = 0; irq < 16; irq++) {
+        if (irq_actions[IRQ_BASE + irq] != NULL) {
+            irq_chip->unmask(irq);
+        }
+    }
+    irq_restore(flags);
 }
 
+/*
+ * Adds fn to the chain of handlers for vector. Registering the first
+ * handler for a PIC line unmasks it. Returns -1 if no slots are left.
+ */
+int irq_register(uint8_t vector, irq_handler_t fn, void *ctx) {
+    struct irq_action *action = NULL;
+    for (int i = 0; i < IRQ_MAX_ACTIONS; i++) {
+        if (irq_action_pool[i].fn == NULL) {
+            action = &irq_action_pool[i];
+            break;
+        }
+    }
+    if (action == NULL) {
+        return -1;
+    }
 
-__attribute__((interrupt)) void invalid_tss_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
-}
+    uint32_t flags = irq_save();
+    action->fn = fn;
+    action->ctx = ctx;
+    action->next = NULL;
 
+    struct irq_action **pp = &irq_actions[vector];
+    while (*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    *pp = action;
 
-__attribute__((interrupt)) void segment_not_present_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + 16 && pp == &irq_actions[vector]) {
+        irq_chip->unmask(vector - IRQ_BASE);
+    }
+    irq_restore(flags);
+    return 0;
 }
 
+void irq_unregister(uint8_t vector, irq_handler_t fn, void *ctx) {
+    uint32_t flags = irq_save();
 
-__attribute__((interrupt)) void stack_exception_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-//    while(1);
+    for (struct irq_action **pp = &irq_actions[vector]; *pp != NULL; pp = &(*pp)->next) {
+        struct irq_action *action = *pp;
+        if (action->fn == fn && action->ctx == ctx) {
+            *pp = action->next;
+            action->fn = NULL;
+            break;
+        }
+    }
+    if (irq_actions[vector] == NULL && vector >= IRQ_BASE && vector < IRQ_BASE + 16) {
+        irq_chip->mask(vector - IRQ_BASE);
+    }
+    irq_restore(flags);
 }
 
+/*
+ * Moves every handler registered on one vector to another, masking the old
+ * ISA line. Used to hand the system tick from the PIT to the APIC timer.
+ */
+void irq_move(uint8_t from, uint8_t to) {
+    uint32_t flags = irq_save();
+    struct irq_action *chain = irq_actions[from];
 
-//__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame)
-void general_protection_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
+    irq_actions[from] = NULL;
+    if (from >= IRQ_BASE && from < IRQ_BASE + 16) {
+        irq_chip->mask(from - IRQ_BASE);
+    }
+
+    struct irq_action **pp = &irq_actions[to];
+    while (*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    *pp = chain;
+    if (to >= IRQ_BASE && to < IRQ_BASE + 16 && chain != NULL) {
+        irq_chip->unmask(to - IRQ_BASE);
+    }
+    irq_restore(flags);
 }
-//void page_fault_handler(struct interrupt_frame* frame)
-void page_fault_handler(struct process_context_with_error* ctx)
-{
-    asm("cli");
-    while(1);
+
+// Interrupts taken on vector, summed over the CPUs' own counts
+uint32_t irq_get_count(uint8_t vector) {
+    uint32_t total = 0;
+    for (int c = 0; c < ncpus; c++) {
+        total += cpus[c].irq_counts[vector];
+    }
+    return total;
 }
 
+// A spurious IRQ 7 or 15 has no bit set in the PIC's in-service register
+static int pic_spurious(int irq) {
+    uint16_t port = (irq == 7) ? PIC_1_COMMAND : PIC_2_COMMAND;
 
-__attribute__((interrupt)) void coprocessor_error_handler(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
+    outb(port, 0x0B);  // OCW3: read ISR
+    if (inb(port) & 0x80) {
+        return 0;
+    }
+    if (irq == 15) {
+        outb(PIC_1_COMMAND, PIC_EOI);  // The master did see the cascade
+    }
+    return 1;
 }
 
-__attribute__((interrupt)) void stub_isr(struct interrupt_frame* frame)
-{
-    asm("cli");
-    /* do something */
-    while(1);
-}
+static void unhandled_exception(struct regs *r) {
+    // Faults in ring 3 only take down the process
+    if ((r->cs & 3) == 3 && current_process() != NULL) {
+        esp_printf(putc, "pid %d: %s at eip 0x%x, error 0x%x\r\n",
+                   current_process()->pid, exception_names[r->vector],
+                   r->eip, r->err_code);
+        proc_exit(-1);
+    }
 
-__attribute__((interrupt)) void pit_handler(struct interrupt_frame* frame)
-{
+    esp_printf(putc, "\r\nKERNEL PANIC: %s (vector %d, error 0x%x)\r\n",
+               exception_names[r->vector], r->vector, r->err_code);
+    esp_printf(putc, "eip=%08x eax=%08x ebx=%08x ecx=%08x edx=%08x\r\n",
+               r->eip, r->eax, r->ebx, r->ecx, r->edx);
+    esp_printf(putc, "esi=%08x edi=%08x ebp=%08x eflags=%08x\r\n",
+               r->esi, r->edi, r->ebp, r->eflags);
     asm("cli");
-    /* do something */
-    while(1);
+    while(1) {
+        asm("hlt");
+    }
 }
 
+// Called from isr_common in src/isr.s for every vector
+void irq_dispatch(struct regs *r) {
+    uint32_t vector = r->vector;
+    int handled = 0;
 
-__attribute__((interrupt)) void keyboard_handler(struct interrupt_frame* frame)
-{
-    // Read scancode from keyboard data port (0x60)
-    uint8_t scancode = inb(0x60);
-    
-    // Only process key press events (bit 7 = 0 means key press)
-    if (!(scancode & 0x80)) {
-        // Convert scancode to ASCII using keyboard map
-        unsigned char ascii = keyboard_map[scancode];
-        
-        // Print character if it's printable (not 0)
-        if (ascii != 0) {
-            putc(ascii);
-        }
+    if (irq_chip == &pic_chip && (vector == IRQ_BASE + 7 || vector == IRQ_BASE + 15) &&
+        pic_spurious(vector - IRQ_BASE)) {
+        return;
     }
-    
-    // Send End-Of-Interrupt signal to PIC
-    PIC_sendEOI(1);
-}
+    // The local APIC's spurious vector must not be acknowledged
+    if (vector == APIC_SPURIOUS_VECTOR && apic_enabled) {
+        return;
+    }
+
+    // The calling CPU's count, with one %fs-relative add as in perf_count()
+    asm volatile("incl %%fs:%c0(,%1,4)"
+                 : : "i"(__builtin_offsetof(struct cpu, irq_counts)), "r"(vector));
+    TRACE(IRQ_ENTRY, vector, r->eip, r->cs & 3);
+    for (struct irq_action *a = irq_actions[vector]; a != NULL; a = a->next) {
+        handled |= a->fn(r, a->ctx);
+    }
+    TRACE(IRQ_EXIT, vector, handled, 0);
 
+    if (vector >= IRQ_BASE) {
+        irq_chip->eoi(vector);
+        sched_preempt();  // A handler may have woken a higher-priority thread
+    } else if (vector < 32 && !handled) {
+        unhandled_exception(r);
+    }
+}
 
-__attribute__((interrupt)) void syscall_handler(struct interrupt_frame* frame)
+static int page_fault_handler(struct regs *r, void *ctx)
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    uint32_t addr;
+    asm volatile("mov %%cr2,%0" : "=r"(addr));
+    TRACE(PAGE_FAULT, addr, r->eip, r->err_code);
+    perf_count(PERF_PAGE_FAULTS, 1);
+
+    if (r->err_code & 1) {
+        esp_printf(putc, "page protection fault at 0x%x\r\n", addr);
+        return IRQ_NONE;
+    }
+    // Kernel page tables added since this address space was last synced
+    if (page_fault_sync(addr) == 0) {
+        return IRQ_HANDLED;
+    }
+    // Not-present faults inside a file mapping are demand-filled
+    if (fat_mmap_fault(addr) == 0) {
+        return IRQ_HANDLED;
+    }
+    esp_printf(putc, "page fault at 0x%x\r\n", addr);
+    return IRQ_NONE;
 }
 
 static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags)
@@ -485,29 +587,11 @@ void init_idt() {
     memset((char*)&idt_entries, 0, sizeof(struct idt_entry)*256);
 
     for(i = 0; i < 256; i++){
-        idt_set_gate( i, (uint32_t)stub_isr, 0x08, 0x8E);
+        idt_set_gate( i, (uint32_t)isr_stubs + i * ISR_STUB_SIZE, 0x08, 0x8E);
     }
-    idt_set_gate(0, (uint32_t)divide_error_handler, 0x08, 0x8e);
-    idt_set_gate(1, (uint32_t)debug_exception_handler, 0x08, 0x8e);
-    idt_set_gate(2, (uint32_t)breakpoint_exception_handler, 0x08, 0x8e);
-    idt_set_gate(3, (uint32_t)overflow_handler, 0x08, 0x8e);
-    idt_set_gate(4, (uint32_t)overflow_handler, 0x08, 0x8e);
-    idt_set_gate(5, (uint32_t)bound_check_handler, 0x08, 0x8e);
-    idt_set_gate(6, (uint32_t)invalid_opcode_handler, 0x08, 0x8e);
-    idt_set_gate(7, (uint32_t)coprocessor_not_available_handler, 0x08, 0x8e);
-    idt_set_gate(8, (uint32_t)double_fault_handler, 0x08, 0x8e);
-//    idt_set_gate(9, (uint32_t)coprocessor_segment_overrun_handler, 0x08, 0x8e);
-    idt_set_gate(10, (uint32_t)invalid_tss_handler, 0x08, 0x8e);
-    idt_set_gate(11, (uint32_t)segment_not_present_handler, 0x08, 0x8e);
-    idt_set_gate(12, (uint32_t)stack_exception_handler, 0x08, 0x8e);
-
-    idt_set_gate(13, (uint32_t)general_protection_handler, 0x08, 0x8e);
-    idt_set_gate(14, (uint32_t)page_fault_handler, 0x08, 0x8e);
-//    idt_set_gate(15, (uint32_t)coprocessor_error_handler, 0x08, 0x8e);
-
-    idt_set_gate(0x21, (uint32_t)keyboard_handler,0x08, 0x8e);
-    idt_set_gate(0x80, (uint32_t)syscall_handler,0x08, 0xee); // Set flags to EE, making DPL = 3 so it is accessible from userspace
-    idt_set_gate(32,   (uint32_t)pit_handler, 0x08, 0x8e);
+    idt_set_gate(0x80, (uint32_t)syscall_entry,0x08, 0xef); // Set flags to EF, a DPL 3 trap gate so it is accessible from userspace
+
+    irq_register(14, page_fault_handler, NULL);
     idt_flush(&idt_ptr);
 }
 
@@ -526,8 +610,8 @@ void remap_pic(void)
     outb(PIC_2_DATA, 0x28);
 
     /* ICW3 - setup cascading */
-    outb(PIC_1_DATA, 0x00);
-    outb(PIC_2_DATA, 0x00);
+    outb(PIC_1_DATA, 0x04);  // Slave on IRQ 2
+    outb(PIC_2_DATA, 0x02);  // Slave's cascade identity
 
     /* ICW4 - environment info */
     outb(PIC_1_DATA, 0x01);
@@ -536,7 +620,7 @@ void remap_pic(void)
     outb(0x21 , 0xff);
     outb(0xA1 , 0xff);
     /* Initialization finished */
-    outb(0x21, 0xfd); // Enable keyboard interrupts
+    outb(0x21, 0xfb); // Only the cascade; drivers unmask lines in irq_register
 }
 
 
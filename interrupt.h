@@ -86,6 +86,50 @@ struct interrupt_frame {
 
 
 
+/*
+ * Register frame built by the stubs in src/isr.s: pushal, then the vector
+ * and error code, then what the CPU pushed. user_esp and user_ss are only
+ * valid when the interrupt came from ring 3.
+ */
+struct regs {
+    uint32_t edi, esi, ebp, esp_dummy, ebx, edx, ecx, eax;
+    uint32_t ds, es, fs;
+    uint32_t vector;
+    uint32_t err_code;
+    uint32_t eip;
+    uint32_t cs;
+    uint32_t eflags;
+    uint32_t user_esp;
+    uint32_t user_ss;
+};
+
+#define IRQ_BASE      0x20   // Vector of PIC line 0 after remap_pic()
+#define ISR_STUB_SIZE 16     // Spacing of the stubs in src/isr.s
+
+#define IRQ_NONE      0
+#define IRQ_HANDLED   1
+
+typedef int (*irq_handler_t)(struct regs *r, void *ctx);
+
+// Interrupt controller backend: the 8259 pair or the IOAPIC/local APIC
+struct irq_chip {
+    const char *name;
+    void (*mask)(int irq);
+    void (*unmask)(int irq);
+    void (*eoi)(uint32_t vector);
+};
+
+extern struct irq_chip *irq_chip;
+
+int irq_register(uint8_t vector, irq_handler_t fn, void *ctx);
+void irq_unregister(uint8_t vector, irq_handler_t fn, void *ctx);
+void irq_move(uint8_t from, uint8_t to);
+void irq_set_chip(struct irq_chip *chip);
+uint32_t irq_get_count(uint8_t vector);
+
+// Stub table in src/isr.s
+extern char isr_stubs[];
+
 struct seg_desc{
     uint16_t sz;
     uint32_t addr;
@@ -148,11 +192,43 @@ struct gdt_entry_bits
 
 
 
+// Disables interrupts and returns the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushfl; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    asm volatile("push %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static inline int irqs_enabled(void) {
+    uint32_t flags;
+    asm volatile("pushfl; pop %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 void PIC_sendEOI(unsigned char irq);
 void IRQ_clear_mask(unsigned char IRQline);
 void IRQ_set_mask(unsigned char IRQline);
 void init_idt();
 void tss_flush (uint16_t tss);
+void tss_set_kernel_stack(uint32_t esp0);
 void load_gdt();
+void idt_flush(struct idt_ptr *idt);
 void remap_pic(void);
+void outb(uint16_t port, uint8_t val);
+uint8_t inb(uint16_t port);
+uint16_t inw(uint16_t port);
 #endif
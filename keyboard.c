@@ -0,0 +1,111 @@
+/*
+ * keyboard.c
+ *
+ * PS/2 keyboard driver. Key presses are queued for kbd_getc() and, unless
+ * a reader does its own echo (the shell), echoed to the console.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "keyboard.h"
+#include "interrupt.h"
+#include "timer.h"
+
+extern int putc(int data);
+
+// Keyboard scancode to ASCII mapping
+unsigned char keyboard_map[128] = {
+   0,  27, '1', '2', '3', '4', '5', '6', '7', '8',
+ '9', '0', '-', '=', '\b',
+ '\t',
+ 'q', 'w', 'e', 'r',
+ 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
+   0,
+ 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',
+'\'', '`',   0,
+'\\', 'z', 'x', 'c', 'v', 'b', 'n',
+ 'm', ',', '.', '/',   0,
+ '*',
+   0,
+ ' ',
+   0,
+   0,   0,   0,   0,   0,   0,   0,   0,  
+   0,
+   0,
+   0,
+   0,
+   0,
+ '-',
+   0,
+   0,  
+   0,
+ '+',
+   0,
+   0,
+   0,
+   0,
+   0,
+   0,   0,   0,  
+   0,
+   0,
+   0,
+};
+
+// Characters typed but not yet consumed by kbd_getc()
+unsigned char kbd_buffer[KBD_BUFFER_SIZE];
+volatile uint32_t kbd_head = 0;
+volatile uint32_t kbd_tail = 0;
+static int kbd_echo = 1;
+
+static int keyboard_handler(struct regs *r, void *ctx)
+{
+    // Read scancode from keyboard data port (0x60)
+    uint8_t scancode = inb(KBD_DATA_PORT);
+    
+    // Only process key press events (bit 7 = 0 means key press)
+    if (!(scancode & 0x80)) {
+        // Convert scancode to ASCII using keyboard map
+        unsigned char ascii = keyboard_map[scancode];
+        
+        // Print character if it's printable (not 0) and queue it for kbd_getc
+        if (ascii != 0) {
+            if (kbd_echo) {
+                putc(ascii);
+            }
+            if (kbd_head - kbd_tail < KBD_BUFFER_SIZE) {
+                kbd_buffer[kbd_head % KBD_BUFFER_SIZE] = ascii;
+                kbd_head++;
+            }
+        }
+    }
+    return IRQ_HANDLED;
+}
+
+void keyboard_init(void)
+{
+    irq_register(IRQ_BASE + KBD_IRQ, keyboard_handler, NULL);
+}
+
+void kbd_set_echo(int on)
+{
+    kbd_echo = on;
+}
+
+/*
+ * Returns the next typed character, waiting at most timeout_ms milliseconds.
+ * A timeout of 0 waits forever. Returns -1 on timeout.
+ */
+int kbd_getc(uint32_t timeout_ms)
+{
+    uint32_t deadline = jiffies + msecs_to_jiffies(timeout_ms);
+
+    while (kbd_head == kbd_tail) {
+        if (timeout_ms != 0 && time_after(jiffies, deadline)) {
+            return -1;
+        }
+        asm("hlt");
+    }
+    int c = kbd_buffer[kbd_tail % KBD_BUFFER_SIZE];
+    kbd_tail++;
+    return c;
+}
@@ -0,0 +1,14 @@
+#ifndef __KEYBOARD_H__
+#define __KEYBOARD_H__
+
+#include <stdint.h>
+
+#define KBD_DATA_PORT    0x60
+#define KBD_IRQ          1
+#define KBD_BUFFER_SIZE  64
+
+void keyboard_init(void);
+int kbd_getc(uint32_t timeout_ms);
+void kbd_set_echo(int on);
+
+#endif
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+#
+# Builds the FAT16 fixture disk the in-kernel tests read (tests.c).
+#
+#   mkfixtures.py <image> <size MB> <small files>
+#
+# The big files F1K.BIN .. F64M.BIN hold fixture_byte(i) = i * 31 + (i >> 12)
+# (mod 256) at offset i. N0000.TXT onwards each contain their own 8.3 name,
+# and COUNT.TXT says how many there are. Fixtures that do not fit the image
+# are left out; MANIFEST.TXT lists the big files that were written, one name
+# per line, so the tests only check those.
+
+import os
+import subprocess
+import sys
+import tempfile
+
+FIXTURES = [
+    ("F1K.BIN", 1024),
+    ("F4K.BIN", 4 * 1024),
+    ("F64K.BIN", 64 * 1024),
+    ("F1M.BIN", 1024 * 1024),
+    ("F16M.BIN", 16 * 1024 * 1024),
+    ("F64M.BIN", 64 * 1024 * 1024),
+]
+
+PAGE = 4096
+
+
+def write_fixture(path, size):
+    # Within a page the pattern only depends on the offset in the page;
+    # pages differ by the page number
+    base = bytes((j * 31) & 0xFF for j in range(PAGE))
+    pages = [bytes((b + k) & 0xFF for b in base) for k in range(256)]
+    with open(path, "wb") as f:
+        left, k = size, 0
+        while left > 0:
+            chunk = pages[k & 0xFF][:min(PAGE, left)]
+            f.write(chunk)
+            left -= len(chunk)
+            k += 1
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("usage: mkfixtures.py <image> <size MB> <small files>")
+    image, size_mb, nsmall = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+    if nsmall > 400:
+        sys.exit("at most 400 small files fit the FAT16 root directory")
+
+    if os.path.exists(image):
+        os.remove(image)
+    # 4 KB clusters keep even the 64 MB file within one FAT16 chain
+    subprocess.check_call(["mkfs.vfat", "-C", "-F", "16", "-s", "8", image,
+                           str(size_mb * 1024)])
+
+    budget = (size_mb - 2) * 1024 * 1024
+    with tempfile.TemporaryDirectory() as tmp:
+        files = []
+        included = []
+        for name, size in FIXTURES:
+            if size > budget:
+                print("mkfixtures: skipping %s, image too small" % name)
+                continue
+            write_fixture(os.path.join(tmp, name), size)
+            included.append(name)
+            budget -= size
+        files += included
+        with open(os.path.join(tmp, "MANIFEST.TXT"), "w") as f:
+            f.write("".join(name + "\n" for name in included))
+        files.append("MANIFEST.TXT")
+        for i in range(nsmall):
+            name = "N%04d.TXT" % i
+            with open(os.path.join(tmp, name), "w") as f:
+                f.write(name)
+            files.append(name)
+        with open(os.path.join(tmp, "COUNT.TXT"), "w") as f:
+            f.write("%d\n" % nsmall)
+        files.append("COUNT.TXT")
+
+        subprocess.check_call(["mcopy", "-i", image] +
+                              [os.path.join(tmp, n) for n in files] + ["::/"])
+
+
+if __name__ == "__main__":
+    main()
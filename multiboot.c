@@ -0,0 +1,93 @@
+/*
+ * multiboot.c
+ *
+ * Reads the multiboot2 boot information. It is read through the direct map
+ * (page.h), and multiboot_parse() copies out what later code needs before
+ * the frames it sits in can be handed out.
+ */
+
+#include "multiboot.h"
+#include "page.h"
+#include <stddef.h>
+
+uint32_t multiboot_magic;
+uint32_t multiboot_info_addr;
+
+char multiboot_cmdline[MULTIBOOT_CMDLINE_LEN];
+struct multiboot_module multiboot_modules[MULTIBOOT_MAX_MODULES];
+int multiboot_nmodules;
+
+static void copy_string(char *dst, const char *src) {
+    int i = 0;
+    for (; i < MULTIBOOT_CMDLINE_LEN - 1 && src[i] != '\0'; i++) {
+        dst[i] = src[i];
+    }
+    dst[i] = '\0';
+}
+
+// Returns the number of modules found, or -1 if we were not booted by multiboot2
+int multiboot_parse(void) {
+    if (multiboot_magic != MULTIBOOT2_BOOTLOADER_MAGIC || multiboot_info_addr == 0) {
+        return -1;
+    }
+
+    // The information starts with its total size and a reserved word
+    char *info = phys_to_virt(multiboot_info_addr);
+    uint32_t total = *(uint32_t *)info;
+    uint32_t off = 8;
+    while (off + sizeof(struct multiboot_tag) <= total) {
+        struct multiboot_tag *tag = (struct multiboot_tag *)(info + off);
+        if (tag->type == MULTIBOOT_TAG_END) {
+            break;
+        }
+        if (tag->type == MULTIBOOT_TAG_CMDLINE) {
+            copy_string(multiboot_cmdline, (char *)(tag + 1));
+        } else if (tag->type == MULTIBOOT_TAG_MODULE && multiboot_nmodules < MULTIBOOT_MAX_MODULES) {
+            struct multiboot_tag_module *m = (struct multiboot_tag_module *)tag;
+            struct multiboot_module *mod = &multiboot_modules[multiboot_nmodules++];
+            mod->start = m->mod_start;
+            mod->end = m->mod_end;
+            copy_string(mod->cmdline, m->cmdline);
+        }
+        off += (tag->size + 7) & ~7;
+    }
+    return multiboot_nmodules;
+}
+
+// True if option is one of the space-separated words on the kernel command line
+int multiboot_has_option(const char *option) {
+    const char *p = multiboot_cmdline;
+    while (*p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
+        const char *o = option;
+        while (*o != '\0' && *p == *o) {
+            p++;
+            o++;
+        }
+        if (*o == '\0' && (*p == ' ' || *p == '\0')) {
+            return 1;
+        }
+        while (*p != ' ' && *p != '\0') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+// Module whose module2 arguments are exactly cmdline, or NULL
+struct multiboot_module *multiboot_find_module(const char *cmdline) {
+    for (int i = 0; i < multiboot_nmodules; i++) {
+        const char *a = multiboot_modules[i].cmdline;
+        const char *b = cmdline;
+        while (*a != '\0' && *a == *b) {
+            a++;
+            b++;
+        }
+        if (*a == *b) {
+            return &multiboot_modules[i];
+        }
+    }
+    return NULL;
+}
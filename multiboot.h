@@ -0,0 +1,49 @@
+#ifndef __MULTIBOOT_H__
+#define __MULTIBOOT_H__
+
+#include <stdint.h>
+
+// Value in %eax when a multiboot2 loader starts the kernel
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36d76289
+
+// Boot information tags
+#define MULTIBOOT_TAG_END       0
+#define MULTIBOOT_TAG_CMDLINE   1
+#define MULTIBOOT_TAG_MODULE    3
+
+#define MULTIBOOT_MAX_MODULES   4
+#define MULTIBOOT_CMDLINE_LEN   64
+
+struct multiboot_tag {
+    uint32_t type;
+    uint32_t size;              // Including this header; tags are 8-byte aligned
+};
+
+struct multiboot_tag_module {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];             // NUL-terminated, from the module2 line
+};
+
+// A module GRUB loaded, copied out of the boot information
+struct multiboot_module {
+    uint32_t start;             // Physical, page aligned
+    uint32_t end;               // One past the last byte
+    char cmdline[MULTIBOOT_CMDLINE_LEN];
+};
+
+// Saved by _start (src/entry.s)
+extern uint32_t multiboot_magic;
+extern uint32_t multiboot_info_addr;
+
+extern char multiboot_cmdline[MULTIBOOT_CMDLINE_LEN];
+extern struct multiboot_module multiboot_modules[MULTIBOOT_MAX_MODULES];
+extern int multiboot_nmodules;
+
+int multiboot_parse(void);
+struct multiboot_module *multiboot_find_module(const char *cmdline);
+int multiboot_has_option(const char *option);
+
+#endif
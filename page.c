@@ -1,33 +1,86 @@
 #include "page.h"
+#include "smp.h"
+#include "perf.h"
 #include <stddef.h>
 
 struct ppage physical_page_array[128];
 struct ppage *free_physical_pages = NULL;
 
 struct page_directory_entry pd[1024] __attribute__((aligned(4096)));
-struct page pt[1024] __attribute__((aligned(4096)));
+
+// Page tables are handed out from a static pool in the kernel image, so they
+// are in the direct map like everything else.
+#define PT_POOL_SIZE 64
+struct page pt_pool[PT_POOL_SIZE][1024] __attribute__((aligned(4096)));
+uint8_t pt_pool_used[PT_POOL_SIZE];
+
+// Page directories for user processes, also from a static pool
+#define PD_POOL_SIZE 8
+struct page_directory_entry pd_pool[PD_POOL_SIZE][1024] __attribute__((aligned(4096)));
+uint8_t pd_pool_used[PD_POOL_SIZE];
+
+// Bumped whenever a new page table is added to the kernel part of pd
+uint32_t kernel_pd_gen = 0;
+uint32_t pd_pool_gen[PD_POOL_SIZE];
+
+// Guards both pools, kernel_pd_gen, ioremap_next and every directory and
+// table update; map_page() and friends can run on several CPUs at once
+DEFINE_SPINLOCK(pt_lock);
+
+extern int _end_kernel;
 
 void init_pfa_list(void) {
+    struct ppage *prev = NULL;
+
+    free_physical_pages = NULL;
     for (int i = 0; i < 128; i++) {
         physical_page_array[i].physical_addr = (void *)(i * 0x200000);  
-        
-        if (i < 127) {
-            physical_page_array[i].next = &physical_page_array[i + 1];
-        } else {
-            physical_page_array[i].next = NULL;  
+        physical_page_array[i].next = NULL;
+        physical_page_array[i].prev = NULL;
+
+        // Frames that overlap the kernel image are never handed out
+        if ((uint32_t)physical_page_array[i].physical_addr < virt_to_phys(&_end_kernel)) {
+            continue;
         }
-        
-        if (i > 0) {
-            physical_page_array[i].prev = &physical_page_array[i - 1];
+
+        if (prev != NULL) {
+            prev->next = &physical_page_array[i];
+            physical_page_array[i].prev = prev;
         } else {
-            physical_page_array[i].prev = NULL; 
+            free_physical_pages = &physical_page_array[i];
         }
+        prev = &physical_page_array[i];
     }
-    
-    free_physical_pages = &physical_page_array[0];
 }
 
-struct ppage *allocate_physical_pages(unsigned int npages) {
+DEFINE_SPINLOCK(pfa_lock);
+
+// Takes the frames overlapping [start, end) off the free list, for memory
+// the boot loader already put something in. Call before the first allocation.
+void pfa_reserve(uint32_t start, uint32_t end) {
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    struct ppage *p = free_physical_pages;
+    while (p != NULL) {
+        struct ppage *next = p->next;
+        uint32_t frame = (uint32_t)p->physical_addr;
+        if (frame < end && frame + KHEAP_SLOT_SIZE > start) {
+            if (p->prev != NULL) {
+                p->prev->next = p->next;
+            } else {
+                free_physical_pages = p->next;
+            }
+            if (p->next != NULL) {
+                p->next->prev = p->prev;
+            }
+            p->next = NULL;
+            p->prev = NULL;
+        }
+        p = next;
+    }
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+static struct ppage *alloc_pages_locked(unsigned int npages) {
     if (free_physical_pages == NULL || npages == 0) {
         return NULL;
     }
@@ -61,56 +114,488 @@ struct ppage *allocate_physical_pages(unsigned int npages) {
     return allocated_list;
 }
 
+// Pushes a chain of frames ending at tail onto the global list
+static void free_pages_locked(struct ppage *head, struct ppage *tail) {
+    tail->next = free_physical_pages;
+    
+    if (free_physical_pages != NULL) {
+        free_physical_pages->prev = tail;
+    }
+    
+    free_physical_pages = head;
+    free_physical_pages->prev = NULL;
+}
+
+/*
+ * Per-CPU magazines of free frames in front of the global list. Single-frame
+ * allocations and frees use the local magazine, which is refilled from and
+ * drained to free_physical_pages PFA_BATCH frames at a time, so most of them
+ * never take pfa_lock. The magazine lock is only contended when another CPU
+ * raids the magazine because the global list ran dry. Lock order is
+ * magazine, then pfa_lock; no CPU holds two magazine locks.
+ */
+#define PFA_MAG_SIZE  8
+#define PFA_BATCH     4
+
+struct pfa_magazine {
+    spinlock_t lock;
+    int count;
+    struct ppage *frames[PFA_MAG_SIZE];
+};
+
+static struct pfa_magazine magazines[MAX_CPUS];
+
+// Takes one frame out of another CPU's magazine
+static struct ppage *magazine_steal(int self) {
+    for (int i = 0; i < ncpus; i++) {
+        struct pfa_magazine *mag = &magazines[i];
+        struct ppage *frame = NULL;
+
+        if (i == self || mag->count == 0) {
+            continue;
+        }
+        spin_lock(&mag->lock);
+        if (mag->count > 0) {
+            frame = mag->frames[--mag->count];
+        }
+        spin_unlock(&mag->lock);
+        if (frame != NULL) {
+            return frame;
+        }
+    }
+    return NULL;
+}
+
+static struct ppage *magazine_alloc(void) {
+    uint32_t flags = irq_save();
+    int self = cpu_id();
+    struct pfa_magazine *mag = &magazines[self];
+    struct ppage *frame = NULL;
+
+    spin_lock(&mag->lock);
+    if (mag->count == 0) {
+        spin_lock(&pfa_lock);
+        while (mag->count < PFA_BATCH && free_physical_pages != NULL) {
+            mag->frames[mag->count++] = alloc_pages_locked(1);
+        }
+        spin_unlock(&pfa_lock);
+    }
+    if (mag->count > 0) {
+        frame = mag->frames[--mag->count];
+    }
+    spin_unlock(&mag->lock);
+
+    if (frame == NULL) {
+        frame = magazine_steal(self);
+    }
+    irq_restore(flags);
+
+    if (frame != NULL) {
+        frame->next = NULL;
+        frame->prev = NULL;
+    }
+    return frame;
+}
+
+static void magazine_free(struct ppage *frame) {
+    uint32_t flags = irq_save();
+    struct pfa_magazine *mag = &magazines[cpu_id()];
+
+    spin_lock(&mag->lock);
+    if (mag->count == PFA_MAG_SIZE) {
+        // Chain the oldest PFA_BATCH frames and hand them back in one go
+        for (int i = 0; i < PFA_BATCH - 1; i++) {
+            mag->frames[i]->next = mag->frames[i + 1];
+            mag->frames[i + 1]->prev = mag->frames[i];
+        }
+        spin_lock(&pfa_lock);
+        free_pages_locked(mag->frames[0], mag->frames[PFA_BATCH - 1]);
+        spin_unlock(&pfa_lock);
+
+        for (int i = PFA_BATCH; i < PFA_MAG_SIZE; i++) {
+            mag->frames[i - PFA_BATCH] = mag->frames[i];
+        }
+        mag->count -= PFA_BATCH;
+    }
+    mag->frames[mag->count++] = frame;
+    spin_unlock(&mag->lock);
+    irq_restore(flags);
+}
+
+struct ppage *allocate_physical_pages(unsigned int npages) {
+    struct ppage *list;
+
+    if (npages == 1) {
+        list = magazine_alloc();
+    } else {
+        uint32_t flags = spin_lock_irqsave(&pfa_lock);
+        list = alloc_pages_locked(npages);
+        spin_unlock_irqrestore(&pfa_lock, flags);
+    }
+    if (list != NULL) {
+        perf_count(PERF_FRAMES_ALLOC, npages);
+    }
+    return list;
+}
+
 void free_physical_pages_list(struct ppage *ppage_list) {
     if (ppage_list == NULL) {
         return;
     }
     
+    if (ppage_list->next == NULL) {
+        perf_count(PERF_FRAMES_FREED, 1);
+        magazine_free(ppage_list);
+        return;
+    }
+
+    // The list is private to the caller until spliced in, so find its
+    // tail before taking the lock
     struct ppage *current = ppage_list;
+    unsigned int n = 1;
     while (current->next != NULL) {
         current = current->next;
+        n++;
     }
+    perf_count(PERF_FRAMES_FREED, n);
     
-    current->next = free_physical_pages;
-    
-    if (free_physical_pages != NULL) {
-        free_physical_pages->prev = current;
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    free_pages_locked(ppage_list, current);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+// Frames free in the global list and every magazine; a snapshot only
+unsigned int pfa_free_frames(void) {
+    unsigned int n = 0;
+
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    for (struct ppage *p = free_physical_pages; p != NULL; p = p->next) {
+        n++;
     }
-    
-    free_physical_pages = ppage_list;
-    free_physical_pages->prev = NULL;
+    spin_unlock_irqrestore(&pfa_lock, flags);
+
+    for (int i = 0; i < ncpus; i++) {
+        n += magazines[i].count;
+    }
+    return n;
+}
+static void invlpg(uint32_t vaddr) {
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
 }
-void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd) {
- 
-    uint32_t vaddr_int = (uint32_t)vaddr;
-    uint32_t pd_index = vaddr_int >> 22;  
-    
 
-    uint32_t pt_index = (vaddr_int >> 12) & 0x3FF; 
-    
+// The page table helpers below expect pt_lock to be held
+static struct page *alloc_page_table(void) {
+    for (int n = 0; n < PT_POOL_SIZE; n++) {
+        if (pt_pool_used[n]) {
+            continue;
+        }
+        pt_pool_used[n] = 1;
+        struct page *table = pt_pool[n];
+        for (int i = 0; i < 1024; i++) {
+            *(uint32_t *)&table[i] = 0;
+        }
+        return table;
+    }
+    return NULL;
+}
+
+static void free_page_table(struct page *table) {
+    int n = ((uint32_t)table - (uint32_t)pt_pool) / sizeof(pt_pool[0]);
+    if (n >= 0 && n < PT_POOL_SIZE) {
+        pt_pool_used[n] = 0;
+    }
+}
+
+static int is_user_pde(int pd_index) {
+    return pd_index >= (USER_BASE >> 22) && pd_index < (USER_TOP >> 22);
+}
+
+// Returns the page table entry for vaddr, or NULL if no page table covers
+// it (nothing mapped, or a large page).
+struct page *get_pte(struct page_directory_entry *pd, uint32_t vaddr) {
+    uint32_t pd_index = vaddr >> 22;
+    uint32_t pt_index = (vaddr >> 12) & 0x3FF;
+
+    if (!pd[pd_index].present || pd[pd_index].pagesize) {
+        return NULL;
+    }
+    struct page *table = phys_to_virt(pd[pd_index].frame << 12);
+    return &table[pt_index];
+}
+
+// Physical address behind a kernel virtual address, for DMA. 0 if unmapped.
+uint32_t virt_to_phys(void *vaddr) {
+    if (is_direct_mapped(vaddr)) {
+        return (uint32_t)vaddr - KERNEL_VMA;
+    }
+    struct page_directory_entry *pde = &pd[(uint32_t)vaddr >> 22];
+    if (pde->present && pde->pagesize) {
+        return ((pde->frame << 12) & ~(LARGE_PAGE_SIZE - 1)) | ((uint32_t)vaddr & (LARGE_PAGE_SIZE - 1));
+    }
+    struct page *pte = get_pte(pd, (uint32_t)vaddr);
+    if (pte == NULL || !pte->present) {
+        return 0;
+    }
+    return (pte->frame << 12) | ((uint32_t)vaddr & (PAGE_SIZE - 1));
+}
+
+// Whether the large page holding vaddr already maps it to paddr with flags
+static int large_page_covers(struct page_directory_entry *pde, uint32_t vaddr, uint32_t paddr,
+                             uint32_t flags) {
+    uint32_t base = (pde->frame << 12) & ~(LARGE_PAGE_SIZE - 1);
+    return base + (vaddr & (LARGE_PAGE_SIZE - 1)) == paddr &&
+           pde->rw == ((flags & PAGE_RW) ? 1 : 0) &&
+           pde->user == ((flags & PAGE_USER) ? 1 : 0) &&
+           pde->cachedisabled == ((flags & PAGE_NOCACHE) ? 1 : 0);
+}
+
+/*
+ * Replaces a large page with a page table mapping the same 4 MB, so single
+ * pages inside it can be changed. Returns -1 if the page table pool is empty.
+ */
+static int split_large_page(struct page_directory_entry *pd, uint32_t pd_index) {
+    struct page_directory_entry old = pd[pd_index];
+    struct page *table = alloc_page_table();
+    if (table == NULL) {
+        return -1;
+    }
+
+    uint32_t base = (old.frame << 12) & ~(LARGE_PAGE_SIZE - 1);
+    for (int i = 0; i < 1024; i++) {
+        table[i].frame = (base >> 12) + i;
+        table[i].rw = old.rw;
+        table[i].user = old.user;
+        table[i].nocache = old.cachedisabled;
+        table[i].present = 1;
+    }
+    *(uint32_t *)&pd[pd_index] = 0;
+    pd[pd_index].frame = virt_to_phys(table) >> 12;
+    pd[pd_index].rw = 1;
+    pd[pd_index].user = old.user;
+    pd[pd_index].present = 1;
+    if (!is_user_pde(pd_index)) {
+        kernel_pd_gen++;
+    }
+    for (int i = 0; i < 1024; i++) {
+        invlpg((pd_index << 22) + i * PAGE_SIZE);
+    }
+    return 0;
+}
+
+void map_page(struct page_directory_entry *pd, uint32_t vaddr, uint32_t paddr, uint32_t flags) {
+    uint32_t pd_index = vaddr >> 22;
+    uint32_t irq_flags = spin_lock_irqsave(&pt_lock);
+
+    if (pd[pd_index].present && pd[pd_index].pagesize) {
+        if (large_page_covers(&pd[pd_index], vaddr, paddr, flags) ||
+            split_large_page(pd, pd_index) < 0) {
+            spin_unlock_irqrestore(&pt_lock, irq_flags);
+            return;
+        }
+    }
+
     if (!pd[pd_index].present) {
+        struct page *table = alloc_page_table();
+        if (table == NULL) {
+            spin_unlock_irqrestore(&pt_lock, irq_flags);
+            return;
+        }
+        pd[pd_index].frame = virt_to_phys(table) >> 12;  // Page table address
+        pd[pd_index].rw = 1;
+        pd[pd_index].user = (flags & PAGE_USER) ? 1 : 0;
         pd[pd_index].present = 1;
-        pd[pd_index].rw = 1;          
-        pd[pd_index].user = 0;        
-        pd[pd_index].frame = ((uint32_t)&pt[0]) >> 12;  // Page table address
+        if (!is_user_pde(pd_index)) {
+            kernel_pd_gen++;
+        }
+    } else if (flags & PAGE_USER) {
+        pd[pd_index].user = 1;
     }
-    
+
+    struct page *pte = get_pte(pd, vaddr);
+    pte->frame = paddr >> 12;
+    pte->rw = (flags & PAGE_RW) ? 1 : 0;
+    pte->user = (flags & PAGE_USER) ? 1 : 0;
+    pte->nocache = (flags & PAGE_NOCACHE) ? 1 : 0;
+    pte->present = 1;
+    invlpg(vaddr);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+}
+
+void unmap_page(struct page_directory_entry *pd, uint32_t vaddr) {
+    uint32_t flags = spin_lock_irqsave(&pt_lock);
+    if (!(pd[vaddr >> 22].present && pd[vaddr >> 22].pagesize &&
+          split_large_page(pd, vaddr >> 22) < 0)) {
+        struct page *pte = get_pte(pd, vaddr);
+        if (pte != NULL) {
+            *(uint32_t *)pte = 0;
+            invlpg(vaddr);
+        }
+    }
+    spin_unlock_irqrestore(&pt_lock, flags);
+}
+
+void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd) {
+    uint32_t addr = (uint32_t)vaddr;
+
     struct ppage *current = pglist;
     while (current != NULL) {
-        pt[pt_index].present = 1;
-        pt[pt_index].rw = 1;           
-        pt[pt_index].user = 0;         
-        pt[pt_index].frame = ((uint32_t)current->physical_addr) >> 12;
-        
-        // Move to next page in list and next page table entry
+        map_page(pd, addr, (uint32_t)current->physical_addr, PAGE_RW);
+
+        // Move to next page in list and next virtual page
         current = current->next;
-        pt_index++;
-        
-        // Handle page table overflow (shouldn't happen in our simple case)
-        if (pt_index >= 1024) {
-            break;
-        }
+        addr += PAGE_SIZE;
     }
     
     return vaddr;
 }
+
+/*
+ * Allocates npages (at most one frame's worth) of kernel memory. The pages
+ * are physically contiguous since they all come from the same frame, and
+ * are used through the direct map, so nothing has to be mapped.
+ */
+void *kpage_alloc(unsigned int npages) {
+    if (npages == 0 || npages > KHEAP_SLOT_SIZE / PAGE_SIZE) {
+        return NULL;
+    }
+    struct ppage *frame = allocate_physical_pages(1);
+    if (frame == NULL) {
+        return NULL;
+    }
+    return phys_to_virt((uint32_t)frame->physical_addr);
+}
+
+void kpage_free(void *vaddr) {
+    uint32_t paddr = (uint32_t)vaddr - KERNEL_VMA;
+
+    if (!is_direct_mapped(vaddr) || (paddr & (KHEAP_SLOT_SIZE - 1)) != 0) {
+        return;
+    }
+    struct ppage *frame = &physical_page_array[paddr / KHEAP_SLOT_SIZE];
+    frame->next = NULL;
+    frame->prev = NULL;
+    free_physical_pages_list(frame);
+}
+
+uint32_t ioremap_next = IOREMAP_BASE;
+
+/*
+ * Maps size bytes of physical memory starting at paddr into the ioremap
+ * window and returns the virtual address of paddr. Mappings are never torn
+ * down; callers map device registers and firmware tables once at init.
+ */
+void *ioremap(uint32_t paddr, uint32_t size, uint32_t flags) {
+    uint32_t offset = paddr & (PAGE_SIZE - 1);
+    uint32_t npages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // Claim the range first; map_page() takes pt_lock itself
+    uint32_t lock_flags = spin_lock_irqsave(&pt_lock);
+    uint32_t vaddr = ioremap_next;
+    if (size == 0 || vaddr + npages * PAGE_SIZE > IOREMAP_END) {
+        spin_unlock_irqrestore(&pt_lock, lock_flags);
+        return NULL;
+    }
+    ioremap_next += npages * PAGE_SIZE;
+    spin_unlock_irqrestore(&pt_lock, lock_flags);
+
+    for (uint32_t i = 0; i < npages; i++) {
+        map_page(pd, vaddr + i * PAGE_SIZE, (paddr - offset) + i * PAGE_SIZE, flags);
+    }
+    return (void *)(vaddr + offset);
+}
+
+/*
+ * Per-process page directories. The user range [USER_BASE, USER_TOP) is
+ * private to each directory; everything else points at the kernel's page
+ * tables, so kernel mappings made through an existing table show up in every
+ * address space. Page tables added to the kernel part later are copied in by
+ * pd_sync_kernel() at context switch time, or lazily from the page fault
+ * handler.
+ */
+static void pd_sync_kernel_locked(struct page_directory_entry *upd) {
+    int n = ((uint32_t)upd - (uint32_t)pd_pool) / sizeof(pd_pool[0]);
+
+    if (upd == pd || pd_pool_gen[n] == kernel_pd_gen) {
+        return;
+    }
+    for (int i = 0; i < 1024; i++) {
+        if (!is_user_pde(i)) {
+            upd[i] = pd[i];
+        }
+    }
+    pd_pool_gen[n] = kernel_pd_gen;
+}
+
+struct page_directory_entry *pd_create(void) {
+    uint32_t flags = spin_lock_irqsave(&pt_lock);
+    for (int n = 0; n < PD_POOL_SIZE; n++) {
+        if (pd_pool_used[n]) {
+            continue;
+        }
+        pd_pool_used[n] = 1;
+        for (int i = 0; i < 1024; i++) {
+            *(uint32_t *)&pd_pool[n][i] = 0;
+        }
+        pd_pool_gen[n] = kernel_pd_gen - 1;
+        pd_sync_kernel_locked(pd_pool[n]);
+        spin_unlock_irqrestore(&pt_lock, flags);
+        return pd_pool[n];
+    }
+    spin_unlock_irqrestore(&pt_lock, flags);
+    return NULL;
+}
+
+void pd_sync_kernel(struct page_directory_entry *upd) {
+    uint32_t flags = spin_lock_irqsave(&pt_lock);
+    pd_sync_kernel_locked(upd);
+    spin_unlock_irqrestore(&pt_lock, flags);
+}
+
+// Frees the user page tables of upd and the directory itself.
+void pd_destroy(struct page_directory_entry *upd) {
+    int n = ((uint32_t)upd - (uint32_t)pd_pool) / sizeof(pd_pool[0]);
+
+    if (upd == pd || n < 0 || n >= PD_POOL_SIZE) {
+        return;
+    }
+    if (this_cpu()->active_pd == upd) {
+        switch_pd(pd);
+    }
+    uint32_t flags = spin_lock_irqsave(&pt_lock);
+    for (int i = USER_BASE >> 22; i < USER_TOP >> 22; i++) {
+        if (upd[i].present) {
+            free_page_table(phys_to_virt(upd[i].frame << 12));
+        }
+    }
+    pd_pool_used[n] = 0;
+    spin_unlock_irqrestore(&pt_lock, flags);
+}
+
+void switch_pd(struct page_directory_entry *new_pd) {
+    if (new_pd == this_cpu()->active_pd) {
+        return;
+    }
+    pd_sync_kernel(new_pd);
+    this_cpu()->active_pd = new_pd;
+    asm volatile("mov %0, %%cr3" : : "r"(virt_to_phys(new_pd)) : "memory");
+}
+
+/*
+ * Copies a kernel page directory entry into the active directory if it is
+ * missing there. Returns 0 if that resolved the fault at addr.
+ */
+int page_fault_sync(uint32_t addr) {
+    int pd_index = addr >> 22;
+
+    if (this_cpu()->active_pd == pd || is_user_pde(pd_index)) {
+        return -1;
+    }
+    uint32_t flags = spin_lock_irqsave(&pt_lock);
+    int ret = -1;
+    if (pd[pd_index].present && !this_cpu()->active_pd[pd_index].present) {
+        this_cpu()->active_pd[pd_index] = pd[pd_index];
+        ret = 0;
+    }
+    spin_unlock_irqrestore(&pt_lock, flags);
+    return ret;
+}
@@ -2,6 +2,39 @@
 #define __PAGE_H__
 #include <stdint.h>
 
+#define PAGE_SIZE 4096
+#define LARGE_PAGE_SIZE 0x400000   // One page directory entry with CR4.PSE
+
+// Flags accepted by map_page()
+#define PAGE_RW       0x002   // Writable
+#define PAGE_USER     0x004   // Accessible from ring 3
+#define PAGE_NOCACHE  0x010   // Cache disabled (MMIO)
+
+// User processes own the address range [USER_BASE, USER_TOP)
+#define USER_BASE       0x00400000
+#define USER_TOP        0xC0000000
+
+/*
+ * The kernel runs in the higher half. Physical memory from 0 up to
+ * DIRECT_MAP_SIZE, which is everything the frame allocator hands out, is
+ * mapped at KERNEL_VMA with large pages, and the kernel image is linked
+ * inside that mapping at KERNEL_VMA + 1 MB. src/entry.s builds it before
+ * paging is turned on.
+ */
+#define KERNEL_VMA      0xC0000000
+#define DIRECT_MAP_SIZE 0x10000000
+
+// Size of an allocator frame; kpage_alloc() hands out at most one
+#define KHEAP_SLOT_SIZE 0x200000
+
+// Virtual address window used for memory-mapped files
+#define MMAP_BASE 0xE0000000
+#define MMAP_END  0xF0000000
+
+// Window for ioremap(): device registers and firmware tables
+#define IOREMAP_BASE 0xF0000000
+#define IOREMAP_END  0xFE000000
+
 struct ppage {
     struct ppage *next;
     struct ppage *prev;
@@ -13,8 +46,10 @@ extern struct ppage *free_physical_pages;
 
 // Function declarations
 void init_pfa_list(void);
+void pfa_reserve(uint32_t start, uint32_t end);
 struct ppage *allocate_physical_pages(unsigned int npages);
 void free_physical_pages_list(struct ppage *ppage_list);
+unsigned int pfa_free_frames(void);
 
 // Page Directory Entry
 struct page_directory_entry {
@@ -24,8 +59,9 @@ struct page_directory_entry {
    uint32_t writethru     : 1;   // Cache this directory as write-thru only
    uint32_t cachedisabled : 1;   // Disable cache on this page table?
    uint32_t accessed      : 1;   // Has it been accessed?
+   uint32_t ignored       : 1;   // Ignored bit
    uint32_t pagesize      : 1;   // Page size (0 = 4KB)
-   uint32_t ignored       : 2;   // Ignored bits
+   uint32_t global        : 1;   // Ignored for 4KB tables
    uint32_t os_specific   : 3;   // OS-specific bits
    uint32_t frame         : 20;  // Frame address (shifted right 12 bits)
 } __attribute__((packed));
@@ -35,13 +71,48 @@ struct page {
    uint32_t present    : 1;   // Page present in memory
    uint32_t rw         : 1;   // Read-only if clear
    uint32_t user       : 1;   // Supervisor level only if clear
+   uint32_t writethru  : 1;   // Write-through caching
+   uint32_t nocache    : 1;   // Cache disabled
    uint32_t accessed   : 1;   // Has the page been accessed?
    uint32_t dirty      : 1;   // Has the page been written to?
-   uint32_t unused     : 7;   // Unused and reserved bits
+   uint32_t pat        : 1;   // Page attribute table index
+   uint32_t global     : 1;   // Not flushed on cr3 reload
+   uint32_t unused     : 3;   // Available to the OS
    uint32_t frame      : 20;  // Frame address
 } __attribute__((packed));
 
 // Function declaration for map_pages
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd);
 
+// Single-page mapping helpers. These allocate page tables on demand.
+void map_page(struct page_directory_entry *pd, uint32_t vaddr, uint32_t paddr, uint32_t flags);
+void unmap_page(struct page_directory_entry *pd, uint32_t vaddr);
+struct page *get_pte(struct page_directory_entry *pd, uint32_t vaddr);
+
+
+// Kernel address of physical memory below DIRECT_MAP_SIZE
+static inline void *phys_to_virt(uint32_t paddr) {
+    return (void *)(paddr + KERNEL_VMA);
+}
+
+static inline int is_direct_mapped(const void *vaddr) {
+    return (uint32_t)vaddr - KERNEL_VMA < DIRECT_MAP_SIZE;
+}
+uint32_t virt_to_phys(void *vaddr);
+
+// Kernel memory backed by the frame allocator, reached through the direct map
+void *kpage_alloc(unsigned int npages);
+void kpage_free(void *vaddr);
+
+// Maps physical memory that is not RAM we own (MMIO, ACPI tables)
+void *ioremap(uint32_t paddr, uint32_t size, uint32_t flags);
+
+// Per-process address spaces
+extern struct page_directory_entry pd[1024];
+struct page_directory_entry *pd_create(void);
+void pd_destroy(struct page_directory_entry *upd);
+void pd_sync_kernel(struct page_directory_entry *upd);
+void switch_pd(struct page_directory_entry *new_pd);
+int page_fault_sync(uint32_t addr);
+
 #endif
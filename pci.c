@@ -0,0 +1,186 @@
+/*
+ * pci.c
+ *
+ * PCI configuration space access through the legacy 0xCF8/0xCFC ports, a
+ * one-time scan of every bus, slot and function, and MSI setup.
+ */
+
+#include "pci.h"
+#include "apic.h"
+#include "sync.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+extern int putc(int data);
+
+struct pci_dev pci_devices[PCI_MAX_DEVICES];
+int pci_ndevices;
+
+DEFINE_SPINLOCK(pci_lock);  // The address/data port pair is one shared window
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile("outl %0, %1" : : "a"(val), "dN"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t rv;
+    asm volatile("inl %1, %0" : "=a"(rv) : "dN"(port));
+    return rv;
+}
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t addr = 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC);
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, addr);
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+static void pci_config_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    uint32_t addr = 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC);
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, addr);
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+uint32_t pci_read32(struct pci_dev *dev, uint8_t offset) {
+    return pci_config_read(dev->bus, dev->slot, dev->func, offset);
+}
+
+uint16_t pci_read16(struct pci_dev *dev, uint8_t offset) {
+    return pci_read32(dev, offset) >> ((offset & 2) * 8);
+}
+
+uint8_t pci_read8(struct pci_dev *dev, uint8_t offset) {
+    return pci_read32(dev, offset) >> ((offset & 3) * 8);
+}
+
+void pci_write32(struct pci_dev *dev, uint8_t offset, uint32_t value) {
+    pci_config_write(dev->bus, dev->slot, dev->func, offset, value);
+}
+
+// Read-modify-write of the containing dword. Not for registers with
+// write-1-to-clear bits next to the field, such as the status register.
+void pci_write16(struct pci_dev *dev, uint8_t offset, uint16_t value) {
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t dword = pci_read32(dev, offset);
+    dword = (dword & ~(0xFFFF << shift)) | ((uint32_t)value << shift);
+    pci_write32(dev, offset, dword);
+}
+
+static void pci_add(uint8_t bus, uint8_t slot, uint8_t func, uint32_t id) {
+    if (pci_ndevices == PCI_MAX_DEVICES) {
+        return;
+    }
+    struct pci_dev *dev = &pci_devices[pci_ndevices++];
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor = id & 0xFFFF;
+    dev->device = id >> 16;
+
+    uint32_t class = pci_read32(dev, PCI_CLASS_REVISION);
+    dev->class = class >> 24;
+    dev->subclass = class >> 16;
+    dev->prog_if = class >> 8;
+    dev->irq_line = pci_read8(dev, PCI_INTERRUPT_LINE);
+}
+
+// Brute-force scan of every bus; cheap enough to do once at boot
+void pci_init(void) {
+    pci_ndevices = 0;
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            uint32_t id = pci_config_read(bus, slot, 0, PCI_VENDOR_ID);
+            if ((id & 0xFFFF) == 0xFFFF) {
+                continue;
+            }
+            pci_add(bus, slot, 0, id);
+
+            int nfuncs = (pci_config_read(bus, slot, 0, PCI_HEADER_TYPE & 0xFC) >> 16) & 0x80 ? 8 : 1;
+            for (int func = 1; func < nfuncs; func++) {
+                id = pci_config_read(bus, slot, func, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) != 0xFFFF) {
+                    pci_add(bus, slot, func, id);
+                }
+            }
+        }
+    }
+    esp_printf(putc, "PCI: %d devices\r\n", pci_ndevices);
+}
+
+struct pci_dev *pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *from) {
+    int i = from == NULL ? 0 : (from - pci_devices) + 1;
+    for (; i < pci_ndevices; i++) {
+        if (pci_devices[i].class == class && pci_devices[i].subclass == subclass) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+struct pci_dev *pci_find_device(uint16_t vendor, uint16_t device, struct pci_dev *from) {
+    int i = from == NULL ? 0 : (from - pci_devices) + 1;
+    for (; i < pci_ndevices; i++) {
+        if (pci_devices[i].vendor == vendor && pci_devices[i].device == device) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Base address of BAR n with the type bits stripped
+uint32_t pci_bar(struct pci_dev *dev, int n) {
+    uint32_t bar = pci_read32(dev, PCI_BAR0 + n * 4);
+    return (bar & PCI_BAR_IO) ? (bar & ~0x3) : (bar & ~0xF);
+}
+
+// Writes the command register with zeros in the status half, whose bits
+// are write-1-to-clear
+void pci_enable(struct pci_dev *dev, uint16_t command_bits) {
+    pci_write32(dev, PCI_COMMAND, pci_read16(dev, PCI_COMMAND) | command_bits);
+}
+
+int pci_alloc_vector(void) {
+    static volatile uint32_t next = MSI_VECTOR_BASE;
+    uint32_t vector = atomic_xadd(&next, 1);
+    return vector < MSI_VECTOR_END ? (int)vector : -1;
+}
+
+/*
+ * Points the device's MSI capability at vector on the boot CPU and turns
+ * INTx off. Returns -1 if the device has no MSI or there is no local APIC
+ * to receive the message.
+ */
+int pci_enable_msi(struct pci_dev *dev, uint8_t vector) {
+    if (!apic_enabled || !(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST)) {
+        return -1;
+    }
+
+    uint8_t cap = pci_read8(dev, PCI_CAP_PTR) & 0xFC;
+    while (cap != 0) {
+        if (pci_read8(dev, cap) == PCI_CAP_ID_MSI) {
+            break;
+        }
+        cap = pci_read8(dev, cap + 1) & 0xFC;
+    }
+    if (cap == 0) {
+        return -1;
+    }
+
+    uint16_t control = pci_read16(dev, cap + 2);
+    pci_write32(dev, cap + 4, 0xFEE00000 | (lapic_id() << 12));
+    if (control & 0x80) {
+        // 64-bit address capable: upper address, then data at +12
+        pci_write32(dev, cap + 8, 0);
+        pci_write16(dev, cap + 12, vector);
+    } else {
+        pci_write16(dev, cap + 8, vector);
+    }
+    // One message, enabled
+    pci_write16(dev, cap + 2, (control & ~0x70) | 0x01);
+    pci_enable(dev, PCI_COMMAND_INTX_DISABLE);
+    return 0;
+}
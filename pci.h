@@ -0,0 +1,67 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_CLASS_REVISION  0x08
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_CAP_PTR         0x34
+#define PCI_INTERRUPT_LINE  0x3C
+
+#define PCI_COMMAND_IO            0x001
+#define PCI_COMMAND_MEMORY        0x002
+#define PCI_COMMAND_MASTER        0x004
+#define PCI_COMMAND_INTX_DISABLE  0x400
+
+#define PCI_STATUS_CAP_LIST 0x10
+#define PCI_CAP_ID_MSI      0x05
+
+#define PCI_BAR_IO          0x1    // BAR bit 0: I/O space rather than memory
+
+// MSI vectors are handed out from this range
+#define MSI_VECTOR_BASE     0x50
+#define MSI_VECTOR_END      0x60
+
+#define PCI_MAX_DEVICES     32
+
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor;
+    uint16_t device;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;        // Legacy INTx line as assigned by the BIOS
+};
+
+extern struct pci_dev pci_devices[PCI_MAX_DEVICES];
+extern int pci_ndevices;
+
+void pci_init(void);
+uint32_t pci_read32(struct pci_dev *dev, uint8_t offset);
+uint16_t pci_read16(struct pci_dev *dev, uint8_t offset);
+uint8_t pci_read8(struct pci_dev *dev, uint8_t offset);
+void pci_write32(struct pci_dev *dev, uint8_t offset, uint32_t value);
+void pci_write16(struct pci_dev *dev, uint8_t offset, uint16_t value);
+
+// Searches start after from, or from the first device if from is NULL
+struct pci_dev *pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *from);
+struct pci_dev *pci_find_device(uint16_t vendor, uint16_t device, struct pci_dev *from);
+
+uint32_t pci_bar(struct pci_dev *dev, int n);
+void pci_enable(struct pci_dev *dev, uint16_t command_bits);
+int pci_alloc_vector(void);
+int pci_enable_msi(struct pci_dev *dev, uint8_t vector);
+
+#endif
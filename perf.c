@@ -0,0 +1,146 @@
+/*
+ * perf.c
+ *
+ * Architectural PMU setup and the combined statistics dump. See perf.h.
+ */
+
+#include <stdint.h>
+#include "perf.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "rprintf.h"
+
+
+int perf_hw_version;
+int perf_hw_nr;
+enum perf_hw_event perf_hw_events[PERF_HW_NR_EVENTS];
+
+#define PERF_HW_NAME(name, event, umask, bit) #name,
+const char *perf_hw_names[] = { PERF_HW_EVENTS(PERF_HW_NAME) };
+#undef PERF_HW_NAME
+
+#define PERF_HW_SEL(name, event, umask, bit) ((umask) << 8) | (event),
+static const uint32_t perf_hw_select[] = { PERF_HW_EVENTS(PERF_HW_SEL) };
+#undef PERF_HW_SEL
+
+#define PERF_HW_BIT(name, event, umask, bit) bit,
+static const uint8_t perf_hw_missing_bit[] = { PERF_HW_EVENTS(PERF_HW_BIT) };
+#undef PERF_HW_BIT
+
+#define PERF_SW_DESC(name, desc) desc,
+static const char *perf_sw_desc[] = { PERF_SW_COUNTERS(PERF_SW_DESC) };
+#undef PERF_SW_DESC
+
+static int perf_hw_width;
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *edx) {
+    uint32_t ecx;
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Picks the events to count from CPUID leaf 0xA; runs once, on the boot CPU
+static void perf_hw_probe(void) {
+    uint32_t eax, ebx, edx;
+
+    cpuid(0, &eax, &ebx, &edx);
+    if (eax < 0xA) {
+        return;
+    }
+    cpuid(0xA, &eax, &ebx, &edx);
+    perf_hw_version = eax & 0xFF;
+    if (perf_hw_version == 0) {
+        return;
+    }
+
+    int ngp = (eax >> 8) & 0xFF;         // General-purpose counters
+    perf_hw_width = (eax >> 16) & 0xFF;
+    int nbits = (eax >> 24) & 0xFF;      // Valid bits in EBX
+    for (int e = 0; e < PERF_HW_NR_EVENTS && perf_hw_nr < ngp; e++) {
+        int bit = perf_hw_missing_bit[e];
+        if (bit < nbits && !(ebx & (1 << bit))) {
+            perf_hw_events[perf_hw_nr++] = e;
+        }
+    }
+}
+
+/*
+ * Programs this CPU's counters with the events the boot CPU chose. Every
+ * CPU calls it once, the boot CPU first.
+ */
+void perf_init_cpu(void) {
+    if (cpu_id() == 0) {
+        perf_hw_probe();
+    }
+    if (perf_hw_nr == 0) {
+        return;
+    }
+
+    uint64_t enable = 0;
+    for (int i = 0; i < perf_hw_nr; i++) {
+        wrmsr(MSR_PERFEVTSEL0 + i, 0);
+        wrmsr(MSR_PMC0 + i, 0);
+        wrmsr(MSR_PERFEVTSEL0 + i, perf_hw_select[perf_hw_events[i]] |
+              PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+        enable |= 1 << i;
+    }
+    // Version 2 added a global enable, and its reset value may leave them off
+    if (perf_hw_version >= 2) {
+        wrmsr(MSR_PERF_GLOBAL_CTRL, enable);
+    }
+}
+
+uint32_t perf_sw_total(enum perf_sw_counter counter) {
+    uint32_t total = 0;
+    for (int i = 0; i < ncpus; i++) {
+        total += cpus[i].perf_sw[counter];
+    }
+    return total;
+}
+
+/*
+ * Everything in one place: the calling CPU's hardware counters, the
+ * software counters per CPU, and the interrupt count of every vector that
+ * has fired. Pass putc for the console or serial_putc for COM1 alone.
+ */
+void perf_stats_dump(int (*out)(int)) {
+    esp_printf(out, "perf statistics:\r\n");
+
+    if (perf_hw_nr == 0) {
+        esp_printf(out, "pmu: not available (no architectural PMU in CPUID leaf 0xA)\r\n");
+    } else {
+        struct perf_hw_sample s;
+        perf_hw_read(&s);
+        esp_printf(out, "pmu: version %d, %d counters, %d bits; cpu %d since boot, in thousands:\r\n",
+                   perf_hw_version, perf_hw_nr, perf_hw_width, cpu_id());
+        for (int i = 0; i < perf_hw_nr; i++) {
+            esp_printf(out, "  %-10s %10d\r\n", perf_hw_names[perf_hw_events[i]],
+                       (uint32_t)div64_32(s.count[i], 1000));
+        }
+    }
+
+    esp_printf(out, "  %-26s %10s", "counter", "total");
+    for (int c = 0; c < ncpus; c++) {
+        esp_printf(out, "       cpu%d", c);
+    }
+    esp_printf(out, "\r\n");
+    for (int i = 0; i < PERF_SW_NR; i++) {
+        esp_printf(out, "  %-26s %10d", perf_sw_desc[i], perf_sw_total(i));
+        for (int c = 0; c < ncpus; c++) {
+            esp_printf(out, " %10d", cpus[c].perf_sw[i]);
+        }
+        esp_printf(out, "\r\n");
+    }
+
+    esp_printf(out, "  interrupts by vector:\r\n");
+    for (int v = 0; v < IDT_SIZE; v++) {
+        uint32_t total = irq_get_count(v);
+        if (total == 0) {
+            continue;
+        }
+        esp_printf(out, "  vector %-19d %10d", v, total);
+        for (int c = 0; c < ncpus; c++) {
+            esp_printf(out, " %10d", cpus[c].irq_counts[v]);
+        }
+        esp_printf(out, "\r\n");
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include "smp.h"
+
+/*
+ * Performance counters.
+ *
+ * Software counters are always on. Each CPU has its own set in struct cpu,
+ * and perf_count() adds to it with a single %fs-relative instruction, so a
+ * count needs no lock and cannot land on another CPU's set even if the
+ * thread migrates. Interrupts are counted per vector the same way, in
+ * struct cpu's irq_counts (irq_dispatch()). perf_stats_dump() sums both
+ * across CPUs.
+ *
+ * Hardware counters use the architectural PMU (CPUID leaf 0xA): the events
+ * below that the CPU supports are programmed into the general-purpose
+ * counters and read with rdpmc. Under plain QEMU (TCG) there is no PMU and
+ * perf_hw_nr stays 0; use -enable-kvm -cpu host to get one. The counters
+ * are per CPU and count both rings.
+ */
+
+// X(name, description)
+#define PERF_SW_COUNTERS(X)                                     \
+    X(SECTORS_READ,    "sectors read")                          \
+    X(SECTORS_WRITTEN, "sectors written")                       \
+    X(SECTORS_MAPPED,  "sectors mapped zero-copy")              \
+    X(RA_HITS,         "FAT readahead hits")                    \
+    X(RA_MISSES,       "FAT readahead misses")                  \
+    X(FRAMES_ALLOC,    "frames allocated")                      \
+    X(FRAMES_FREED,    "frames freed")                          \
+    X(PAGE_FAULTS,     "page faults")
+
+#define PERF_SW_ENUM(name, desc) PERF_##name,
+enum perf_sw_counter {
+    PERF_SW_COUNTERS(PERF_SW_ENUM)
+    PERF_SW_NR
+};
+#undef PERF_SW_ENUM
+
+_Static_assert(PERF_SW_NR <= PERF_SW_SLOTS, "raise PERF_SW_SLOTS in smp.h");
+
+// Adds n to the calling CPU's counter; usable from interrupt handlers
+#define perf_count(counter, n)                                                  \
+    asm volatile("addl %1, %%fs:%c0"                                            \
+                 : : "i"(__builtin_offsetof(struct cpu, perf_sw) + 4 * (counter)), \
+                     "ri"((uint32_t)(n)))
+
+// X(name, event select, unit mask, CPUID.0AH:EBX bit that says it is missing)
+#define PERF_HW_EVENTS(X)                                       \
+    X(cycles,   0x3C, 0x00, 0)                                  \
+    X(instr,    0xC0, 0x00, 1)                                  \
+    X(llc_ref,  0x2E, 0x4F, 3)                                  \
+    X(llc_miss, 0x2E, 0x41, 4)                                  \
+    X(br_miss,  0xC5, 0x00, 6)
+
+#define PERF_HW_ENUM(name, event, umask, bit) PERF_HW_##name,
+enum perf_hw_event {
+    PERF_HW_EVENTS(PERF_HW_ENUM)
+    PERF_HW_NR_EVENTS
+};
+#undef PERF_HW_ENUM
+
+#define MSR_PERFEVTSEL0         0x186
+#define MSR_PMC0                0xC1
+#define MSR_PERF_GLOBAL_CTRL    0x38F
+
+#define PERFEVTSEL_USR          (1 << 16)
+#define PERFEVTSEL_OS           (1 << 17)
+#define PERFEVTSEL_EN           (1 << 22)
+
+// Counter values for every programmed event, in perf_hw_events[] order
+struct perf_hw_sample {
+    uint64_t count[PERF_HW_NR_EVENTS];
+};
+
+extern int perf_hw_version;                     // Architectural PMU version, 0 if none
+extern int perf_hw_nr;                          // Events programmed on every CPU
+extern enum perf_hw_event perf_hw_events[];     // Which event each counter holds
+extern const char *perf_hw_names[];
+
+static inline uint64_t rdpmc(uint32_t counter) {
+    uint32_t lo, hi;
+    asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Reads the calling CPU's counters; all zero without a PMU
+static inline void perf_hw_read(struct perf_hw_sample *s) {
+    for (int i = 0; i < PERF_HW_NR_EVENTS; i++) {
+        s->count[i] = i < perf_hw_nr ? rdpmc(i) : 0;
+    }
+}
+
+void perf_init_cpu(void);
+uint32_t perf_sw_total(enum perf_sw_counter counter);
+void perf_stats_dump(int (*out)(int));
+
+#endif
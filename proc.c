@@ -0,0 +1,278 @@
+/*
+ * proc.c
+ *
+ * User mode processes.
+ *
+ * Each process has its own page directory (see pd_create in page.c) and runs
+ * in one kernel thread. The thread loads the program into the new address
+ * space from its own context, so it can copy straight to user addresses,
+ * then drops to ring 3 with enter_user_mode(). System calls and interrupts
+ * bring it back onto the thread's kernel stack through the TSS.
+ */
+
+#include <stdint.h>
+#include "proc.h"
+#include "elf.h"
+#include "fat.h"
+#include "interrupt.h"
+#include "rprintf.h"
+
+struct process procs[MAX_PROCS];
+static int next_pid = 1;
+
+extern void *memcpy(void *dest, const void *src, int n);
+extern int putc(int data);
+
+struct process *current_process(void) {
+    return current_thread()->proc;
+}
+
+// Hands out the next 4 KB page of the process's frames.
+static uint32_t proc_alloc_page(struct process *p) {
+    if (p->frames == NULL || p->frame_used >= KHEAP_SLOT_SIZE) {
+        struct ppage *frame = allocate_physical_pages(1);
+        if (frame == NULL) {
+            return 0;
+        }
+        frame->next = p->frames;
+        p->frames = frame;
+        p->frame_used = 0;
+    }
+
+    uint32_t paddr = (uint32_t)p->frames->physical_addr + p->frame_used;
+    p->frame_used += PAGE_SIZE;
+    return paddr;
+}
+
+/*
+ * Backs [start, end) with zeroed user pages in p's address space, which must
+ * be the active one.
+ */
+static int proc_map_range(struct process *p, uint32_t start, uint32_t end, uint32_t flags) {
+    for (uint32_t v = start & ~(PAGE_SIZE - 1); v < end; v += PAGE_SIZE) {
+        struct page *pte = get_pte(p->pd, v);
+        if (pte != NULL && pte->present) {
+            if (flags & PAGE_RW) {
+                pte->rw = 1;
+            }
+            continue;
+        }
+
+        uint32_t paddr = proc_alloc_page(p);
+        if (paddr == 0) {
+            return -1;
+        }
+        map_page(p->pd, v, paddr, flags | PAGE_USER);
+
+        // Through the direct map: with CR0.WP a read-only page would fault
+        uint32_t *words = phys_to_virt(paddr);
+        for (int i = 0; i < PAGE_SIZE / 4; i++) {
+            words[i] = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies len bytes to vaddr in p's address space, which proc_map_range()
+ * has backed. Goes through the direct map one page at a time, so pages the
+ * process may only read can still be filled.
+ */
+static void proc_copy_out(struct process *p, uint32_t vaddr, const char *src, uint32_t len) {
+    while (len > 0) {
+        uint32_t off = vaddr & (PAGE_SIZE - 1);
+        uint32_t n = PAGE_SIZE - off < len ? PAGE_SIZE - off : len;
+        struct page *pte = get_pte(p->pd, vaddr);
+        memcpy((char *)phys_to_virt(pte->frame << 12) + off, src, n);
+        vaddr += n;
+        src += n;
+        len -= n;
+    }
+}
+
+static int load_elf(struct process *p, const char *image, uint32_t size, uint32_t *entry) {
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *)image;
+
+    if (size < sizeof(Elf32_Ehdr) ||
+        eh->e_ident[0] != ELFMAG0 || eh->e_ident[1] != 'E' ||
+        eh->e_ident[2] != 'L' || eh->e_ident[3] != 'F' ||
+        eh->e_ident[4] != ELFCLASS32 || eh->e_ident[5] != ELFDATA2LSB ||
+        eh->e_type != ET_EXEC || eh->e_machine != EM_386 ||
+        eh->e_phentsize != sizeof(Elf32_Phdr)) {
+        esp_printf(putc, "exec: %s is not an i386 ELF executable\r\n", p->name);
+        return -1;
+    }
+    if (eh->e_phoff > size || eh->e_phnum * sizeof(Elf32_Phdr) > size - eh->e_phoff) {
+        return -1;
+    }
+
+    const Elf32_Phdr *ph = (const Elf32_Phdr *)(image + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; i++, ph++) {
+        if (ph->p_type != PT_LOAD) {
+            continue;
+        }
+        if (ph->p_vaddr < USER_BASE || ph->p_memsz < ph->p_filesz ||
+            ph->p_vaddr + ph->p_memsz < ph->p_vaddr ||
+            ph->p_vaddr + ph->p_memsz > USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE ||
+            ph->p_offset > size || ph->p_filesz > size - ph->p_offset) {
+            esp_printf(putc, "exec: bad program header %d\r\n", i);
+            return -1;
+        }
+        uint32_t flags = (ph->p_flags & PF_W) ? PAGE_RW : 0;
+        if (proc_map_range(p, ph->p_vaddr, ph->p_vaddr + ph->p_memsz, flags) < 0) {
+            return -1;
+        }
+        proc_copy_out(p, ph->p_vaddr, image + ph->p_offset, ph->p_filesz);
+    }
+
+    *entry = eh->e_entry;
+    return 0;
+}
+
+// Loads an ELF file from the FAT volume through a file mapping.
+static int load_elf_file(struct process *p, uint32_t *entry) {
+    int fd = fatOpen(p->path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint32_t size = fatSize(fd);
+    char *image = fat_mmap(fd, 0, size);
+    fatClose(fd);  // The mapping keeps what it needs
+    if (image == NULL) {
+        return -1;
+    }
+    int ret = load_elf(p, image, size, entry);
+    fat_munmap(image);
+    return ret;
+}
+
+// Body of a process's kernel thread: load the program, then enter ring 3.
+static void proc_thread(void *arg) {
+    struct process *p = (struct process *)arg;
+    uint32_t entry;
+
+    if (p->path != NULL) {
+        if (load_elf_file(p, &entry) < 0) {
+            proc_exit(-1);
+        }
+    } else {
+        if (proc_map_range(p, USER_BASE, USER_BASE + p->image_size, 0) < 0) {
+            proc_exit(-1);
+        }
+        proc_copy_out(p, USER_BASE, p->image, p->image_size);
+        entry = USER_BASE + p->entry_offset;
+    }
+
+    if (proc_map_range(p, USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE,
+                       USER_STACK_TOP, PAGE_RW) < 0) {
+        proc_exit(-1);
+    }
+    enter_user_mode(entry, USER_STACK_TOP);
+}
+
+static struct process *proc_create(const char *name) {
+    for (int i = 0; i < MAX_PROCS; i++) {
+        struct process *p = &procs[i];
+        if (p->state != PROC_UNUSED) {
+            continue;
+        }
+
+        p->pd = pd_create();
+        if (p->pd == NULL) {
+            return NULL;
+        }
+        p->pid = next_pid++;
+        p->frames = NULL;
+        p->frame_used = 0;
+        p->path = NULL;
+        p->image = NULL;
+        p->exit_code = 0;
+        p->exit_wait.head = NULL;
+        int k = 0;
+        while (name[k] != '\0' && k < sizeof(p->name) - 1) {
+            p->name[k] = name[k];
+            k++;
+        }
+        p->name[k] = '\0';
+        p->state = PROC_RUNNING;
+        return p;
+    }
+    return NULL;
+}
+
+static int proc_start(struct process *p) {
+    // Keep the thread from running until it knows its address space
+    p->thread = kthread_new(proc_thread, p, p->name);
+    if (p->thread == NULL) {
+        pd_destroy(p->pd);
+        p->state = PROC_UNUSED;
+        return -1;
+    }
+    p->thread->proc = p;
+    p->thread->pgdir = p->pd;
+    kthread_start(p->thread);
+    return p->pid;
+}
+
+// Starts a new process running the ELF executable at path.
+int proc_exec(const char *path) {
+    struct process *p = proc_create(path);
+    if (p == NULL) {
+        return -1;
+    }
+    p->path = path;
+    return proc_start(p);
+}
+
+/*
+ * Starts a new process from a position-independent code image, which is
+ * copied to USER_BASE. Used for code built into the kernel.
+ */
+int proc_spawn_image(const char *name, const void *image, uint32_t size, uint32_t entry_offset) {
+    struct process *p = proc_create(name);
+    if (p == NULL) {
+        return -1;
+    }
+    p->image = image;
+    p->image_size = size;
+    p->entry_offset = entry_offset;
+    return proc_start(p);
+}
+
+// Tears down the calling process. Does not return.
+void proc_exit(int code) {
+    struct process *p = current_process();
+    struct thread *t = current_thread();
+
+    irq_save();
+    t->proc = NULL;
+    t->pgdir = NULL;
+    pd_destroy(p->pd);
+    free_physical_pages_list(p->frames);
+    p->frames = NULL;
+    p->exit_code = code;
+    p->state = PROC_ZOMBIE;
+    wait_queue_wake_all(&p->exit_wait);
+    kthread_exit();
+}
+
+// Waits for process pid to exit and returns its exit code.
+int proc_wait(int pid) {
+    for (int i = 0; i < MAX_PROCS; i++) {
+        struct process *p = &procs[i];
+        if (p->state == PROC_UNUSED || p->pid != pid) {
+            continue;
+        }
+
+        uint32_t flags = spin_lock_irqsave(&p->exit_wait.lock);
+        while (p->state != PROC_ZOMBIE) {
+            wait_queue_sleep_locked(&p->exit_wait);
+        }
+        int code = p->exit_code;
+        p->state = PROC_UNUSED;
+        spin_unlock_irqrestore(&p->exit_wait.lock, flags);
+        return code;
+    }
+    return -1;
+}
@@ -0,0 +1,50 @@
+#ifndef __PROC_H__
+#define __PROC_H__
+
+#include <stdint.h>
+#include "page.h"
+#include "sched.h"
+
+#define MAX_PROCS         8
+#define USER_STACK_TOP    USER_TOP
+#define USER_STACK_PAGES  4
+
+// Selectors for the ring 3 descriptors in gdt[]
+#define USER_CODE_SEL     0x1B
+#define USER_DATA_SEL     0x23
+
+enum proc_state {
+    PROC_UNUSED = 0,
+    PROC_RUNNING,
+    PROC_ZOMBIE,
+};
+
+struct process {
+    int pid;
+    int state;
+    char name[16];
+    struct page_directory_entry *pd;
+    struct ppage *frames;       // Frames backing user memory, newest first
+    uint32_t frame_used;        // Bytes handed out from the newest frame
+    struct thread *thread;
+
+    // What to load: an ELF file on the FAT volume, or a raw code image
+    const char *path;
+    const void *image;
+    uint32_t image_size;
+    uint32_t entry_offset;
+
+    int exit_code;
+    struct wait_queue exit_wait;
+};
+
+int proc_exec(const char *path);
+int proc_spawn_image(const char *name, const void *image, uint32_t size, uint32_t entry_offset);
+int proc_wait(int pid);
+void proc_exit(int code);
+struct process *current_process(void);
+
+// Implemented in src/syscall_entry.s
+void enter_user_mode(uint32_t entry, uint32_t user_esp);
+
+#endif
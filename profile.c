@@ -0,0 +1,139 @@
+/*
+ * profile.c
+ *
+ * Timer-driven sampling, one histogram per CPU so the tick never takes a
+ * lock. The dump that profile_report.py reads:
+ *
+ *   PROFILE-BEGIN hz=<ticks per second> samples=<n> dropped=<n>
+ *   P <eip hex> <count>
+ *   S <pc hex> <pc hex> ...          (one stack, leaf first)
+ *   PROFILE-END
+ */
+
+#include "profile.h"
+#include "sched.h"
+#include "page.h"
+#include "timer.h"
+#include "serial.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+extern void memset(char *s, char c, unsigned int n);
+
+volatile int profile_enabled;
+static struct profile_cpu profile_cpus[MAX_CPUS];
+
+void profile_start(void) {
+    memset((char *)profile_cpus, 0, sizeof(profile_cpus));
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        profile_cpus[cpu].seed = 2463534242u + cpu;
+    }
+    profile_enabled = 1;
+}
+
+void profile_stop(void) {
+    profile_enabled = 0;
+}
+
+static void profile_count(struct profile_cpu *pc, uint32_t eip) {
+    uint32_t h = (eip >> 2) * 2654435761u;
+    for (int probe = 0; probe < PROFILE_HASH_SIZE; probe++) {
+        struct profile_bucket *b = &pc->hist[(h + probe) & (PROFILE_HASH_SIZE - 1)];
+        if (b->eip == eip || b->count == 0) {
+            b->eip = eip;
+            b->count++;
+            return;
+        }
+    }
+    pc->dropped++;
+}
+
+// Slot for this sample's stack, or NULL if it is not kept. Sample n
+// replaces a random kept one with probability PROFILE_STACKS / n.
+static struct profile_stack *profile_stack_slot(struct profile_cpu *pc) {
+    if (pc->nstacks < PROFILE_STACKS) {
+        return &pc->stacks[pc->nstacks++];
+    }
+    pc->seed ^= pc->seed << 13;
+    pc->seed ^= pc->seed >> 17;
+    pc->seed ^= pc->seed << 5;
+    uint32_t j = pc->seed % pc->samples;
+    return j < PROFILE_STACKS ? &pc->stacks[j] : NULL;
+}
+
+// Follows saved %ebp links while they stay inside the interrupted stack
+static void profile_unwind(struct profile_cpu *pc, struct regs *r) {
+    struct profile_stack *s = profile_stack_slot(pc);
+    if (s == NULL) {
+        return;
+    }
+    uint32_t lo, hi;
+    struct thread *t = sched_running ? current_thread() : NULL;
+    if (t != NULL) {
+        hi = t->stack_top;
+        lo = hi - KSTACK_PAGES * PAGE_SIZE;
+    } else {
+        lo = r->esp_dummy;
+        hi = lo + KSTACK_PAGES * PAGE_SIZE;
+    }
+
+    s->pc[0] = r->eip;
+    s->depth = 1;
+    uint32_t fp = r->ebp;
+    while (s->depth < PROFILE_DEPTH && fp >= lo && fp + 8 <= hi && (fp & 3) == 0) {
+        uint32_t *frame = (uint32_t *)fp;
+        uint32_t ret = frame[1];
+        if (ret == 0) {
+            break;
+        }
+        s->pc[s->depth++] = ret;
+        if (frame[0] <= fp) {
+            break;  // Frames only grow toward the top of the stack
+        }
+        fp = frame[0];
+    }
+}
+
+// Called from the timer interrupt on every CPU
+void profile_tick(struct regs *r) {
+    if (!profile_enabled) {
+        return;
+    }
+    struct profile_cpu *pc = &profile_cpus[cpu_id()];
+    pc->samples++;
+    profile_count(pc, r->eip);
+    if ((r->cs & 3) == 0) {
+        profile_unwind(pc, r);
+    }
+}
+
+void profile_dump(void) {
+    int was_enabled = profile_enabled;
+    uint32_t samples = 0, dropped = 0;
+
+    profile_enabled = 0;
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        samples += profile_cpus[cpu].samples;
+        dropped += profile_cpus[cpu].dropped;
+    }
+    esp_printf(serial_putc, "PROFILE-BEGIN hz=%d samples=%d dropped=%d\r\n", timer_hz, samples,
+               dropped);
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        struct profile_cpu *pc = &profile_cpus[cpu];
+        for (int i = 0; i < PROFILE_HASH_SIZE; i++) {
+            if (pc->hist[i].count != 0) {
+                esp_printf(serial_putc, "P %x %d\r\n", pc->hist[i].eip, pc->hist[i].count);
+            }
+        }
+        for (uint32_t i = 0; i < pc->nstacks; i++) {
+            struct profile_stack *s = &pc->stacks[i];
+            esp_printf(serial_putc, "S");
+            for (uint32_t d = 0; d < s->depth; d++) {
+                esp_printf(serial_putc, " %x", s->pc[d]);
+            }
+            esp_printf(serial_putc, "\r\n");
+        }
+    }
+    esp_printf(serial_putc, "PROFILE-END\r\n");
+    profile_enabled = was_enabled;
+}
@@ -0,0 +1,48 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/*
+ * Sampling profiler. Every timer tick on each CPU, profile_tick() counts
+ * the interrupted EIP in that CPU's histogram. For kernel-mode samples it
+ * also walks the saved frame pointers (CFLAGS has -fno-omit-frame-pointer,
+ * so this holds at any -O level) for folded-stack output. The stacks kept are a
+ * uniform sample of the whole run (reservoir sampling), not its first
+ * PROFILE_STACKS ticks.
+ * profile_dump() prints both to COM1, and profile_report.py symbolises
+ * them against the kernel ELF ('make profile').
+ */
+
+#define PROFILE_HASH_SIZE   1024    // Distinct EIPs per CPU; a power of two
+#define PROFILE_STACKS      256     // Stack samples kept per CPU
+#define PROFILE_DEPTH       12      // Frames per stack sample, leaf first
+
+struct profile_bucket {
+    uint32_t eip;
+    uint32_t count;
+};
+
+struct profile_stack {
+    uint32_t depth;
+    uint32_t pc[PROFILE_DEPTH];
+};
+
+struct profile_cpu {
+    struct profile_bucket hist[PROFILE_HASH_SIZE];
+    struct profile_stack stacks[PROFILE_STACKS];
+    uint32_t nstacks;
+    uint32_t seed;              // xorshift state for picking which stacks to keep
+    uint32_t samples;
+    uint32_t dropped;           // EIPs that found the histogram full
+};
+
+extern volatile int profile_enabled;
+
+void profile_start(void);
+void profile_stop(void);
+void profile_tick(struct regs *r);
+void profile_dump(void);
+
+#endif
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# Symbolises the sampling profile in a kernel serial log (profile.c).
+#
+#   profile_report.py <kernel ELF> <serial log> [--folded FILE] [--objdump CMD] [--top N]
+#
+# Prints a flat profile (samples per function) and writes folded stacks,
+# root first, one "a;b;c count" line each, for flamegraph.pl or speedscope.
+
+import argparse
+import bisect
+import collections
+import subprocess
+import sys
+
+
+def load_symbols(objdump, kernel):
+    out = subprocess.check_output([objdump, "-t", kernel], universal_newlines=True)
+    syms = []
+    for line in out.splitlines():
+        # 00101234 g     F .text  00000123 name
+        parts = line.split()
+        if len(parts) >= 6 and parts[-3] == ".text" and "F" in parts[1:-3]:
+            syms.append((int(parts[0], 16), int(parts[-2], 16), parts[-1]))
+    syms.sort()
+    return syms
+
+
+def symbolise(syms, starts, addr):
+    i = bisect.bisect_right(starts, addr) - 1
+    if i >= 0:
+        start, size, name = syms[i]
+        if addr < start + max(size, 1):
+            return name
+    return "[user]" if addr >= 0x00400000 and addr < 0xC0000000 else "[unknown]"
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("kernel")
+    ap.add_argument("log")
+    ap.add_argument("--folded", default="profile.folded")
+    ap.add_argument("--objdump", default="objdump")
+    ap.add_argument("--top", type=int, default=30)
+    args = ap.parse_args()
+
+    syms = load_symbols(args.objdump, args.kernel)
+    starts = [s[0] for s in syms]
+
+    flat = collections.Counter()
+    folded = collections.Counter()
+    total = 0
+    header = ""
+    with open(args.log, errors="replace") as f:
+        for line in f:
+            words = line.split()
+            if not words:
+                continue
+            try:
+                if words[0] == "PROFILE-BEGIN":
+                    header = " ".join(words[1:])
+                elif words[0] == "P" and len(words) == 3:
+                    n = int(words[2])
+                    flat[symbolise(syms, starts, int(words[1], 16))] += n
+                    total += n
+                elif words[0] == "S" and len(words) > 1:
+                    pcs = [int(w, 16) for w in words[1:]]
+                    # Return addresses point after the call; look up the call itself
+                    names = [symbolise(syms, starts, pcs[0])]
+                    names += [symbolise(syms, starts, pc - 1) for pc in pcs[1:]]
+                    folded[";".join(reversed(names))] += 1
+            except ValueError:
+                continue  # A line another CPU's output broke up
+
+    if total == 0:
+        sys.exit("profile_report: no profile in %s" % args.log)
+
+    print("Flat profile (%s)" % header)
+    print("%8s %7s  %s" % ("samples", "%", "function"))
+    for name, n in flat.most_common(args.top):
+        print("%8d %6.2f%%  %s" % (n, n * 100.0 / total, name))
+
+    with open(args.folded, "w") as out:
+        for stack, n in sorted(folded.items()):
+            out.write("%s %d\n" % (stack, n))
+    print("Folded stacks: %s (%d distinct)" % (args.folded, len(folded)))
+
+
+if __name__ == "__main__":
+    main()
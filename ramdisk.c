@@ -0,0 +1,81 @@
+/*
+ * ramdisk.c
+ *
+ * Block device over the memory of a boot module. main() has already
+ * reserved the module's frames; the data is read through the direct map.
+ */
+
+#include "ramdisk.h"
+#include "multiboot.h"
+#include "page.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+extern int putc(int data);
+extern void *memcpy(void *dest, const void *src, int n);
+
+static struct ramdisk ramdisk;
+
+static int ramdisk_read(struct blockdev *dev, uint32_t lba, char *buf, uint32_t count) {
+    struct ramdisk *rd = (struct ramdisk *)dev->private;
+    memcpy(buf, rd->base + lba * 512, count * 512);
+    return 0;
+}
+
+static int ramdisk_write(struct blockdev *dev, uint32_t lba, const char *buf, uint32_t count) {
+    struct ramdisk *rd = (struct ramdisk *)dev->private;
+    memcpy(rd->base + lba * 512, buf, count * 512);
+    return 0;
+}
+
+// Completes at once; there is nothing to wait for
+static int ramdisk_submit(struct blockdev *dev, struct blk_request *req, blk_callback_t callback) {
+    req->status = ramdisk_read(dev, req->lba, req->buf, req->count);
+    req->callback = callback;
+    callback(req);
+    return 0;
+}
+
+static uint32_t ramdisk_queue_depth(struct blockdev *dev) {
+    return 1;
+}
+
+static char *ramdisk_map(struct blockdev *dev, uint32_t lba, uint32_t count) {
+    struct ramdisk *rd = (struct ramdisk *)dev->private;
+    return rd->base + lba * 512;
+}
+
+static const struct blockdev_ops ramdisk_ops = {
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .flush = NULL,
+    .submit = ramdisk_submit,
+    .queue_depth = ramdisk_queue_depth,
+    .map = ramdisk_map,
+};
+
+// Registers the "ramdisk" boot module as a block device, if GRUB loaded one
+int ramdisk_init(void) {
+    struct multiboot_module *mod = multiboot_find_module(RAMDISK_MODULE_NAME);
+    if (mod == NULL) {
+        return -1;
+    }
+
+    if (mod->end > DIRECT_MAP_SIZE) {
+        esp_printf(putc, "ram0: module at 0x%x is outside the direct map\r\n", mod->start);
+        return -1;
+    }
+
+    struct ramdisk *rd = &ramdisk;
+    rd->base = phys_to_virt(mod->start);
+    rd->sectors = (mod->end - mod->start) / 512;
+
+    blockdev_init(&rd->bdev, "ram0", &ramdisk_ops, rd->sectors, rd);
+
+    esp_printf(putc, "ram0: %d sectors at 0x%x\r\n", rd->sectors, mod->start);
+    return 0;
+}
+
+struct blockdev *ramdisk_get(void) {
+    return ramdisk.sectors != 0 ? &ramdisk.bdev : NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef __RAMDISK_H__
+#define __RAMDISK_H__
+
+#include <stdint.h>
+#include "blockdev.h"
+
+/*
+ * RAM disk backed by a multiboot2 module. GRUB reads the image once at boot
+ * ("module2 /boot/ramdisk.img ramdisk" in grub.cfg). After that every
+ * access is a memory copy. blockdev_map() hands out pointers straight into
+ * the image, so readers that can use them do not copy at all.
+ */
+
+#define RAMDISK_MODULE_NAME "ramdisk"
+
+struct ramdisk {
+    char *base;                 // Module memory, in the direct map
+    uint32_t sectors;
+    struct blockdev bdev;
+};
+
+int ramdisk_init(void);
+struct blockdev *ramdisk_get(void);
+
+#endif
@@ -8,6 +8,7 @@
 /*---------------------------------------------------*/
 
 #include "rprintf.h"
+#include "smp.h"
 /*---------------------------------------------------*/
 /* The purpose of this routine is to output data the */
 /* same as the standard printf function without the  */
@@ -24,6 +25,12 @@ static int num1;
 static int num2;
 static char pad_character;
 
+/* The state above is shared, so one CPU formats at a  */
+/* time. A fault taken while printing may print again  */
+/* on the same CPU; that nested call skips the lock.   */
+DEFINE_SPINLOCK(printf_lock);
+static struct cpu *volatile printf_owner;
+
 size_t strlen(const char *str) {
     unsigned int len = 0;
     while(str[len] != '\0') {
@@ -165,7 +172,23 @@ void esp_printf( const func_ptr f_ptr, charptr ctrl, ...)
   
 }
 
+static void vprintf_locked( const func_ptr f_ptr, charptr ctrl, va_list argp);
+
 void esp_vprintf( const func_ptr f_ptr, charptr ctrl, va_list argp)
+{
+   if (printf_owner == this_cpu()) {
+      vprintf_locked(f_ptr, ctrl, argp);
+      return;
+      }
+
+   uint32_t flags = spin_lock_irqsave(&printf_lock);
+   printf_owner = this_cpu();
+   vprintf_locked(f_ptr, ctrl, argp);
+   printf_owner = NULL;
+   spin_unlock_irqrestore(&printf_lock, flags);
+}
+
+static void vprintf_locked( const func_ptr f_ptr, charptr ctrl, va_list argp)
 {
 
    int long_flag;
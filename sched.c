@@ -0,0 +1,584 @@
+/*
+ * sched.c
+ *
+ * Preemptive round-robin scheduler for kernel threads.
+ *
+ * Every thread has its own kernel stack from the frame allocator. Threads
+ * switch by saving their callee-saved registers and stack pointer in
+ * context_switch() (src/switch.s). The timer handler calls sched_tick() on
+ * every tick and sched_preempt() after sending EOI, so a thread whose time
+ * slice ran out is switched away from inside the interrupt handler and
+ * resumes by returning through it later.
+ *
+ * Each CPU has its own run queue. A CPU whose queue is empty steals a
+ * waiting thread from the busiest other queue before falling back to its
+ * idle thread, so work spreads across the CPUs without a global lock.
+ */
+
+#include <stdint.h>
+#include "sched.h"
+#include "page.h"
+#include "interrupt.h"
+#include "rprintf.h"
+
+struct thread threads[MAX_THREADS];
+struct runqueue runqueues[MAX_CPUS];
+int sched_running = 0;
+
+static int next_tid = 0;
+DEFINE_SPINLOCK(thread_lock);  // Guards slot allocation in threads[]
+
+static inline struct runqueue *this_rq(void) {
+    return &runqueues[cpu_id()];
+}
+
+static inline int first_set_bit(uint32_t x) {
+    int bit;
+    asm("bsf %1, %0" : "=r"(bit) : "rm"(x));
+    return bit;
+}
+
+static void rq_enqueue(struct runqueue *rq, struct thread *t) {
+    int p = t->priority;
+
+    t->next = NULL;
+    if (rq->tail[p] != NULL) {
+        rq->tail[p]->next = t;
+    } else {
+        rq->head[p] = t;
+    }
+    rq->tail[p] = t;
+    rq->bitmap |= 1 << p;
+    rq->nr_running++;
+}
+
+static struct thread *rq_dequeue(struct runqueue *rq) {
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+
+    int p = first_set_bit(rq->bitmap);
+    struct thread *t = rq->head[p];
+    rq->head[p] = t->next;
+    if (rq->head[p] == NULL) {
+        rq->tail[p] = NULL;
+        rq->bitmap &= ~(1 << p);
+    }
+    t->next = NULL;
+    rq->nr_running--;
+    return t;
+}
+
+/*
+ * Takes the highest-priority thread off rq that is not still finishing a
+ * switch on its old CPU. A thread woken before it managed to switch away is
+ * queued while it still runs, and must not be picked up elsewhere yet.
+ * Pinned threads are never taken.
+ */
+static struct thread *rq_steal(struct runqueue *rq) {
+    for (int p = 0; p < SCHED_PRIORITIES; p++) {
+        struct thread *prev = NULL;
+        for (struct thread *t = rq->head[p]; t != NULL; prev = t, t = t->next) {
+            if (t->on_cpu || t->pinned) {
+                continue;
+            }
+            if (prev != NULL) {
+                prev->next = t->next;
+            } else {
+                rq->head[p] = t->next;
+            }
+            if (rq->tail[p] == t) {
+                rq->tail[p] = prev;
+            }
+            if (rq->head[p] == NULL) {
+                rq->bitmap &= ~(1 << p);
+            }
+            t->next = NULL;
+            rq->nr_running--;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Called with this CPU's run queue locked. Never waits on another queue's lock.
+static struct thread *steal_thread(void) {
+    int self = cpu_id();
+    struct runqueue *victim = NULL;
+    int busiest = 0;
+
+    for (int i = 0; i < ncpus; i++) {
+        if (i != self && runqueues[i].nr_running > busiest) {
+            busiest = runqueues[i].nr_running;
+            victim = &runqueues[i];
+        }
+    }
+    if (victim == NULL || !spin_trylock(&victim->lock)) {
+        return NULL;
+    }
+    struct thread *t = rq_steal(victim);
+    if (t != NULL) {
+        t->cpu = self;
+    }
+    spin_unlock(&victim->lock);
+    return t;
+}
+
+struct thread *current_thread(void) {
+    uint32_t flags = irq_save();
+    struct thread *t = this_rq()->current;
+    irq_restore(flags);
+    return t;
+}
+
+static struct thread *alloc_thread(const char *name) {
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+
+    struct thread *t = NULL;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (threads[i].state == THREAD_UNUSED) {
+            t = &threads[i];
+            t->state = THREAD_BLOCKED;  // Claimed; set properly by the caller
+            t->tid = next_tid++;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&thread_lock, flags);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->priority = SCHED_PRIO_DEFAULT;
+    t->cpu = cpu_id();
+    t->on_cpu = 0;
+    t->pinned = 0;
+    t->next = NULL;
+    t->stack = NULL;
+    t->stack_top = 0;
+    t->proc = NULL;
+    t->pgdir = NULL;
+    int k = 0;
+    while (name[k] != '\0' && k < sizeof(t->name) - 1) {
+        t->name[k] = name[k];
+        k++;
+    }
+    t->name[k] = '\0';
+    return t;
+}
+
+/*
+ * Runs on the stack of the thread just switched to: the previous thread is
+ * off its CPU now, so it may be stolen or freed, and the run queue locked by
+ * schedule() can be released.
+ */
+static void finish_switch(void) {
+    struct runqueue *rq = this_rq();
+
+    rq->prev->on_cpu = 0;
+    spin_unlock(&rq->lock);
+}
+
+// First code a new thread runs, entered through context_switch's ret
+static void kthread_entry(void) {
+    finish_switch();
+    struct thread *t = current_thread();
+
+    asm("sti");
+    t->fn(t->arg);
+    kthread_exit();
+}
+
+/*
+ * Creates a thread without making it runnable, so the caller can finish
+ * setting it up before any CPU picks it up with kthread_start().
+ */
+struct thread *kthread_new(void (*fn)(void *), void *arg, const char *name) {
+    struct thread *t = alloc_thread(name);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->stack = kpage_alloc(KSTACK_PAGES);
+    if (t->stack == NULL) {
+        t->state = THREAD_UNUSED;
+        return NULL;
+    }
+    t->stack_top = (uint32_t)t->stack + KSTACK_PAGES * PAGE_SIZE;
+    t->fn = fn;
+    t->arg = arg;
+
+    // Initial frame popped by context_switch: edi, esi, ebx, ebp, return address
+    uint32_t *sp = (uint32_t *)t->stack_top;
+    *--sp = 0;                          // Fake return address for kthread_entry
+    *--sp = (uint32_t)kthread_entry;
+    *--sp = 0;                          // ebp
+    *--sp = 0;                          // ebx
+    *--sp = 0;                          // esi
+    *--sp = 0;                          // edi
+    t->esp = (uint32_t)sp;
+    return t;
+}
+
+// Pokes an idle CPU so it steals work instead of waiting for its next tick
+static void kick_idle_cpu(void) {
+    int self = cpu_id();
+
+    for (int i = 0; i < ncpus; i++) {
+        if (i != self && runqueues[i].current == runqueues[i].idle) {
+            runqueues[i].need_resched = 1;
+            smp_send_resched(i);
+            return;
+        }
+    }
+}
+
+void kthread_start(struct thread *t) {
+    uint32_t flags = irq_save();
+    struct runqueue *rq = &runqueues[t->cpu];
+
+    spin_lock(&rq->lock);
+    t->state = THREAD_RUNNABLE;
+    rq_enqueue(rq, t);
+    spin_unlock(&rq->lock);
+    kick_idle_cpu();
+    irq_restore(flags);
+}
+
+struct thread *kthread_create(void (*fn)(void *), void *arg, const char *name) {
+    struct thread *t = kthread_new(fn, arg, name);
+    if (t != NULL) {
+        kthread_start(t);
+    }
+    return t;
+}
+
+// Frees the stacks of threads that have exited. Runs from the idle threads.
+static void reap_zombies(void) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        struct thread *t = &threads[i];
+        if (t->state != THREAD_ZOMBIE || t->on_cpu) {
+            continue;
+        }
+
+        uint32_t flags = spin_lock_irqsave(&thread_lock);
+        void *stack = NULL;
+        if (t->state == THREAD_ZOMBIE && !t->on_cpu) {
+            stack = t->stack;
+            t->stack = NULL;
+            t->state = THREAD_UNUSED;
+        }
+        spin_unlock_irqrestore(&thread_lock, flags);
+        if (stack != NULL) {
+            kpage_free(stack);
+        }
+    }
+}
+
+// True if this CPU has queued work or could steal some
+static int work_available(void) {
+    int self = cpu_id();
+
+    if (runqueues[self].bitmap != 0) {
+        return 1;
+    }
+    for (int i = 0; i < ncpus; i++) {
+        if (i != self && runqueues[i].nr_running > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void idle_thread(void *arg) {
+    while (1) {
+        reap_zombies();
+        asm("cli");
+        if (work_available()) {
+            asm("sti");
+            schedule();
+        } else {
+            asm("sti; hlt");  // sti's one-instruction shadow covers the hlt
+        }
+    }
+}
+
+// The boot context of an application processor ends up here as its idle thread
+void sched_idle(void) {
+    idle_thread(NULL);
+}
+
+static int sched_timer_irq(struct regs *r, void *ctx) {
+    sched_tick();
+    return IRQ_HANDLED;
+}
+
+/*
+ * Turns the boot context into the "main" thread and creates the idle thread
+ * that runs when nothing else is runnable.
+ */
+void sched_init(void) {
+    struct runqueue *rq = this_rq();
+
+    struct thread *boot = alloc_thread("main");
+    boot->state = THREAD_RUNNING;
+    boot->on_cpu = 1;
+    boot->timeslice = msecs_to_jiffies(SCHED_TIMESLICE_MS);
+    rq->current = boot;
+
+    rq->idle = kthread_new(idle_thread, NULL, "idle");
+    rq->idle->priority = SCHED_PRIO_IDLE;
+    rq->idle->state = THREAD_RUNNABLE;
+
+    // Chained after the timer's own handler on the tick vector
+    irq_register(timer_vector, sched_timer_irq, NULL);
+    sched_running = 1;
+}
+
+/*
+ * Turns an application processor's boot context, already running on
+ * this_cpu()->boot_stack, into that CPU's idle thread.
+ */
+void sched_init_ap(void) {
+    struct cpu *c = this_cpu();
+    struct runqueue *rq = &runqueues[c->id];
+
+    struct thread *idle = alloc_thread("idle");
+    idle->priority = SCHED_PRIO_IDLE;
+    idle->state = THREAD_RUNNING;
+    idle->on_cpu = 1;
+    idle->stack = c->boot_stack;
+    idle->stack_top = (uint32_t)c->boot_stack + KSTACK_PAGES * PAGE_SIZE;
+    rq->idle = idle;
+    rq->current = idle;
+}
+
+/*
+ * Picks the highest-priority runnable thread and switches to it. The
+ * current thread goes to the back of its priority level if it is still
+ * runnable. With nothing queued locally, a thread is stolen from another
+ * CPU.
+ */
+void schedule(void) {
+    uint32_t flags = irq_save();
+    struct runqueue *rq = this_rq();
+    struct thread *prev = rq->current;
+
+    spin_lock(&rq->lock);
+    rq->need_resched = 0;
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_RUNNABLE;
+        if (prev != rq->idle) {
+            rq_enqueue(rq, prev);
+        }
+    }
+
+    struct thread *next = rq_dequeue(rq);
+    if (next == NULL) {
+        next = steal_thread();
+    }
+    if (next == NULL) {
+        next = rq->idle;
+    }
+    next->state = THREAD_RUNNING;
+    next->timeslice = msecs_to_jiffies(SCHED_TIMESLICE_MS);
+
+    if (next != prev) {
+        rq->current = next;
+        rq->prev = prev;
+        next->on_cpu = 1;
+        // Every address space maps all kernel stacks, so cr3 can change first
+        switch_pd(next->pgdir != NULL ? next->pgdir : pd);
+        if (next->stack_top != 0) {
+            tss_set_kernel_stack(next->stack_top);
+        }
+        context_switch(&prev->esp, next->esp);
+        finish_switch();
+    } else {
+        spin_unlock(&rq->lock);
+    }
+    irq_restore(flags);
+}
+
+void sched_yield(void) {
+    if (sched_running) {
+        schedule();
+    }
+}
+
+// Called from the timer interrupt on every tick.
+void sched_tick(void) {
+    if (!sched_running) {
+        return;
+    }
+
+    struct runqueue *rq = this_rq();
+    struct thread *t = rq->current;
+    if (t == NULL) {
+        return;  // An AP whose scheduler is not set up yet
+    }
+    if (t == rq->idle) {
+        if (rq->bitmap != 0) {
+            rq->need_resched = 1;
+        }
+    } else if (--t->timeslice <= 0) {
+        rq->need_resched = 1;
+    }
+}
+
+// Called by irq_dispatch() after EOI has been sent for a hardware interrupt.
+void sched_preempt(void) {
+    if (sched_running && this_rq()->need_resched && this_rq()->current != NULL) {
+        schedule();
+    }
+}
+
+void sched_wakeup(struct thread *t) {
+    uint32_t flags = irq_save();
+    struct runqueue *rq = &runqueues[t->cpu];
+
+    spin_lock(&rq->lock);
+    int kick = 0;
+    if (t->state == THREAD_BLOCKED) {
+        t->state = THREAD_RUNNABLE;
+        rq_enqueue(rq, t);
+        if (t->priority < rq->current->priority || rq->current == rq->idle) {
+            rq->need_resched = 1;
+            kick = rq != this_rq();
+        }
+    }
+    spin_unlock(&rq->lock);
+    if (kick) {
+        smp_send_resched(rq - runqueues);
+    }
+    irq_restore(flags);
+}
+
+void kthread_exit(void) {
+    irq_save();
+    current_thread()->state = THREAD_ZOMBIE;
+    schedule();
+    while (1);  // Not reached
+}
+
+void kthread_set_priority(struct thread *t, int priority) {
+    if (priority < 0 || priority >= SCHED_PRIORITIES) {
+        return;
+    }
+    t->priority = priority;
+}
+
+/*
+ * Keeps t on the CPU whose run queue it is on now, for code that reads
+ * per-CPU state across a preemption or a sleep.
+ */
+void kthread_set_pinned(struct thread *t, int pinned) {
+    t->pinned = pinned;
+}
+
+static void sleep_timeout(void *data) {
+    sched_wakeup((struct thread *)data);
+}
+
+void kthread_sleep(uint32_t ms) {
+    if (!sched_running) {
+        msleep(ms);
+        return;
+    }
+
+    struct thread *t = current_thread();
+    uint32_t flags = irq_save();
+    timer_setup(&t->sleep_timer, sleep_timeout, t);
+    t->state = THREAD_BLOCKED;
+    mod_timer(&t->sleep_timer, jiffies + msecs_to_jiffies(ms) + 1);
+    schedule();
+    irq_restore(flags);
+}
+
+static void wq_append(struct wait_queue *wq, struct thread *t) {
+    t->next = NULL;
+    struct thread **pp = &wq->head;
+    while (*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    *pp = t;
+}
+
+/*
+ * Blocks the current thread on wq. The caller holds wq->lock with interrupts
+ * disabled and has just found its wake-up condition false; the lock is
+ * dropped while asleep and held again on return. Wakers change the condition
+ * before taking the lock, so a wake-up can not slip in between the test and
+ * the sleep, even from another CPU.
+ */
+void wait_queue_sleep_locked(struct wait_queue *wq) {
+    struct thread *t = current_thread();
+
+    t->state = THREAD_BLOCKED;
+    wq_append(wq, t);
+    spin_unlock(&wq->lock);
+    schedule();
+    spin_lock(&wq->lock);
+}
+
+// Unconditional sleep until the next wake_one/wake_all on wq.
+void wait_queue_sleep(struct wait_queue *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    wait_queue_sleep_locked(wq);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void wait_queue_wake_one(struct wait_queue *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    struct thread *t = wq->head;
+    if (t != NULL) {
+        wq->head = t->next;
+    }
+    spin_unlock(&wq->lock);
+    if (t != NULL) {
+        sched_wakeup(t);
+    }
+    irq_restore(flags);
+}
+
+/*
+ * Wakes every waiter while the caller holds wq->lock, for wait queues that
+ * live in memory the waiter frees as soon as it sees its condition change.
+ */
+void wait_queue_wake_all_locked(struct wait_queue *wq) {
+    while (wq->head != NULL) {
+        struct thread *t = wq->head;
+        wq->head = t->next;
+        sched_wakeup(t);
+    }
+}
+
+void wait_queue_wake_all(struct wait_queue *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    wait_queue_wake_all_locked(wq);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void mutex_lock(struct mutex *m) {
+    uint32_t flags = spin_lock_irqsave(&m->waiters.lock);
+    while (m->locked && sched_running) {
+        wait_queue_sleep_locked(&m->waiters);
+    }
+    m->locked = 1;
+    m->owner = sched_running ? current_thread() : NULL;
+    spin_unlock_irqrestore(&m->waiters.lock, flags);
+}
+
+void mutex_unlock(struct mutex *m) {
+    uint32_t flags = spin_lock_irqsave(&m->waiters.lock);
+    m->locked = 0;
+    m->owner = NULL;
+    struct thread *t = m->waiters.head;
+    if (t != NULL) {
+        m->waiters.head = t->next;
+    }
+    spin_unlock(&m->waiters.lock);
+    if (t != NULL) {
+        sched_wakeup(t);
+    }
+    irq_restore(flags);
+}
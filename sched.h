@@ -0,0 +1,107 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+#include "timer.h"
+#include "smp.h"
+
+struct process;
+struct page_directory_entry;
+
+#define MAX_THREADS         32
+#define SCHED_PRIORITIES    8      // 0 is the highest priority
+#define SCHED_PRIO_DEFAULT  4
+#define SCHED_PRIO_IDLE     (SCHED_PRIORITIES - 1)
+#define SCHED_TIMESLICE_MS  10
+#define KSTACK_PAGES        4      // 16 KB kernel stack per thread
+
+enum thread_state {
+    THREAD_UNUSED = 0,
+    THREAD_RUNNABLE,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_ZOMBIE,
+};
+
+struct thread {
+    uint32_t esp;               // Saved stack pointer; must stay first (switch.s)
+    int tid;
+    int state;
+    int priority;
+    int cpu;                    // Run queue the thread belongs to
+    volatile int on_cpu;        // Still on a CPU's stack; not yet safe to steal or free
+    int pinned;                 // Never stolen, so it only runs on cpu
+    int timeslice;              // Ticks left before preemption
+    char name[16];
+    void (*fn)(void *arg);
+    void *arg;
+    void *stack;                // Base of the kernel stack (kpage_alloc)
+    uint32_t stack_top;
+    struct thread *next;        // Run queue or wait queue link
+    struct timer_list sleep_timer;
+    struct process *proc;       // Owning user process, NULL for kernel threads
+    struct page_directory_entry *pgdir;  // NULL means the kernel's pd
+};
+
+/*
+ * Per-CPU run queue. Each priority level is a FIFO and the bitmap has one bit
+ * per non-empty level, so picking the next thread is a single bsf. The lock
+ * is held across a context switch and released by the thread switched to.
+ */
+struct runqueue {
+    spinlock_t lock;
+    uint32_t bitmap;
+    struct thread *head[SCHED_PRIORITIES];
+    struct thread *tail[SCHED_PRIORITIES];
+    struct thread *current;
+    struct thread *idle;
+    struct thread *prev;        // Thread being switched away from
+    volatile int nr_running;
+    volatile int need_resched;
+};
+
+struct wait_queue {
+    spinlock_t lock;
+    struct thread *head;
+};
+
+// Sleeping lock for resources held across blocking operations such as disk I/O
+struct mutex {
+    volatile int locked;
+    struct thread *owner;
+    struct wait_queue waiters;
+};
+
+extern int sched_running;
+
+void sched_init(void);
+void sched_init_ap(void);
+void sched_idle(void);
+struct thread *kthread_create(void (*fn)(void *), void *arg, const char *name);
+struct thread *kthread_new(void (*fn)(void *), void *arg, const char *name);
+void kthread_start(struct thread *t);
+void kthread_exit(void);
+void kthread_sleep(uint32_t ms);
+void kthread_set_priority(struct thread *t, int priority);
+void kthread_set_pinned(struct thread *t, int pinned);
+struct thread *current_thread(void);
+
+void schedule(void);
+void sched_yield(void);
+void sched_tick(void);
+void sched_preempt(void);
+void sched_wakeup(struct thread *t);
+
+void wait_queue_sleep(struct wait_queue *wq);
+void wait_queue_sleep_locked(struct wait_queue *wq);
+void wait_queue_wake_all_locked(struct wait_queue *wq);
+void wait_queue_wake_one(struct wait_queue *wq);
+void wait_queue_wake_all(struct wait_queue *wq);
+
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+// Implemented in src/switch.s
+void context_switch(uint32_t *old_esp, uint32_t new_esp);
+
+#endif
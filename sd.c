@@ -1,51 +1,444 @@
 #include "sd.h"
+#include "timer.h"
+#include "sched.h"
+#include "interrupt.h"
+#include "rprintf.h"
+#include "trace.h"
 #include <stdint.h>
+#include <stddef.h>
 
 // Need inb/outb for I/O port access
 extern uint8_t inb(uint16_t port);
 extern void outb(uint16_t port, uint8_t val);
-extern void insl(uint16_t port, void *addr, uint32_t cnt);
+extern int putc(int data);
 
-// Wait for disk to not be busy
-void ata_wait_busy(void) {
-    while (inb(ATA_STATUS) & ATA_STATUS_BSY) {
-        // Wait
+static struct ata_channel ata_channels[2] = {
+    { .io = ATA_PRIMARY_IO,   .ctl = ATA_PRIMARY_CTL,   .irq = ATA_PRIMARY_IRQ },
+    { .io = ATA_SECONDARY_IO, .ctl = ATA_SECONDARY_CTL, .irq = ATA_SECONDARY_IRQ },
+};
+
+// ata_reset_thread() sleeps here until a channel is marked resetting
+static struct wait_queue ata_reset_wq;
+
+struct ata_device ata_devices[ATA_MAX_DEVICES];
+
+// Lets other threads run while we poll the drive, if that is possible here
+static void ata_yield(void) {
+    if (sched_running && irqs_enabled()) {
+        sched_yield();
+    }
+}
+
+// Wait for disk to not be busy. Returns -1 if the drive stays busy too long.
+static int ata_wait_busy(struct ata_channel *chan) {
+    uint64_t deadline = ktime_ns() + (uint64_t)ATA_TIMEOUT_MS * 1000000;
+
+    while (inb(chan->io + ATA_STATUS) & ATA_STATUS_BSY) {
+        if (ktime_ns() > deadline) {
+            return -1;
+        }
+        ata_yield();
+    }
+    return 0;
+}
+
+// Wait for disk to be ready for data transfer. Returns -1 on error or timeout.
+static int ata_wait_drq(struct ata_channel *chan) {
+    uint64_t deadline = ktime_ns() + (uint64_t)ATA_TIMEOUT_MS * 1000000;
+    uint8_t status;
+
+    while (!((status = inb(chan->io + ATA_STATUS)) & ATA_STATUS_DRQ)) {
+        if (status & ATA_STATUS_ERR) {
+            return -1;
+        }
+        if (ktime_ns() > deadline) {
+            return -1;
+        }
+        ata_yield();
+    }
+    return 0;
+}
+
+// Reading the alternate status four times gives the drive its 400 ns
+static void ata_delay(struct ata_channel *chan) {
+    for (int i = 0; i < 4; i++) {
+        inb(chan->ctl);
+    }
+}
+
+static inline void insw(uint16_t port, void *addr, uint32_t cnt) {
+    asm volatile("rep insw" : "+D"(addr), "+c"(cnt) : "d"(port) : "memory");
+}
+
+/*
+ * Transfers are interrupt driven. ata_issue() sends one read command for a
+ * whole group of merged requests, and the drive interrupts once per block
+ * of dev->multiple sectors. ata_irq() copies each sector straight into the
+ * buffer of the request it belongs to.
+ *
+ * Nothing here waits on the drive with chan->lock held. A command that
+ * finds BSY still set is retried from the channel timer, once per tick. A
+ * drive that stays busy, or a command that times out, is handed to
+ * ata_reset_thread(), which resets the channel without the lock held.
+ */
+
+/*
+ * Writes the active device's command to the drive. Returns -1 without
+ * touching the drive if it is still busy. Called with chan->lock held.
+ */
+static int ata_send(struct ata_channel *chan) {
+    struct ata_device *dev = chan->active;
+    struct blk_request *g = dev->group;
+    uint32_t lba = g->lba;
+    uint32_t count = g->group_count;
+    uint16_t io = chan->io;
+
+    // BSY normally clears as soon as the previous command ends
+    if (inb(chan->ctl) & ATA_STATUS_BSY) {
+        return -1;
+    }
+    chan->sent = 1;
+    mod_timer(&chan->timer, jiffies + msecs_to_jiffies(ATA_TIMEOUT_MS));
+    if (dev->lba48 && (lba + count > 0x0FFFFFFF || count > 256)) {
+        // High-order bytes first; a count of 0 means 65536
+        outb(io + ATA_DRIVE, 0x40 | (dev->slave << 4));
+        outb(io + ATA_SECTOR_CNT, count >> 8);
+        outb(io + ATA_LBA_LOW, lba >> 24);
+        outb(io + ATA_LBA_MID, 0);
+        outb(io + ATA_LBA_HIGH, 0);
+        outb(io + ATA_SECTOR_CNT, count & 0xFF);
+        outb(io + ATA_LBA_LOW, lba & 0xFF);
+        outb(io + ATA_LBA_MID, (lba >> 8) & 0xFF);
+        outb(io + ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+        outb(io + ATA_COMMAND, dev->multiple > 1 ? ATA_CMD_READ_MULTIPLE_EXT
+                                                  : ATA_CMD_READ_SECTORS_EXT);
+    } else {
+        outb(io + ATA_DRIVE, 0xE0 | (dev->slave << 4) | ((lba >> 24) & 0x0F));
+        outb(io + ATA_SECTOR_CNT, count & 0xFF);  // 256 is written as 0
+        outb(io + ATA_LBA_LOW, lba & 0xFF);
+        outb(io + ATA_LBA_MID, (lba >> 8) & 0xFF);
+        outb(io + ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+        outb(io + ATA_COMMAND, dev->multiple > 1 ? ATA_CMD_READ_MULTIPLE
+                                                  : ATA_CMD_READ_SECTORS);
+    }
+    return 0;
+}
+
+// Makes dev->group the channel's command and sends it. Called with chan->lock held.
+static void ata_issue(struct ata_device *dev) {
+    struct ata_channel *chan = dev->chan;
+    struct blk_request *g = dev->group;
+
+    chan->active = dev;
+    chan->sent = 0;
+    chan->busy_tries = 0;
+    dev->req = g;
+    dev->req_sector = 0;
+    dev->left = g->group_count;
+    TRACE(ATA_ISSUE, dev - ata_devices, g->lba, g->group_count);
+
+    if (ata_send(chan) < 0) {
+        mod_timer(&chan->timer, jiffies + 1);
+    }
+}
+
+// blk_queue start hook: runs now, or once the other device on the channel is done
+static void ata_start(struct blk_queue *q, struct blk_request *group) {
+    struct ata_device *dev = (struct ata_device *)q->driver_data;
+    struct ata_channel *chan = dev->chan;
+
+    spin_lock(&chan->lock);
+    dev->group = group;
+    if (chan->active == NULL) {
+        ata_issue(dev);
+    } else {
+        chan->waiting = dev;
+    }
+    spin_unlock(&chan->lock);
+}
+
+// Ends the channel's active command and starts the waiting one, if any.
+// Called with chan->lock held; returns the group that finished.
+static struct blk_request *ata_finish(struct ata_channel *chan) {
+    struct ata_device *dev = chan->active;
+    struct blk_request *group = dev->group;
+
+    dev->group = NULL;
+    dev->req = NULL;
+    chan->active = NULL;
+    del_timer(&chan->timer);
+    if (chan->waiting != NULL) {
+        struct ata_device *next = chan->waiting;
+        chan->waiting = NULL;
+        ata_issue(next);
+    }
+    return group;
+}
+
+/*
+ * Moves the next block of sectors from the drive if it has one ready, and
+ * completes the group once the last one is in.
+ */
+static void ata_service(struct ata_channel *chan) {
+    struct blk_request *done = NULL;
+    int status_ok = 0;
+    uint32_t flags = spin_lock_irqsave(&chan->lock);
+    uint8_t status = inb(chan->io + ATA_STATUS);  // Also acknowledges the interrupt
+    struct ata_device *dev = chan->active;
+
+    if (dev == NULL || !chan->sent || chan->resetting || (status & ATA_STATUS_BSY)) {
+        // Nothing in flight, or not our interrupt yet
+    } else if (status & ATA_STATUS_ERR) {
+        done = ata_finish(chan);
+    } else if (status & ATA_STATUS_DRQ) {
+        uint32_t n = dev->left < dev->multiple ? dev->left : dev->multiple;
+        for (uint32_t i = 0; i < n; i++) {
+            insw(chan->io + ATA_DATA, dev->req->buf + dev->req_sector * SECTOR_SIZE,
+                 SECTOR_SIZE / 2);
+            if (++dev->req_sector == dev->req->count) {
+                dev->req = dev->req->chain;
+                dev->req_sector = 0;
+            }
+        }
+        dev->left -= n;
+        if (dev->left == 0) {
+            done = ata_finish(chan);
+            status_ok = 1;
+        }
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    if (done != NULL) {
+        TRACE(ATA_COMPLETE, dev - ata_devices, done->lba, status_ok ? 0 : -1);
+        blk_complete(&dev->queue, done, status_ok ? 0 : -1);
+    }
+}
+
+static int ata_irq(struct regs *r, void *ctx) {
+    ata_service((struct ata_channel *)ctx);
+    return IRQ_HANDLED;
+}
+
+static void ata_poll(struct blk_queue *q) {
+    struct ata_device *dev = (struct ata_device *)q->driver_data;
+    ata_service(dev->chan);
+}
+
+/*
+ * Asks for one interrupt per block of dev->multiple sectors instead of one
+ * per sector. Falls back to single sectors if the drive refuses.
+ */
+static void ata_set_multiple(struct ata_device *dev) {
+    struct ata_channel *chan = dev->chan;
+
+    if (dev->multiple <= 1) {
+        dev->multiple = 1;
+        return;
+    }
+    outb(chan->io + ATA_DRIVE, 0xA0 | (dev->slave << 4));
+    outb(chan->io + ATA_SECTOR_CNT, dev->multiple);
+    outb(chan->io + ATA_COMMAND, ATA_CMD_SET_MULTIPLE);
+    if (ata_wait_busy(chan) < 0 || (inb(chan->io + ATA_STATUS) & ATA_STATUS_ERR)) {
+        dev->multiple = 1;
+    }
+}
+
+/*
+ * Software reset of both drives on the channel, so a hung command does not
+ * wedge the next one. Waits for BSY to clear and restores the block size
+ * that READ MULTIPLE uses. Runs in ata_reset_thread() without chan->lock;
+ * chan->resetting keeps everything else off the registers meanwhile.
+ */
+static void ata_reset(struct ata_channel *chan) {
+    outb(chan->ctl, ATA_CTL_NIEN | ATA_CTL_SRST);
+    udelay(5);
+    outb(chan->ctl, ATA_CTL_NIEN);
+    ata_delay(chan);
+    if (ata_wait_busy(chan) == 0) {
+        for (int s = 0; s < 2; s++) {
+            struct ata_device *dev = &ata_devices[(chan - ata_channels) * 2 + s];
+            if (dev->present) {
+                ata_set_multiple(dev);
+            }
+        }
+    }
+    inb(chan->io + ATA_STATUS);  // Drop any interrupt the reset raised
+    outb(chan->ctl, 0);
+}
+
+/*
+ * Channel timer. Retries a command that found the drive busy; if BSY has
+ * not cleared after ATA_BUSY_RETRIES ticks, or a sent command timed out,
+ * the channel is marked resetting for ata_reset_thread(). The active
+ * command stays in place until then, so its queue starts nothing new.
+ */
+static void ata_timeout(void *data) {
+    struct ata_channel *chan = (struct ata_channel *)data;
+    int hung = 0;
+
+    uint32_t flags = spin_lock_irqsave(&chan->lock);
+    if (chan->active != NULL && !chan->resetting) {
+        if (!chan->sent && ++chan->busy_tries < ATA_BUSY_RETRIES) {
+            if (ata_send(chan) < 0) {
+                mod_timer(&chan->timer, jiffies + 1);
+            }
+        } else {
+            chan->resetting = 1;
+            hung = 1;
+        }
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    if (hung) {
+        wait_queue_wake_all(&ata_reset_wq);
+    }
+}
+
+// Resets a hung channel, then fails its command and starts the waiting one
+static void ata_recover(struct ata_channel *chan) {
+    struct ata_device *dev = chan->active;
+
+    esp_printf(putc, "ata: %s on %s, resetting the channel\r\n",
+               chan->sent ? "timeout" : "drive stuck busy", dev->model);
+    ata_reset(chan);
+
+    uint32_t flags = spin_lock_irqsave(&chan->lock);
+    chan->resetting = 0;
+    struct blk_request *group = ata_finish(chan);
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    TRACE(ATA_COMPLETE, dev - ata_devices, group->lba, -1);
+    blk_complete(&dev->queue, group, -1);
+}
+
+static int ata_resetting(void) {
+    return ata_channels[0].resetting || ata_channels[1].resetting;
+}
+
+// Thread that does the slow part of error recovery, where it may sleep
+static void ata_reset_thread(void *arg) {
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&ata_reset_wq.lock);
+        while (!ata_resetting()) {
+            wait_queue_sleep_locked(&ata_reset_wq);
+        }
+        spin_unlock_irqrestore(&ata_reset_wq.lock, flags);
+
+        for (int c = 0; c < 2; c++) {
+            if (ata_channels[c].resetting) {
+                ata_recover(&ata_channels[c]);
+            }
+        }
     }
 }
 
-// Wait for disk to be ready for data transfer
-void ata_wait_drq(void) {
-    while (!(inb(ATA_STATUS) & ATA_STATUS_DRQ)) {
-        // Wait
+// Copies an IDENTIFY string, which stores two bytes per word big-end first
+static void ata_copy_string(char *dst, uint16_t *words, int nwords) {
+    int len = nwords * 2;
+    for (int i = 0; i < nwords; i++) {
+        dst[2 * i] = words[i] >> 8;
+        dst[2 * i + 1] = words[i] & 0xFF;
     }
+    while (len > 0 && dst[len - 1] == ' ') {
+        len--;
+    }
+    dst[len] = '\0';
 }
 
+// Runs IDENTIFY DEVICE with the channel's interrupt masked. Returns 0 if an
+// ATA disk answered.
+static int ata_identify(struct ata_device *dev) {
+    struct ata_channel *chan = dev->chan;
+    uint16_t id[256];
+
+    outb(chan->io + ATA_DRIVE, 0xA0 | (dev->slave << 4));
+    ata_delay(chan);
+    outb(chan->io + ATA_SECTOR_CNT, 0);
+    outb(chan->io + ATA_LBA_LOW, 0);
+    outb(chan->io + ATA_LBA_MID, 0);
+    outb(chan->io + ATA_LBA_HIGH, 0);
+    outb(chan->io + ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+    // A status of 0 means no device; 0xFF is a floating bus with no channel
+    uint8_t status = inb(chan->io + ATA_STATUS);
+    if (status == 0 || status == 0xFF) {
+        return -1;
+    }
+    if (ata_wait_busy(chan) < 0) {
+        return -1;
+    }
+    // ATAPI and SATA devices put a signature here and abort IDENTIFY
+    if (inb(chan->io + ATA_LBA_MID) != 0 || inb(chan->io + ATA_LBA_HIGH) != 0) {
+        return -1;
+    }
+    if (ata_wait_drq(chan) < 0) {
+        return -1;
+    }
+    insw(chan->io + ATA_DATA, id, 256);
+
+    dev->lba48 = (id[83] & (1 << 10)) != 0;
+    if (dev->lba48 && (id[102] != 0 || id[103] != 0)) {
+        dev->sectors = 0xFFFFFFFF;
+    } else if (dev->lba48) {
+        dev->sectors = id[100] | ((uint32_t)id[101] << 16);
+    } else {
+        dev->sectors = id[60] | ((uint32_t)id[61] << 16);
+    }
+    dev->multiple = id[47] & 0xFF;
+    ata_copy_string(dev->model, &id[27], 20);
+    ata_set_multiple(dev);
+    return 0;
+}
+
+static const char *ata_names[ATA_MAX_DEVICES] = {
+    "ata0", "ata1", "ata2", "ata3",
+};
+
 void sd_init(void) {
-    // Wait for drive to be ready
-    ata_wait_busy();
-}
-
-void sd_readblock(uint32_t sector_num, char *buf, uint32_t num_sectors) {
-    // Wait for drive to be ready
-    ata_wait_busy();
-    
-    // Set up for LBA28 mode
-    outb(ATA_DRIVE, 0xE0 | ((sector_num >> 24) & 0x0F));  // Master drive, LBA mode
-    outb(ATA_SECTOR_CNT, num_sectors);                     // Number of sectors
-    outb(ATA_LBA_LOW, sector_num & 0xFF);                  // LBA bits 0-7
-    outb(ATA_LBA_MID, (sector_num >> 8) & 0xFF);          // LBA bits 8-15
-    outb(ATA_LBA_HIGH, (sector_num >> 16) & 0xFF);        // LBA bits 16-23
-    outb(ATA_COMMAND, ATA_CMD_READ_SECTORS);               // Read command
-    
-    // Read each sector
-    for (uint32_t i = 0; i < num_sectors; i++) {
-        // Wait for data to be ready
-        ata_wait_drq();
-        
-        // Read 256 words from data port
-        uint16_t *dst = (uint16_t *)(buf + i * SECTOR_SIZE);
-        for (int j = 0; j < 256; j++) {
-            dst[j] = inw(ATA_DATA);
+    static int initialized;
+    if (initialized) {
+        return;
+    }
+    initialized = 1;
+
+    for (int c = 0; c < 2; c++) {
+        struct ata_channel *chan = &ata_channels[c];
+        spin_lock_init(&chan->lock, c == 0 ? "ata_primary" : "ata_secondary");
+        timer_setup(&chan->timer, ata_timeout, chan);
+        outb(chan->ctl, ATA_CTL_NIEN);
+
+        for (int s = 0; s < 2; s++) {
+            struct ata_device *dev = &ata_devices[c * 2 + s];
+            dev->chan = chan;
+            dev->slave = s;
+            if (ata_identify(dev) < 0) {
+                continue;
+            }
+            dev->present = 1;
+            // LBA48 counts up to 65536 sectors per command, LBA28 up to 256
+            blk_queue_init(&dev->queue, ata_names[c * 2 + s], dev->lba48 ? 65536 : 256,
+                           ata_start, ata_poll);
+            dev->queue.driver_data = dev;
+            blockdev_init_queue(&dev->bdev, ata_names[c * 2 + s], &dev->queue, dev->sectors);
+            esp_printf(putc, "%s: %s, %d sectors, %s, %d sectors/irq\r\n",
+                       ata_names[c * 2 + s], dev->model, dev->sectors,
+                       dev->lba48 ? "LBA48" : "LBA28", dev->multiple);
         }
+
+        if (ata_devices[c * 2].present || ata_devices[c * 2 + 1].present) {
+            irq_register(IRQ_BASE + chan->irq, ata_irq, chan);
+            outb(chan->ctl, 0);  // Let the drives interrupt
+        }
+    }
+
+    spin_lock_init(&ata_reset_wq.lock, "ata_reset");
+    ata_reset_wq.head = NULL;
+    kthread_create(ata_reset_thread, NULL, "ata_reset");
+}
+
+int ata_readblock(struct ata_device *dev, uint32_t sector_num, char *buf, uint32_t num_sectors) {
+    if (dev == NULL || !dev->present) {
+        return -1;
     }
+    return blk_read(&dev->queue, sector_num, buf, num_sectors);
 }
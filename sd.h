@@ -1,8 +1,10 @@
 #ifndef __SD_H__
 #define __SD_H__
 #include <stdint.h>
-
-#include <stdint.h>
+#include "blk.h"
+#include "blockdev.h"
+#include "sync.h"
+#include "timer.h"
 
 // I/O port access functions
 uint8_t inb(uint16_t port);
@@ -10,20 +12,36 @@ uint16_t inw(uint16_t port);
 
 #define SECTOR_SIZE 512
 
-// ATA I/O ports
-#define ATA_DATA        0x1F0
-#define ATA_ERROR       0x1F1
-#define ATA_FEATURES    0x1F1
-#define ATA_SECTOR_CNT  0x1F2
-#define ATA_LBA_LOW     0x1F3
-#define ATA_LBA_MID     0x1F4
-#define ATA_LBA_HIGH    0x1F5
-#define ATA_DRIVE       0x1F6
-#define ATA_STATUS      0x1F7
-#define ATA_COMMAND     0x1F7
+// ATA channels: command block base, control block base and IRQ line
+#define ATA_PRIMARY_IO      0x1F0
+#define ATA_PRIMARY_CTL     0x3F6
+#define ATA_PRIMARY_IRQ     14
+#define ATA_SECONDARY_IO    0x170
+#define ATA_SECONDARY_CTL   0x376
+#define ATA_SECONDARY_IRQ   15
+
+// ATA registers, as offsets from the channel's command block base
+#define ATA_DATA        0
+#define ATA_ERROR       1
+#define ATA_FEATURES    1
+#define ATA_SECTOR_CNT  2
+#define ATA_LBA_LOW     3
+#define ATA_LBA_MID     4
+#define ATA_LBA_HIGH    5
+#define ATA_DRIVE       6
+#define ATA_STATUS      7
+#define ATA_COMMAND     7
+
+#define ATA_CTL_NIEN    0x02  // Set in the control register to mask the drive's interrupt
+#define ATA_CTL_SRST    0x04  // Held for 5 us to reset both drives on the channel
 
 // ATA Commands
-#define ATA_CMD_READ_SECTORS  0x20
+#define ATA_CMD_READ_SECTORS      0x20
+#define ATA_CMD_READ_SECTORS_EXT  0x24
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_SET_MULTIPLE      0xC6
+#define ATA_CMD_IDENTIFY          0xEC
 
 // ATA Status bits
 #define ATA_STATUS_BSY  0x80  // Busy
@@ -31,12 +49,51 @@ uint16_t inw(uint16_t port);
 #define ATA_STATUS_DRQ  0x08  // Data request ready
 #define ATA_STATUS_ERR  0x01  // Error
 
+// How long to wait for the drive before giving up on a command
+#define ATA_TIMEOUT_MS  5000
+#define ATA_BUSY_RETRIES 50   // Ticks a new command waits for BSY to clear before the channel is reset
+
+#define ATA_MAX_DEVICES 4     // Primary and secondary, master and slave
+
+struct ata_device;
+
+// One IDE channel. Its two devices share the registers, so only one of
+// them can have a command running.
+struct ata_channel {
+    uint16_t io;
+    uint16_t ctl;
+    uint8_t irq;
+    spinlock_t lock;
+    struct ata_device *active;    // Device whose command is running
+    struct ata_device *waiting;   // The other device, with a group ready to go
+    int sent;                     // The active command has been written to the drive
+    int busy_tries;               // Ticks it has waited for BSY to clear so far
+    volatile int resetting;       // Hung; the reset thread owns the registers
+    struct timer_list timer;      // Retries a delayed command; hands a hung one to the reset thread
+};
+
+struct ata_device {
+    struct ata_channel *chan;
+    int slave;
+    int present;
+    int lba48;                    // Supports the 48-bit command set
+    uint32_t sectors;             // Capacity, clamped to 2^32 - 1
+    uint32_t multiple;            // Sectors per interrupt (READ MULTIPLE), 1 if unused
+    char model[41];
+    struct blk_queue queue;
+    struct blockdev bdev;
+
+    // State of the running transfer, guarded by chan->lock
+    struct blk_request *group;
+    struct blk_request *req;      // Request the next sector belongs to
+    uint32_t req_sector;          // Sector within req
+    uint32_t left;                // Sectors left in the group
+};
+
+extern struct ata_device ata_devices[ATA_MAX_DEVICES];
+
 // Function declarations
 void sd_init(void);
-void sd_readblock(uint32_t sector_num, char *buf, uint32_t num_sectors);
-
-// Helper functions
-void ata_wait_busy(void);
-void ata_wait_drq(void);
+int ata_readblock(struct ata_device *dev, uint32_t sector_num, char *buf, uint32_t num_sectors);
 
 #endif
@@ -0,0 +1,104 @@
+/*
+ * serial.c
+ *
+ * COM1 output, for logs and results a host can capture (-serial stdio).
+ * Characters go into a ring and the transmitter is fed from it, one FIFO's
+ * worth (16 bytes) at a time. Once serial_irq_init() has run, refills come
+ * from the THRE interrupt, so a print only waits on the line when the ring
+ * is full. Before that, each print pushes whatever the FIFO has room for.
+ */
+
+#include "serial.h"
+#include "interrupt.h"
+#include "sync.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+static int serial_ready;
+static char tx_ring[SERIAL_TX_RING];
+static uint32_t tx_head;        // Next slot to fill
+static uint32_t tx_tail;        // Next character to send
+DEFINE_SPINLOCK(serial_lock);
+
+void serial_init(uint32_t baud) {
+    uint16_t divisor = UART_CLOCK_HZ / baud;
+
+    outb(COM1_BASE + UART_IER, 0);
+    outb(COM1_BASE + UART_LCR, UART_LCR_DLAB);
+    outb(COM1_BASE + UART_DATA, divisor & 0xFF);
+    outb(COM1_BASE + UART_IER, divisor >> 8);
+    outb(COM1_BASE + UART_LCR, UART_LCR_8N1);
+    outb(COM1_BASE + UART_FCR, UART_FCR_ENABLE);
+    outb(COM1_BASE + UART_MCR, UART_MCR_DTR_RTS);
+
+    // No UART reads back 0xFF from the line status register
+    serial_ready = inb(COM1_BASE + UART_LSR) != 0xFF;
+}
+
+// Moves up to a FIFO's worth from the ring to the UART if it has gone idle.
+// Called with serial_lock held.
+static void serial_tx_fill(void) {
+    if (!(inb(COM1_BASE + UART_LSR) & UART_LSR_THRE)) {
+        return;
+    }
+    for (int n = 0; n < UART_FIFO_SIZE && tx_tail != tx_head; n++) {
+        outb(COM1_BASE + UART_DATA, tx_ring[tx_tail % SERIAL_TX_RING]);
+        tx_tail++;
+    }
+}
+
+static int serial_irq(struct regs *r, void *ctx) {
+    uint8_t iir = inb(COM1_BASE + UART_IIR);  // Reading it clears a THRE interrupt
+    if (iir & UART_IIR_NO_INT) {
+        return IRQ_NONE;
+    }
+    spin_lock(&serial_lock);
+    serial_tx_fill();
+    spin_unlock(&serial_lock);
+    return IRQ_HANDLED;
+}
+
+void serial_irq_init(void) {
+    if (!serial_ready) {
+        return;
+    }
+    irq_register(IRQ_BASE + COM1_IRQ, serial_irq, NULL);
+    outb(COM1_BASE + UART_MCR, UART_MCR_DTR_RTS | UART_MCR_OUT2);
+    outb(COM1_BASE + UART_IER, UART_IER_THRI);
+}
+
+int serial_putc(int data) {
+    if (!serial_ready) {
+        return data;
+    }
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+
+    // Full ring: the one place we wait for the line
+    while (tx_head - tx_tail == SERIAL_TX_RING) {
+        while (!(inb(COM1_BASE + UART_LSR) & UART_LSR_THRE)) {
+            cpu_relax();
+        }
+        serial_tx_fill();
+    }
+    tx_ring[tx_head % SERIAL_TX_RING] = data;
+    tx_head++;
+    serial_tx_fill();
+
+    spin_unlock_irqrestore(&serial_lock, flags);
+    return data;
+}
+
+// Sends everything still in the ring, for before QEMU exits or the CPU halts
+void serial_flush(void) {
+    if (!serial_ready) {
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    while (tx_tail != tx_head) {
+        while (!(inb(COM1_BASE + UART_LSR) & UART_LSR_THRE)) {
+            cpu_relax();
+        }
+        serial_tx_fill();
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
@@ -0,0 +1,41 @@
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include <stdint.h>
+
+// 16550 UART on COM1
+#define COM1_BASE       0x3F8
+#define COM1_IRQ        4
+
+// Registers, as offsets from the base port
+#define UART_DATA       0   // RBR/THR, or divisor low with DLAB set
+#define UART_IER        1   // Interrupt enable, or divisor high with DLAB set
+#define UART_IIR        2   // Interrupt identification (read)
+#define UART_FCR        2   // FIFO control (write)
+#define UART_LCR        3   // Line control
+#define UART_MCR        4   // Modem control
+#define UART_LSR        5   // Line status
+
+#define UART_IER_THRI   0x02    // Interrupt when the transmit FIFO empties
+#define UART_IIR_NO_INT 0x01
+#define UART_IIR_ID     0x0E
+#define UART_IIR_THRI   0x02
+#define UART_LCR_8N1    0x03
+#define UART_LCR_DLAB   0x80
+#define UART_FCR_ENABLE 0x07    // Enable and clear both FIFOs
+#define UART_MCR_DTR_RTS 0x03
+#define UART_MCR_OUT2   0x08    // Gates the interrupt line on PC serial ports
+#define UART_LSR_THRE   0x20    // Transmit holding register (and FIFO) empty
+
+#define UART_CLOCK_HZ   115200
+#define UART_FIFO_SIZE  16
+
+// Characters waiting for the transmitter; a power of two
+#define SERIAL_TX_RING  16384
+
+void serial_init(uint32_t baud);
+void serial_irq_init(void);
+int serial_putc(int data);
+void serial_flush(void);
+
+#endif
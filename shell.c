@@ -0,0 +1,289 @@
+/*
+ * shell.c
+ *
+ * Interactive kernel shell. Reads a line from the keyboard, splits it into
+ * words and runs the command named by the first one. The commands poke at
+ * the FAT, block and memory subsystems and report on them, so experiments
+ * do not need a rebuild.
+ */
+
+#include <stdint.h>
+#include "shell.h"
+#include "keyboard.h"
+#include "rprintf.h"
+#include "fat.h"
+#include "page.h"
+#include "timer.h"
+#include "bench.h"
+#include "perf.h"
+#include "trace.h"
+#include "sync.h"
+
+extern int putc(int data);
+extern int _end_kernel;
+
+static int streq(const char *a, const char *b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+/*
+ * Reads one line into buf, echoing as it goes. Backspace removes the last
+ * character; anything past max - 1 characters is dropped.
+ */
+static void shell_readline(char *buf, int max) {
+    int len = 0;
+
+    while (1) {
+        int c = kbd_getc(0);
+        if (c == '\n') {
+            esp_printf(putc, "\r\n");
+            break;
+        }
+        if (c == '\b') {
+            if (len > 0) {
+                len--;
+                esp_printf(putc, "\b \b");
+            }
+            continue;
+        }
+        if (c == '\t') {
+            c = ' ';
+        }
+        if (c < ' ' || len == max - 1) {
+            continue;
+        }
+        buf[len++] = c;
+        putc(c);
+    }
+    buf[len] = '\0';
+}
+
+// Splits line in place at spaces; returns the number of words
+static int shell_split(char *line, char **argv, int max) {
+    int argc = 0;
+
+    while (*line != '\0' && argc < max) {
+        while (*line == ' ') {
+            *line++ = '\0';
+        }
+        if (*line == '\0') {
+            break;
+        }
+        argv[argc++] = line;
+        while (*line != ' ' && *line != '\0') {
+            line++;
+        }
+    }
+    return argc;
+}
+
+// "NAME    EXT" -> "NAME.EXT"
+static void format_name(struct root_directory_entry *rde, char *out) {
+    int n = 0;
+    for (int i = 0; i < 8 && rde->file_name[i] != ' '; i++) {
+        out[n++] = rde->file_name[i];
+    }
+    if (rde->file_extension[0] != ' ') {
+        out[n++] = '.';
+        for (int i = 0; i < 3 && rde->file_extension[i] != ' '; i++) {
+            out[n++] = rde->file_extension[i];
+        }
+    }
+    out[n] = '\0';
+}
+
+static void ls_entry(struct root_directory_entry *rde, void *ctx) {
+    char name[13];
+    format_name(rde, name);
+    if (rde->attribute & FILE_ATTRIBUTE_SUBDIRECTORY) {
+        esp_printf(putc, "%-12s      <DIR>\r\n", name);
+    } else {
+        esp_printf(putc, "%-12s %10d\r\n", name, rde->file_size);
+    }
+}
+
+static int cmd_ls(int argc, char **argv) {
+    int n = fat_readdir(ls_entry, NULL);
+    esp_printf(putc, "%d entries\r\n", n);
+    return 0;
+}
+
+static int cmd_cat(int argc, char **argv) {
+    char buf[512];
+
+    if (argc < 2) {
+        esp_printf(putc, "usage: cat <file>\r\n");
+        return -1;
+    }
+    int fd = fatOpen(argv[1]);
+    if (fd < 0) {
+        return -1;
+    }
+    int n;
+    while ((n = fatRead(fd, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                putc('\r');
+            }
+            putc(buf[i]);
+        }
+    }
+    fatClose(fd);
+    esp_printf(putc, "\r\n");
+    return 0;
+}
+
+static int cmd_stat(int argc, char **argv) {
+    struct root_directory_entry rde;
+    char name[13];
+
+    if (argc < 2) {
+        esp_printf(putc, "usage: stat <file>\r\n");
+        return -1;
+    }
+    int fd = fatOpen(argv[1]);
+    if (fd < 0) {
+        return -1;
+    }
+    fatStat(fd, &rde);
+    fatClose(fd);
+
+    // FAT dates are yyyyyyym mmmddddd from 1980, times hhhhhmmm mmmsssss in 2 s units
+    format_name(&rde, name);
+    esp_printf(putc, "name:      %s\r\n", name);
+    esp_printf(putc, "size:      %d bytes\r\n", rde.file_size);
+    esp_printf(putc, "cluster:   %d\r\n", rde.cluster);
+    esp_printf(putc, "attribute: 0x%02x\r\n", rde.attribute);
+    esp_printf(putc, "modified:  %d-%02d-%02d %02d:%02d:%02d\r\n",
+               1980 + (rde.modified_date >> 9), (rde.modified_date >> 5) & 0xF,
+               rde.modified_date & 0x1F, rde.modified_time >> 11,
+               (rde.modified_time >> 5) & 0x3F, (rde.modified_time & 0x1F) * 2);
+    return 0;
+}
+
+static int cmd_bench(int argc, char **argv) {
+    if (argc < 2) {
+        bench_list(putc);
+        return 0;
+    }
+    if (bench_run_one(argv[1], putc) < 0) {
+        esp_printf(putc, "bench: no benchmark called %s\r\n", argv[1]);
+        return -1;
+    }
+    return 0;
+}
+
+static int cmd_stats(int argc, char **argv) {
+    lock_stats_dump();
+    perf_stats_dump(putc);
+    return 0;
+}
+
+static int cmd_trace(int argc, char **argv) {
+    if (argc >= 2 && streq(argv[1], "dump")) {
+        trace_dump();
+        esp_printf(putc, "trace written to COM1\r\n");
+    } else if (argc >= 2 && streq(argv[1], "on")) {
+        trace_enable(1);
+    } else if (argc >= 2 && streq(argv[1], "off")) {
+        trace_enable(0);
+    } else {
+        esp_printf(putc, "usage: trace dump|on|off\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int cmd_cache(int argc, char **argv) {
+    if (argc < 2 || !streq(argv[1], "flush")) {
+        esp_printf(putc, "usage: cache flush\r\n");
+        return -1;
+    }
+    int freed = fat_drop_caches();
+    esp_printf(putc, "readahead dropped, %d mmap cache frames freed\r\n", freed);
+    return 0;
+}
+
+static int cmd_meminfo(int argc, char **argv) {
+    uint32_t free = pfa_free_frames();
+
+    esp_printf(putc, "kernel image:     %d KB\r\n", (virt_to_phys(&_end_kernel) - 0x100000) / 1024);
+    esp_printf(putc, "free frames:      %d (%d KB each, %d KB)\r\n", free,
+               KHEAP_SLOT_SIZE / 1024, free * (KHEAP_SLOT_SIZE / 1024));
+    esp_printf(putc, "frames allocated: %d\r\n", perf_sw_total(PERF_FRAMES_ALLOC));
+    esp_printf(putc, "frames freed:     %d\r\n", perf_sw_total(PERF_FRAMES_FREED));
+    esp_printf(putc, "page faults:      %d\r\n", perf_sw_total(PERF_PAGE_FAULTS));
+    return 0;
+}
+
+static int cmd_time(int argc, char **argv);
+static int cmd_help(int argc, char **argv);
+
+struct shell_command {
+    const char *name;
+    int (*fn)(int argc, char **argv);
+    const char *help;
+};
+
+static const struct shell_command shell_commands[] = {
+    { "ls",      cmd_ls,      "list the root directory" },
+    { "cat",     cmd_cat,     "cat <file>: print a file" },
+    { "stat",    cmd_stat,    "stat <file>: show a file's directory entry" },
+    { "bench",   cmd_bench,   "bench [name]: list benchmarks, or run one" },
+    { "stats",   cmd_stats,   "lock, PMU, software and interrupt counters" },
+    { "trace",   cmd_trace,   "trace dump|on|off: tracepoints (dump goes to COM1)" },
+    { "cache",   cmd_cache,   "cache flush: drop readahead and mmap cache frames" },
+    { "meminfo", cmd_meminfo, "physical memory use" },
+    { "time",    cmd_time,    "time <command>: run a command and show how long it took" },
+    { "help",    cmd_help,    "this list" },
+};
+
+#define SHELL_NR_COMMANDS (sizeof(shell_commands) / sizeof(shell_commands[0]))
+
+static int shell_exec(int argc, char **argv) {
+    for (uint32_t i = 0; i < SHELL_NR_COMMANDS; i++) {
+        if (streq(argv[0], shell_commands[i].name)) {
+            return shell_commands[i].fn(argc, argv);
+        }
+    }
+    esp_printf(putc, "%s: unknown command, try help\r\n", argv[0]);
+    return -1;
+}
+
+static int cmd_time(int argc, char **argv) {
+    if (argc < 2) {
+        esp_printf(putc, "usage: time <command>\r\n");
+        return -1;
+    }
+    uint64_t start = ktime_ns();
+    int ret = shell_exec(argc - 1, argv + 1);
+    esp_printf(putc, "%d us\r\n", (uint32_t)div64_32(ktime_ns() - start, 1000));
+    return ret;
+}
+
+static int cmd_help(int argc, char **argv) {
+    for (uint32_t i = 0; i < SHELL_NR_COMMANDS; i++) {
+        esp_printf(putc, "%-8s %s\r\n", shell_commands[i].name, shell_commands[i].help);
+    }
+    return 0;
+}
+
+void shell_run(void) {
+    char line[SHELL_LINE_MAX];
+    char *argv[SHELL_MAX_ARGS];
+
+    kbd_set_echo(0);
+    esp_printf(putc, "\r\nType help for a list of commands.\r\n");
+    while (1) {
+        esp_printf(putc, "> ");
+        shell_readline(line, sizeof(line));
+        int argc = shell_split(line, argv, SHELL_MAX_ARGS);
+        if (argc > 0) {
+            shell_exec(argc, argv);
+        }
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef __SHELL_H__
+#define __SHELL_H__
+
+#define SHELL_LINE_MAX  128
+#define SHELL_MAX_ARGS  8
+
+void shell_run(void);
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * smp.c
+ *
+ * Application processor bring-up and per-CPU state.
+ *
+ * The boot CPU wakes every other CPU listed in the MADT with the INIT,
+ * SIPI, SIPI sequence. Each AP starts in src/trampoline.s, which brings it
+ * into paged protected mode and calls ap_main(). Every CPU runs on its own
+ * copy of the GDT, whose TSS entry points at that CPU's TSS and whose per-CPU
+ * data segment (loaded in %fs) is based at its struct cpu.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "smp.h"
+#include "apic.h"
+#include "acpi.h"
+#include "page.h"
+#include "sched.h"
+#include "syscall.h"
+#include "timer.h"
+#include "perf.h"
+
+struct cpu cpus[MAX_CPUS];
+int ncpus = 1;
+
+extern struct gdt_entry_bits gdt[GDT_ENTRIES];
+extern struct idt_ptr idt_ptr;
+extern void *memcpy(void *dest, const void *src, int n);
+extern void memset(char *s, char c, unsigned int n);
+
+// src/trampoline.s; the variables are patched in the copy at TRAMPOLINE_ADDR
+extern char trampoline_start[], trampoline_end[];
+extern char tramp_cr3[], tramp_cr4[], tramp_stack[], tramp_entry[], tramp_cpu[];
+#define TRAMP_VAR(sym) (*(volatile uint32_t *)(TRAMPOLINE_ADDR + ((sym) - trampoline_start)))
+
+#define AP_START_TIMEOUT_MS 100
+
+static void set_segment_base(struct gdt_entry_bits *g, uint32_t base) {
+    g->base_low = base & 0xFFFFFF;
+    g->base_high = (base >> 24) & 0xFF;
+}
+
+// Builds the calling CPU's GDT and TSS and loads them, along with %fs
+static void cpu_load(struct cpu *c, uint32_t esp0) {
+    c->self = c;
+    memcpy(c->gdt, gdt, sizeof(c->gdt));
+
+    memset((char *)&c->tss, 0, sizeof(c->tss));
+    c->tss.ss0 = 0x10;
+    c->tss.esp0 = esp0;
+    c->tss.iomap_base = sizeof(struct tss_entry);  // No I/O bitmap
+
+    uint32_t limit = sizeof(struct tss_entry) - 1;
+    set_segment_base(&c->gdt[TSS_SEL >> 3], (uint32_t)&c->tss);
+    c->gdt[TSS_SEL >> 3].limit_low = limit & 0xFFFF;
+    c->gdt[TSS_SEL >> 3].limit_high = (limit >> 16) & 0xF;
+    c->gdt[TSS_SEL >> 3].read_write = 0;  // Not busy
+    set_segment_base(&c->gdt[PERCPU_SEL >> 3], (uint32_t)c);
+
+    c->gdt_desc.sz = sizeof(c->gdt) - 1;
+    c->gdt_desc.addr = (uint32_t)c->gdt;
+    asm volatile("lgdt %0" : : "m"(c->gdt_desc));
+    asm volatile("ltr %%ax" : : "a"(TSS_SEL));
+    asm volatile("mov %%ax, %%fs" : : "a"(PERCPU_SEL) : "memory");
+}
+
+// Moves the boot CPU onto its per-CPU GDT. Runs before interrupts are enabled.
+void smp_init_bsp(void) {
+    extern int _end_stack;
+    struct cpu *c = &cpus[0];
+
+    c->id = 0;
+    c->online = 1;
+    c->active_pd = pd;
+    cpu_load(c, (uint32_t)&_end_stack);
+}
+
+// C entry point of an application processor, called from the trampoline
+void ap_main(struct cpu *c) {
+    cpu_load(c, (uint32_t)c->boot_stack + KSTACK_PAGES * PAGE_SIZE);
+    c->active_pd = pd;
+    idt_flush(&idt_ptr);
+    lapic_init_cpu();
+    syscall_init();
+    perf_init_cpu();
+    sched_init_ap();
+
+    c->online = 1;
+    apic_timer_start();
+    asm("sti");
+    sched_idle();
+}
+
+static int resched_ipi(struct regs *r, void *ctx) {
+    return IRQ_HANDLED;  // irq_dispatch() calls sched_preempt() on the way out
+}
+
+static void tlb_flush_local(void) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    this_cpu()->tlb_flush_pending = 0;
+}
+
+static int tlb_ipi(struct regs *r, void *ctx) {
+    if (this_cpu()->tlb_flush_pending) {
+        tlb_flush_local();
+    }
+    return IRQ_HANDLED;
+}
+
+void smp_send_resched(int cpu) {
+    if (cpu != cpu_id() && cpus[cpu].online) {
+        lapic_send_ipi(cpus[cpu].apic_id, ICR_FIXED | RESCHED_VECTOR);
+    }
+}
+
+/*
+ * Makes every other CPU flush its TLB and waits until they have. Call after
+ * removing kernel mappings, and never with a spinlock held: a CPU spinning
+ * with interrupts off could not take the IPI. A CPU waiting here serves
+ * requests aimed at itself, so two concurrent shootdowns do not deadlock.
+ */
+void tlb_shootdown(void) {
+    if (ncpus == 1) {
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    int self = cpu_id();
+    for (int i = 0; i < ncpus; i++) {
+        if (i != self && cpus[i].online) {
+            cpus[i].tlb_flush_pending = 1;
+            lapic_send_ipi(cpus[i].apic_id, ICR_FIXED | TLB_VECTOR);
+        }
+    }
+    for (int i = 0; i < ncpus; i++) {
+        while (i != self && cpus[i].tlb_flush_pending) {
+            if (this_cpu()->tlb_flush_pending) {
+                tlb_flush_local();
+            }
+            asm volatile("pause");
+        }
+    }
+    irq_restore(flags);
+}
+
+// Two startup IPIs pointing at the trampoline; the INIT has already been sent
+static int start_ap(struct cpu *c) {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    TRAMP_VAR(tramp_cr3) = virt_to_phys(pd);
+    TRAMP_VAR(tramp_cr4) = cr4;
+    TRAMP_VAR(tramp_stack) = (uint32_t)c->boot_stack + KSTACK_PAGES * PAGE_SIZE;
+    TRAMP_VAR(tramp_entry) = (uint32_t)ap_main;
+    TRAMP_VAR(tramp_cpu) = (uint32_t)c;
+
+    for (int i = 0; i < 2 && !c->online; i++) {
+        lapic_send_ipi(c->apic_id, ICR_STARTUP | (TRAMPOLINE_ADDR >> 12));
+        udelay(200);
+    }
+
+    uint64_t deadline = ktime_ns() + (uint64_t)AP_START_TIMEOUT_MS * 1000000;
+    while (!c->online) {
+        if (ktime_ns() > deadline) {
+            return -1;
+        }
+        asm volatile("pause");
+    }
+    return 0;
+}
+
+/*
+ * Starts every processor the MADT lists. All of them get their INIT IPI up
+ * front and share one 10 ms wait (Intel SDM 8.4.4.1); the startup IPIs then
+ * go one CPU at a time since they share the trampoline. Needs the local
+ * APIC and the scheduler. Returns the number of CPUs online.
+ */
+int smp_boot_aps(void) {
+    if (!apic_enabled) {
+        return ncpus;
+    }
+
+    cpus[0].apic_id = lapic_id();
+    irq_register(RESCHED_VECTOR, resched_ipi, NULL);
+    irq_register(TLB_VECTOR, tlb_ipi, NULL);
+
+    // The trampoline page has to stay identity mapped while the APs enable paging
+    map_page(pd, TRAMPOLINE_ADDR, TRAMPOLINE_ADDR, PAGE_RW);
+    memcpy((void *)TRAMPOLINE_ADDR, trampoline_start, trampoline_end - trampoline_start);
+
+    for (int i = 0, n = ncpus; i < acpi_info.ncpus && n < MAX_CPUS; i++) {
+        if (acpi_info.cpu_apic_ids[i] != cpus[0].apic_id) {
+            lapic_send_ipi(acpi_info.cpu_apic_ids[i], ICR_INIT | ICR_LEVEL_ASSERT);
+            n++;
+        }
+    }
+    udelay(10000);
+
+    for (int i = 0; i < acpi_info.ncpus && ncpus < MAX_CPUS; i++) {
+        if (acpi_info.cpu_apic_ids[i] == cpus[0].apic_id) {
+            continue;
+        }
+
+        struct cpu *c = &cpus[ncpus];
+        c->id = ncpus;
+        c->apic_id = acpi_info.cpu_apic_ids[i];
+        c->boot_stack = kpage_alloc(KSTACK_PAGES);
+        if (c->boot_stack == NULL) {
+            break;
+        }
+        if (start_ap(c) < 0) {
+            // It may still wake up later and use this slot and stack; stop here
+            break;
+        }
+        ncpus++;
+    }
+    return ncpus;
+}
+
+struct smp_batch {
+    void (*fn)(int job, void *arg);
+    void *arg;
+    int remaining;
+    struct wait_queue done;
+};
+
+struct smp_job {
+    struct smp_batch *batch;
+    int index;
+};
+
+static void smp_job_thread(void *p) {
+    struct smp_job *job = (struct smp_job *)p;
+    struct smp_batch *batch = job->batch;
+
+    batch->fn(job->index, batch->arg);
+
+    // The caller returns, and the batch goes away, once it sees remaining hit 0
+    uint32_t flags = spin_lock_irqsave(&batch->done.lock);
+    if (--batch->remaining == 0) {
+        wait_queue_wake_all_locked(&batch->done);
+    }
+    spin_unlock_irqrestore(&batch->done.lock, flags);
+}
+
+/*
+ * Runs fn(0, arg) .. fn(njobs - 1, arg), each in its own thread, and waits
+ * for all of them. Work stealing spreads the threads over the CPUs. Returns
+ * the number of jobs that could be started.
+ */
+int smp_run(void (*fn)(int job, void *arg), void *arg, int njobs) {
+    struct smp_batch batch;
+    struct smp_job jobs[SMP_MAX_JOBS];
+
+    if (njobs > SMP_MAX_JOBS) {
+        njobs = SMP_MAX_JOBS;
+    }
+    batch.fn = fn;
+    batch.arg = arg;
+    batch.remaining = njobs;
+    batch.done.head = NULL;
+    spin_lock_init(&batch.done.lock, "smp_run");
+
+    int started = 0;
+    for (int i = 0; i < njobs; i++) {
+        jobs[i].batch = &batch;
+        jobs[i].index = i;
+        if (kthread_create(smp_job_thread, &jobs[i], "job") == NULL) {
+            break;
+        }
+        started++;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&batch.done.lock);
+    batch.remaining -= njobs - started;
+    while (batch.remaining > 0) {
+        wait_queue_sleep_locked(&batch.done);
+    }
+    spin_unlock_irqrestore(&batch.done.lock, flags);
+    return started;
+}
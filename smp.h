@@ -0,0 +1,62 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+#include "interrupt.h"
+#include "sync.h"
+
+struct page_directory_entry;
+
+#define MAX_CPUS            8
+#define GDT_ENTRIES         7
+#define TSS_SEL             0x2b
+#define PERCPU_SEL          0x30   // gdt[6], based at the CPU's struct cpu
+
+#define TRAMPOLINE_ADDR     0x8000 // Real-mode entry point for the APs (SIPI vector 8)
+
+#define SMP_MAX_JOBS        16
+#define PERF_SW_SLOTS       16     // Software event counters per CPU (perf.h)
+
+#define RESCHED_VECTOR      0x41   // IPI: re-run the scheduler on the target CPU
+#define TLB_VECTOR          0x42   // IPI: flush the TLB
+
+/*
+ * Per-CPU state. Each CPU has its own GDT, whose entry 6 is a data segment
+ * based at the CPU's struct cpu and loaded into %fs, so this_cpu() is a
+ * single load of %fs:0.
+ */
+struct cpu {
+    struct cpu *self;           // Must stay first (this_cpu)
+    int id;
+    uint8_t apic_id;
+    volatile int online;
+    volatile int tlb_flush_pending;
+    struct page_directory_entry *active_pd;
+    void *boot_stack;           // Becomes the idle thread's stack
+    struct gdt_entry_bits gdt[GDT_ENTRIES] __attribute__((aligned(8)));
+    struct seg_desc gdt_desc;
+    struct tss_entry tss;
+    uint32_t perf_sw[PERF_SW_SLOTS];  // Only ever added to through %fs (perf_count)
+    uint32_t irq_counts[IDT_SIZE];    // Interrupts taken per vector, added to the same way
+};
+
+extern struct cpu cpus[MAX_CPUS];
+extern int ncpus;
+
+static inline struct cpu *this_cpu(void) {
+    struct cpu *c;
+    asm volatile("mov %%fs:0, %0" : "=r"(c));
+    return c;
+}
+
+static inline int cpu_id(void) {
+    return this_cpu()->id;
+}
+
+void smp_init_bsp(void);
+int smp_boot_aps(void);
+void smp_send_resched(int cpu);
+void tlb_shootdown(void);
+int smp_run(void (*fn)(int job, void *arg), void *arg, int njobs);
+
+#endif
@@ -0,0 +1,63 @@
+# entry.s
+#
+# Kernel entry point. A multiboot2 loader jumps here with the magic value in
+# %eax and the physical address of the boot information in %ebx, paging off.
+# The kernel is linked at KERNEL_VMA + 1 MB but loaded at 1 MB, so this
+# code lives in .boot, linked where it is loaded, and reaches everything
+# else at its physical address (symbol - KERNEL_VMA).
+#
+# It fills the kernel page directory with 4 MB pages: physical 0 to
+# DIRECT_MAP_SIZE at KERNEL_VMA (the direct map, page.h), plus the first
+# 4 MB at 0 so the instructions right after paging is turned on still have
+# a mapping. main() removes that identity page. Needs PSE (Pentium or later).
+# CR0.WP is set so read-only pages are read-only to the kernel too.
+
+.set KERNEL_VMA, 0xC0000000
+.set DIRECT_MAP_PDES, 64            # DIRECT_MAP_SIZE / 4 MB
+.set PDE_LARGE, 0x83                # Present, writable, 4 MB page
+.set BOOT_STACK_SIZE, 16384
+
+.section .boot, "ax"
+.globl _start
+_start:
+    mov %eax, multiboot_magic - KERNEL_VMA
+    mov %ebx, multiboot_info_addr - KERNEL_VMA
+
+    mov $(pd - KERNEL_VMA), %edi
+    movl $PDE_LARGE, (%edi)
+    lea (KERNEL_VMA >> 20)(%edi), %edi  # Directory entry for KERNEL_VMA
+    mov $PDE_LARGE, %eax
+    mov $DIRECT_MAP_PDES, %ecx
+1:
+    mov %eax, (%edi)
+    add $0x400000, %eax
+    add $4, %edi
+    loop 1b
+
+    mov %cr4, %eax
+    or $0x10, %eax                  # PSE
+    mov %eax, %cr4
+    mov $(pd - KERNEL_VMA), %eax
+    mov %eax, %cr3
+    mov %cr0, %eax
+    or $0x80010001, %eax            # PG, WP, PE
+    mov %eax, %cr0
+
+    mov $higher_half, %eax
+    jmp *%eax
+
+.text
+higher_half:
+    mov $_end_stack, %esp
+    call main
+1:
+    cli
+    hlt
+    jmp 1b
+
+# The boot CPU's stack until the scheduler gives main() a thread
+.section .stack, "aw", @nobits
+.align 16
+    .skip BOOT_STACK_SIZE
+
+.section .note.GNU-stack,"",@progbits
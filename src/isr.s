@@ -0,0 +1,50 @@
+# isr.s
+#
+# Interrupt entry stubs for all 256 vectors.
+#
+# Every stub is padded to 16 bytes, so the stub for vector n lives at
+# isr_stubs + 16 * n. Stubs for vectors where the CPU does not push an error
+# code push a zero in its place, so every handler sees the same struct regs
+# layout (see interrupt.h). The common path saves the general purpose
+# registers, %ds, %es and %fs. The interrupted code may be running in ring 3
+# with any selector loaded, even a null one, so %ds and %es are reloaded
+# with the kernel data selector and %fs with the per-CPU data selector.
+
+.text
+.align 16
+.globl isr_stubs
+isr_stubs:
+.set vec, 0
+.rept 256
+    .align 16
+    .if (vec == 8) || ((vec >= 10) && (vec <= 14)) || (vec == 17) || (vec == 21) || (vec == 29) || (vec == 30)
+    .else
+    push $0                 # No error code from the CPU
+    .endif
+    push $vec
+    jmp isr_common
+    .set vec, vec + 1
+.endr
+
+isr_common:
+    push %fs
+    push %es
+    push %ds
+    pushal
+    mov $0x10, %ax          # Kernel data
+    mov %ax, %ds
+    mov %ax, %es
+    mov $0x30, %ax          # PERCPU_SEL
+    mov %ax, %fs
+    cld
+    push %esp               # struct regs *
+    call irq_dispatch
+    add $4, %esp
+    popal
+    pop %ds
+    pop %es
+    pop %fs
+    add $8, %esp            # Vector number and error code
+    iret
+
+.section .note.GNU-stack,"",@progbits
@@ -7,6 +7,28 @@ const unsigned int multiboot_header[] __attribute__((section(".multiboot"))) = {
 #include "../page.h"
 #include "../sd.h"
 #include "../fat.h"
+#include "../timer.h"
+#include "../sched.h"
+#include "../syscall.h"
+#include "../keyboard.h"
+#include "../apic.h"
+#include "../acpi.h"
+#include "../smp.h"
+#include "../blk.h"
+#include "../pci.h"
+#include "../ahci.h"
+#include "../virtio.h"
+#include "../multiboot.h"
+#include "../ramdisk.h"
+#include "../serial.h"
+#include "../bench.h"
+#include "../test.h"
+#include "../console.h"
+#include "../trace.h"
+#include "../profile.h"
+#include "../perf.h"
+#include "../shell.h"
+#include "../boot.h"
 
 // External symbols from linker script
 extern int _end_kernel;
@@ -14,10 +36,14 @@ extern int _end_kernel;
 // External page directory from page.c
 extern struct page_directory_entry pd[1024];
 
-int putc(int data) {
-    // Video memory starts at 0xB8000
-    volatile unsigned short* vram = (unsigned short*)0xB8000;
+DEFINE_SPINLOCK(console_lock);  // Guards cursor_pos and scrolling
+
+// VGA text output; putc() (console.c) decides whether it is used
+int vga_putc(int data) {
+    // Video memory starts at 0xB8000, reached through the direct map
+    volatile unsigned short* vram = phys_to_virt(0xB8000);
     static int cursor_pos = 0;
+    uint32_t flags = spin_lock_irqsave(&console_lock);
     
     if (data == '\n') {
         // Move to next line (80 characters per line)
@@ -25,6 +51,11 @@ int putc(int data) {
     } else if (data == '\r') {
         // Carriage return - move to beginning of current line
         cursor_pos = (cursor_pos / 80) * 80;
+    } else if (data == '\b') {
+        // Backspace - step back, but not past the start of the line
+        if (cursor_pos % 80 != 0) {
+            cursor_pos--;
+        }
     } else {
         // Write character with gray color (0x07) on black background
         vram[cursor_pos] = (0x07 << 8) | (unsigned char)data;
@@ -45,6 +76,7 @@ int putc(int data) {
         cursor_pos = 80 * 24;
     }
     
+    spin_unlock_irqrestore(&console_lock, flags);
     return data;
 }
 
@@ -54,18 +86,285 @@ int putc_wrapper(int data) {
     return data;
 }
 
+// Parallel checksum demo: each job sums one slice of the buffer
+struct checksum_work {
+    const uint8_t *buf;
+    uint32_t len;
+    int njobs;
+    uint32_t sums[SMP_MAX_JOBS];
+};
+
+static void checksum_job(int job, void *arg) {
+    struct checksum_work *w = (struct checksum_work *)arg;
+    uint32_t slice = w->len / w->njobs;
+    uint32_t start = job * slice;
+    uint32_t end = (job == w->njobs - 1) ? w->len : start + slice;
+    uint32_t sum = 0;
+
+    for (uint32_t i = start; i < end; i++) {
+        sum += w->buf[i];
+    }
+    w->sums[job] = sum;
+}
+
+// Returns the time in microseconds to checksum buf with njobs threads
+static uint32_t parallel_checksum(const uint8_t *buf, uint32_t len, int njobs, uint32_t *sum) {
+    struct checksum_work w;
+    w.buf = buf;
+    w.len = len;
+    w.njobs = njobs;
+
+    uint64_t start = ktime_ns();
+    smp_run(checksum_job, &w, njobs);
+    uint32_t us = div64_32(ktime_ns() - start, 1000);
+
+    *sum = 0;
+    for (int i = 0; i < njobs; i++) {
+        *sum += w.sums[i];
+    }
+    return us;
+}
+
+// Frame allocator stress: each job repeatedly takes a few frames and frees them
+#define PFA_STRESS_ROUNDS 2000
+#define PFA_STRESS_DEPTH  3
+
+static void pfa_stress_job(int job, void *arg) {
+    volatile uint32_t *failures = (volatile uint32_t *)arg;
+    struct ppage *held[PFA_STRESS_DEPTH];
+
+    for (int round = 0; round < PFA_STRESS_ROUNDS; round++) {
+        for (int i = 0; i < PFA_STRESS_DEPTH; i++) {
+            held[i] = allocate_physical_pages(1);
+            if (held[i] == NULL) {
+                atomic_inc(failures);
+            }
+        }
+        for (int i = 0; i < PFA_STRESS_DEPTH; i++) {
+            free_physical_pages_list(held[i]);
+        }
+    }
+}
+
+// Returns the time in microseconds for njobs threads to run the stress loop
+static uint32_t pfa_stress(int njobs, uint32_t *failures) {
+    *failures = 0;
+    uint64_t start = ktime_ns();
+    smp_run(pfa_stress_job, (void *)failures, njobs);
+    return div64_32(ktime_ns() - start, 1000);
+}
+
+// Block queue demo: single-sector reads queued back to back get merged
+#define BLK_DEMO_REQS 16
+
+static volatile uint32_t blk_demo_left;
+
+static void blk_demo_done(struct blk_request *req) {
+    atomic_dec(&blk_demo_left);
+}
+
+static void blk_merge_demo(void) {
+    struct blk_request reqs[BLK_DEMO_REQS];
+    struct blockdev *disk = blockdev_boot();
+    if (disk == NULL || disk->queue == NULL) {
+        return;
+    }
+    struct blk_queue *q = disk->queue;
+    char *buf = kpage_alloc(2);
+    if (buf == NULL) {
+        return;
+    }
+
+    uint32_t submitted = q->nr_submitted;
+    uint32_t dispatched = q->nr_dispatched;
+    blk_demo_left = BLK_DEMO_REQS;
+
+    // Submit from the highest LBA down so later requests front-merge
+    for (int i = BLK_DEMO_REQS - 1; i >= 0; i--) {
+        reqs[i].queue = q;
+        reqs[i].lba = i;
+        reqs[i].count = 1;
+        reqs[i].buf = buf + i * 512;
+        if (blk_submit(&reqs[i], blk_demo_done) < 0) {
+            atomic_dec(&blk_demo_left);
+        }
+    }
+    while (blk_demo_left != 0) {
+        kthread_sleep(1);
+    }
+
+    esp_printf(putc_wrapper, "Block queue: %d requests in %d transfers\r\n",
+               q->nr_submitted - submitted, q->nr_dispatched - dispatched);
+    kpage_free(buf);
+}
+
+// Reads the first 1 MB of each disk, one thread per disk
+static struct ata_device *disk_list[ATA_MAX_DEVICES];
+
+static void disk_read_job(int job, void *arg) {
+    char *buf = kpage_alloc(256);
+    if (buf != NULL) {
+        ata_readblock(disk_list[job], 0, buf, 2048);
+        kpage_free(buf);
+    }
+}
+
+// Sequential read speed of the boot disk, to compare the drivers
+static void disk_throughput(void) {
+    struct blockdev *disk = blockdev_boot();
+    char *buf = kpage_alloc(256);
+    if (buf == NULL || disk == NULL) {
+        return;
+    }
+
+    uint64_t start = ktime_ns();
+    for (uint32_t mb = 0; mb < 4; mb++) {
+        blockdev_read(disk, mb * 2048, buf, 2048);
+    }
+    uint32_t ms = div64_32(ktime_ns() - start, 1000000);
+    esp_printf(putc_wrapper, "%s: read 4 MB in %d ms (%d KB/s)\r\n", disk->name,
+               ms, ms ? 4096 * 1000 / ms : 0);
+    kpage_free(buf);
+}
+
+// Reads the kernel image through FAT from dev; returns microseconds, or -1
+static int fat_read_timed(struct blockdev *dev, char *buf) {
+    if (dev == NULL || fatInit(dev) != 0) {
+        return -1;
+    }
+    int fd = fatOpen("kernel");
+    if (fd < 0) {
+        return -1;
+    }
+    uint64_t start = ktime_ns();
+    while (fatRead(fd, buf, 64 * 1024) > 0) {
+    }
+    uint32_t us = div64_32(ktime_ns() - start, 1000);
+    fatClose(fd);
+    return us;
+}
+
+// FAT read speed from the RAM disk against the boot disk
+static void fat_read_compare(void) {
+    struct blockdev *ram = ramdisk_get();
+    struct blockdev *disk = blockdev_root();
+    if (ram == NULL || disk == NULL) {
+        return;
+    }
+    char *buf = kpage_alloc(16);
+    if (buf == NULL) {
+        return;
+    }
+    int disk_us = fat_read_timed(disk, buf);
+    int ram_us = fat_read_timed(ram, buf);
+    esp_printf(putc_wrapper, "FAT read of kernel: %s %d us, %s %d us\r\n",
+               disk->name, disk_us, ram->name, ram_us);
+    kpage_free(buf);
+}
+
+static void parallel_disk_read(void) {
+    int ndisks = 0;
+    for (int i = 0; i < ATA_MAX_DEVICES; i++) {
+        if (ata_devices[i].present) {
+            disk_list[ndisks++] = &ata_devices[i];
+        }
+    }
+    if (ndisks == 0) {
+        return;
+    }
+
+    uint64_t start = ktime_ns();
+    smp_run(disk_read_job, NULL, ndisks);
+    esp_printf(putc_wrapper, "Read 1 MB from each of %d disks in parallel: %d us\r\n",
+               ndisks, (uint32_t)div64_32(ktime_ns() - start, 1000));
+}
+
+// Demo thread: counts until it has been scheduled for a while, then exits
+void spin_thread(void *arg) {
+    volatile int *count = (volatile int *)arg;
+    for (int i = 0; i < 20; i++) {
+        (*count)++;
+        kthread_sleep(1);
+    }
+}
+
+// Demos and measurements that run at the end of a normal boot
+static void boot_diagnostics(void) {
+    blk_merge_demo();
+    parallel_disk_read();
+    disk_throughput();
+    esp_printf(putc_wrapper, "Timer: %d Hz, TSC %d kHz, uptime %d ms\r\n\r\n",
+               timer_hz, tsc_khz, (uint32_t)div64_32(ktime_ns(), 1000000));
+
+    // Run ring 3 code and time null system calls through both entry paths
+    syscall_latency_test();
+    esp_printf(putc_wrapper, "\r\n");
+
+    // Checksum 1 MB on one CPU, then split across all of them
+    uint8_t *work = kpage_alloc(256);
+    if (work != NULL) {
+        for (uint32_t i = 0; i < 256 * PAGE_SIZE; i++) {
+            work[i] = i * 7;
+        }
+        uint32_t sum1, sumn;
+        uint32_t t1 = parallel_checksum(work, 256 * PAGE_SIZE, 1, &sum1);
+        uint32_t tn = parallel_checksum(work, 256 * PAGE_SIZE, ncpus, &sumn);
+        esp_printf(putc_wrapper, "Checksum 1 MB: 1 CPU %d us, %d CPUs %d us (%s)\r\n",
+                   t1, ncpus, tn, sum1 == sumn ? "match" : "MISMATCH");
+        kpage_free(work);
+    }
+
+    // Same per-thread allocator work on one CPU and on all of them; with the
+    // per-CPU magazines the time should stay roughly flat as CPUs are added
+    uint32_t fail1, failn;
+    uint32_t s1 = pfa_stress(1, &fail1);
+    uint32_t sn = pfa_stress(ncpus, &failn);
+    esp_printf(putc_wrapper, "Frame alloc stress: 1 thread %d us, %d threads %d us, %d failures, %d frames free\r\n",
+               s1, ncpus, sn, fail1 + failn, pfa_free_frames());
+
+    // Show how often each lock was taken and how often other CPUs waited on it
+    lock_stats_dump();
+    perf_stats_dump(putc_wrapper);
+}
+
 void main() {
-    // Clear the screen first
-    volatile unsigned short* vram = (unsigned short*)0xB8000;
-    for (int i = 0; i < 80 * 25; i++) {
-        vram[i] = (0x07 << 8) | ' ';
+    boot_start();  // Boot phases are timed from here
+
+    // Clear the screen first, two cells per store
+    volatile uint32_t* vram = phys_to_virt(0xB8000);
+    for (int i = 0; i < 80 * 25 / 2; i++) {
+        vram[i] = 0x07200720;
     }
+
+    // Copy out the boot information before its frames can be handed out
+    multiboot_parse();
+    fast_boot = multiboot_has_option("fastboot");
+    fat_verbose = !fast_boot;
+    serial_init(115200);
+    if (multiboot_has_option("console=serial")) {
+        console_set_targets(CONSOLE_SERIAL);
+    } else if (multiboot_has_option("console=vga")) {
+        console_set_targets(CONSOLE_VGA);
+    }
+    boot_phase("console");
     
     // Initialize interrupt system for keyboard input
     remap_pic();  // Set up the programmable interrupt controller
     load_gdt();   // Load the global descriptor table
     init_idt();   // Initialize the interrupt descriptor table
+    smp_init_bsp();   // Per-CPU GDT, TSS and %fs for the boot CPU
+    trace_enable(multiboot_has_option("trace"));  // Tracepoints need this_cpu()
+    keyboard_init();  // Register the keyboard IRQ handler
+    serial_irq_init();  // Feed COM1 from its transmit interrupt
     asm("sti");   // Enable interrupts
+    boot_phase("interrupts");
+    timer_init(CONFIG_HZ);  // Start the PIT tick and calibrate the TSC
+    boot_phase("timer");
+    if (multiboot_has_option("profile")) {
+        profile_start();  // Sample the interrupted EIP on every tick
+    }
+    syscall_init();         // Program the sysenter MSRs if supported
+    perf_init_cpu();        // Start the hardware counters if there is a PMU
     
     // Print welcome message
     esp_printf(putc_wrapper, "CS310 Homework 5: Fat Fs Driver\r\n");
@@ -74,65 +373,82 @@ void main() {
     
 
 	init_pfa_list();
+	for (int i = 0; i < multiboot_nmodules; i++) {
+		pfa_reserve(multiboot_modules[i].start, multiboot_modules[i].end);
+	}
 	esp_printf(putc_wrapper, "Page frame allocator initialized\r\n");
     
-    // Identity map the kernel
-// Map from 0x100000 (1MB) to end of kernel
-for (uint32_t addr = 0x100000; addr < (uint32_t)&_end_kernel; addr += 0x1000) {
-    struct ppage tmp;
-    tmp.next = NULL;
-    tmp.prev = NULL;
-    tmp.physical_addr = (void *)addr;
-    map_pages((void *)addr, &tmp, pd);
-}
-
-// Identity map the video buffer at 0xB8000
-	struct ppage video_page;
-	video_page.next = NULL;
-	video_page.prev = NULL;
-	video_page.physical_addr = (void *)0xB8000;
-	map_pages((void *)0xB8000, &video_page, pd);
-
-// Identity map the stack
-	uint32_t esp;
-	asm("mov %%esp,%0" : "=r" (esp));
-	uint32_t stack_start = esp & 0xFFFFF000;  // Round down to page boundary
-	for (uint32_t addr = stack_start; addr < stack_start + 0x10000; addr += 0x1000) {
-		struct ppage tmp;
-		tmp.next = NULL;
-		tmp.prev = NULL;
-		tmp.physical_addr = (void *)addr;
-		map_pages((void *)addr, &tmp, pd);
-}
-
-esp_printf(putc_wrapper, "Identity mapping complete\r\n");
-
-// Load page directory and enable paging
-asm("mov %0,%%cr3" : : "r"(pd));
-asm("mov %%cr0, %%eax\n"
-    "or $0x80000001,%%eax\n"
-    "mov %%eax,%%cr0" : : : "eax");
-
-esp_printf(putc_wrapper, "Paging enabled!\r\n");
+    // src/entry.s turned paging on with the direct map and a temporary
+    // identity map of the first 4 MB. Drop the latter so NULL faults again.
+    *(uint32_t *)&pd[0] = 0;
+    asm volatile("mov %%cr3, %%eax\n"
+                 "mov %%eax, %%cr3" : : : "eax", "memory");
+    esp_printf(putc_wrapper, "Paging enabled, %d MB direct mapped at 0x%x\r\n",
+               DIRECT_MAP_SIZE >> 20, KERNEL_VMA);
+boot_phase("paging");
+
+// Hand interrupts to the IOAPIC and the tick to the local APIC timer
+if (apic_init() == 0) {
+    esp_printf(putc_wrapper, "APIC enabled: %d CPUs, tick %d counts\r\n",
+               acpi_info.ncpus, apic_timer_ticks);
+} else {
+    esp_printf(putc_wrapper, "No APIC, using 8259 PIC\r\n");
+}
+boot_phase("apic");
     
-    struct ppage *pages = allocate_physical_pages(10);
+    struct ppage *pages = fast_boot ? NULL : allocate_physical_pages(10);
 if (pages != NULL) {
     esp_printf(putc_wrapper, "Allocated 10 pages successfully\r\n");
     free_physical_pages_list(pages);
     esp_printf(putc_wrapper, "Freed 10 pages\r\n");
 }
 esp_printf(putc_wrapper, "\r\n");
+
+// Start the scheduler now that the kernel heap can be mapped
+sched_init();
+if (!fast_boot) {
+    volatile int spins[2] = {0, 0};
+    kthread_create(spin_thread, (void *)&spins[0], "spin0");
+    kthread_create(spin_thread, (void *)&spins[1], "spin1");
+    kthread_sleep(50);
+    esp_printf(putc_wrapper, "Scheduler running: spin0=%d spin1=%d\r\n", spins[0], spins[1]);
+}
+boot_phase("scheduler");
+
+// Wake the other processors now that they have a scheduler to join
+esp_printf(putc_wrapper, "SMP: %d CPUs online\r\n", smp_boot_aps());
+boot_phase("smp");
     
     
 esp_printf(putc_wrapper, "\r\n=== Testing FAT Filesystem ===\r\n");
 
-// Initialize SD card driver
+// Find the disks. The first driver to find one serves the FAT volume, so
+// the faster controllers go first.
 esp_printf(putc_wrapper, "Initializing SD card...\r\n");
+pci_init();
+virtio_blk_init();
+ahci_init();
 sd_init();
+for (struct blockdev *dev = blockdev_list; dev != NULL; dev = dev->next) {
+    if (dev->parent == NULL) {
+        mbr_scan(dev);
+    }
+}
+ramdisk_init();
+boot_phase("disks");
+if (!fast_boot) {
+    fat_read_compare();
+}
 
-// Initialize FAT filesystem
+// Initialize FAT filesystem, from the RAM disk if GRUB loaded one
 esp_printf(putc_wrapper, "Initializing FAT filesystem...\r\n");
-if (fatInit() == 0) {
+struct blockdev *root = ramdisk_get();
+if (root == NULL) {
+    root = blockdev_root();
+}
+if (fast_boot) {
+    fat_mount_deferred(root);  // Mounted by the first fatOpen
+} else if (fatInit(root) == 0) {
     esp_printf(putc_wrapper, "FAT filesystem initialized successfully!\r\n");
     
     // Open test file
@@ -151,9 +467,39 @@ if (fatInit() == 0) {
             esp_printf(putc_wrapper, "\r\n=== File contents ===\r\n");
             esp_printf(putc_wrapper, "%s", buffer);
             esp_printf(putc_wrapper, "\r\n=== End of file (%d bytes) ===\r\n", bytes_read);
+
+            // Map the same file and compare it against the fatRead copy.
+            // The first touch of each page goes through the page fault handler.
+            char *mapped = fat_mmap(fd, 0, bytes_read);
+            if (mapped != NULL) {
+                int same = 1;
+                for (int i = 0; i < bytes_read; i++) {
+                    if (mapped[i] != buffer[i]) {
+                        same = 0;
+                        break;
+                    }
+                }
+                esp_printf(putc_wrapper, "fat_mmap at 0x%x: %s\r\n", (unsigned int)mapped,
+                           same ? "contents match" : "MISMATCH");
+                fat_munmap(mapped);
+
+                // Map it again and fault the pages in from every CPU at once
+                mapped = fat_mmap(fd, 0, bytes_read);
+                if (mapped != NULL) {
+                    uint32_t expect = 0, sum;
+                    for (int i = 0; i < bytes_read; i++) {
+                        expect += (uint8_t)buffer[i];
+                    }
+                    parallel_checksum((uint8_t *)mapped, bytes_read, ncpus, &sum);
+                    esp_printf(putc_wrapper, "Parallel fat_mmap checksum on %d CPUs: %s\r\n",
+                               ncpus, sum == expect ? "match" : "MISMATCH");
+                    fat_munmap(mapped);
+                }
+            }
         } else {
             esp_printf(putc_wrapper, "ERROR: Failed to read file\r\n");
         }
+        fatClose(fd);
     } else {
         esp_printf(putc_wrapper, "ERROR: Failed to open file\r\n");
     }
@@ -162,9 +508,34 @@ if (fatInit() == 0) {
 }
 
 esp_printf(putc_wrapper, "\r\n=== FAT Test Complete ===\r\n\r\n");
+boot_phase("filesystem");
+if (!fast_boot) {
+    boot_diagnostics();
+}
+boot_phase("diagnostics");
+boot_report();
 
-    // Infinite loop - wait for keyboard interrupts
-    while(1) {
-        asm("hlt");  // Halt until next interrupt
-    }
+// Regression tests and micro-benchmarks, when asked for on the command
+// line. Under 'make test' QEMU exits here with the result.
+int test_failures = 0;
+if (multiboot_has_option("test")) {
+    test_failures = test_run_all();
+    esp_printf(putc_wrapper, "Tests: %d failed, results on COM1\r\n", test_failures);
+}
+if (multiboot_has_option("bench")) {
+    esp_printf(putc_wrapper, "Benchmarks: %d run, results on COM1\r\n", bench_run_all());
+}
+if (trace_enabled) {
+    trace_dump();
+}
+if (profile_enabled) {
+    profile_stop();
+    profile_dump();
+}
+if (multiboot_has_option("test")) {
+    qemu_exit(test_failures ? QEMU_EXIT_FAIL : QEMU_EXIT_PASS);
+}
+
+    // Hand the keyboard to the shell; it never returns
+    shell_run();
 }
@@ -0,0 +1,32 @@
+# switch.s
+#
+# Kernel thread context switch.
+#
+# void context_switch(uint32_t *old_esp, uint32_t new_esp)
+#
+# Saves the callee-saved registers on the current stack, stores the stack
+# pointer through old_esp, then loads new_esp and restores the registers the
+# other thread saved when it switched away. The caller-saved registers are
+# already preserved by the C calling convention.
+
+.text
+.globl context_switch
+context_switch:
+    mov 4(%esp), %eax
+    mov 8(%esp), %edx
+
+    push %ebp
+    push %ebx
+    push %esi
+    push %edi
+
+    mov %esp, (%eax)
+    mov %edx, %esp
+
+    pop %edi
+    pop %esi
+    pop %ebx
+    pop %ebp
+    ret
+
+.section .note.GNU-stack,"",@progbits
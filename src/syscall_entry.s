@@ -0,0 +1,106 @@
+# syscall_entry.s
+#
+# System call entry stubs and the jump to ring 3.
+#
+# Both stubs save only what the C calling convention does not already
+# preserve for us: ebx, esi and edi are pushed as the three arguments and are
+# callee-saved anyway, and ecx/edx are declared clobbered by the ABI (see
+# syscall.h). %ds and %es are saved and reloaded with the kernel data
+# selector, since ring 3 may have loaded a null selector into them, and %fs
+# with the per-CPU data selector. %gs is left alone; the kernel never uses it.
+
+.text
+
+# int 0x80, installed as a DPL 3 trap gate so interrupts stay enabled
+.globl syscall_entry
+syscall_entry:
+    push %ds
+    push %es
+    push %fs
+    mov $0x10, %dx          # Kernel data
+    mov %dx, %ds
+    mov %dx, %es
+    mov $0x30, %dx          # PERCPU_SEL
+    mov %dx, %fs
+    cld
+    cmp nr_syscalls, %eax
+    jae 1f
+    push %edi
+    push %esi
+    push %ebx
+    call *syscall_table(,%eax,4)
+    add $12, %esp
+    pop %fs
+    pop %es
+    pop %ds
+    iret
+1:
+    mov $-1, %eax
+    pop %fs
+    pop %es
+    pop %ds
+    iret
+
+# sysenter: the CPU loads cs/ss from SYSENTER_CS and esp from SYSENTER_ESP,
+# and clears IF. User code passes its return eip in edx and esp in ecx.
+.globl sysenter_entry
+sysenter_entry:
+    push %ecx
+    push %edx
+    push %ds
+    push %es
+    push %fs
+    mov $0x10, %dx          # Kernel data
+    mov %dx, %ds
+    mov %dx, %es
+    mov $0x30, %dx          # PERCPU_SEL
+    mov %dx, %fs
+    sti
+    cld
+    cmp nr_syscalls, %eax
+    jae 1f
+    push %edi
+    push %esi
+    push %ebx
+    call *syscall_table(,%eax,4)
+    add $12, %esp
+    jmp 2f
+1:
+    mov $-1, %eax
+2:
+    pop %fs
+    pop %es
+    pop %ds
+    pop %edx
+    pop %ecx
+    sysexit
+
+# void enter_user_mode(uint32_t entry, uint32_t user_esp)
+.globl enter_user_mode
+enter_user_mode:
+    mov 4(%esp), %ecx
+    mov 8(%esp), %edx
+
+    mov $0x23, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+
+    push $0x23              # ss
+    push %edx               # esp
+    pushfl
+    orl $0x200, (%esp)      # eflags with IF set
+    push $0x1b              # cs
+    push %ecx               # eip
+
+    xor %eax, %eax
+    xor %ebx, %ebx
+    xor %ecx, %ecx
+    xor %edx, %edx
+    xor %esi, %esi
+    xor %edi, %edi
+    xor %ebp, %ebp
+    iret
+
+.section .note.GNU-stack,"",@progbits
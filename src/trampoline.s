@@ -0,0 +1,75 @@
+# trampoline.s
+#
+# Real-mode entry point for the application processors.
+#
+# smp_boot_aps() copies this blob to TRAMPOLINE_ADDR (smp.h) and fills in
+# the variables at the end before sending the startup IPIs. Each AP starts
+# here in real mode with cs = TRAMPOLINE_ADDR >> 4, loads a temporary flat
+# GDT, enters protected mode, turns on paging with the kernel page directory
+# and calls ap_main(cpu) on its own stack. ap_main() loads the CPU's real
+# GDT. The code does not run where it was linked, so every address is
+# computed relative to TRAMPOLINE_ADDR.
+
+.set TRAMPOLINE_ADDR, 0x8000
+
+.text
+.globl trampoline_start, trampoline_end
+.globl tramp_cr3, tramp_cr4, tramp_stack, tramp_entry, tramp_cpu
+
+.align 16
+.code16
+trampoline_start:
+    cli
+    cld
+    xor %ax, %ax
+    mov %ax, %ds
+    lgdtl tramp_gdt_desc - trampoline_start + TRAMPOLINE_ADDR
+    mov %cr0, %eax
+    or $1, %eax                     # PE
+    mov %eax, %cr0
+    ljmpl $0x08, $(tramp_pm - trampoline_start + TRAMPOLINE_ADDR)
+
+.code32
+tramp_pm:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %ss
+    mov %ax, %fs
+    mov %ax, %gs
+
+    mov tramp_cr4 - trampoline_start + TRAMPOLINE_ADDR, %eax
+    mov %eax, %cr4                  # PSE, for large pages in the directory
+    mov tramp_cr3 - trampoline_start + TRAMPOLINE_ADDR, %eax
+    mov %eax, %cr3
+    mov %cr0, %eax
+    or $0x80010000, %eax            # PG, WP
+    mov %eax, %cr0
+
+    mov tramp_stack - trampoline_start + TRAMPOLINE_ADDR, %esp
+    pushl tramp_cpu - trampoline_start + TRAMPOLINE_ADDR           # struct cpu *
+    mov tramp_entry - trampoline_start + TRAMPOLINE_ADDR, %eax
+    call *%eax
+1:
+    cli
+    hlt
+    jmp 1b
+
+.align 8
+tramp_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF        # Flat 4 GB code, ring 0
+    .quad 0x00CF92000000FFFF        # Flat 4 GB data, ring 0
+tramp_gdt_desc:
+    .word tramp_gdt_desc - tramp_gdt - 1
+    .long tramp_gdt - trampoline_start + TRAMPOLINE_ADDR
+
+.align 4
+tramp_cr3:   .long 0                # Kernel page directory
+tramp_cr4:   .long 0                # The boot CPU's CR4
+tramp_stack: .long 0                # Top of the AP's boot stack
+tramp_entry: .long 0                # ap_main
+tramp_cpu:   .long 0                # Argument to ap_main
+trampoline_end:
+
+.section .note.GNU-stack,"",@progbits
@@ -0,0 +1,65 @@
+# usertest.s
+#
+# Ring 3 code built into the kernel for measuring system call latency. The
+# whole block is copied to USER_BASE by proc_spawn_image(), so everything in
+# it must be position independent. Each entry point runs ITERATIONS null
+# system calls and exits with the average number of cycles per call.
+
+.set SYS_exit, 0
+.set SYS_getpid, 1
+.set ITERATIONS, 1000
+
+.text
+.globl user_test_start
+.globl user_test_end
+.globl ubench_int80
+.globl ubench_sysenter
+
+user_test_start:
+
+ubench_int80:
+    mov $ITERATIONS, %esi
+    rdtsc
+    mov %eax, %edi
+    mov %edx, %ebp
+1:
+    mov $SYS_getpid, %eax
+    int $0x80
+    dec %esi
+    jnz 1b
+    jmp report
+
+ubench_sysenter:
+    call 2f
+2:
+    pop %ebx
+    add $(3f - 2b), %ebx    # Address sysexit should return to
+    mov $ITERATIONS, %esi
+    rdtsc
+    mov %eax, %edi
+    mov %edx, %ebp
+4:
+    mov $SYS_getpid, %eax
+    mov %ebx, %edx
+    mov %esp, %ecx
+    sysenter
+3:
+    dec %esi
+    jnz 4b
+
+# edx:eax = (rdtsc - ebp:edi) / ITERATIONS, then exit with it
+report:
+    rdtsc
+    sub %edi, %eax
+    sbb %ebp, %edx
+    mov $ITERATIONS, %ecx
+    div %ecx
+    mov %eax, %ebx
+    mov $SYS_exit, %eax
+    int $0x80
+5:
+    jmp 5b
+
+user_test_end:
+
+.section .note.GNU-stack,"",@progbits
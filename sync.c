@@ -0,0 +1,41 @@
+/*
+ * sync.c
+ *
+ * Lock contention statistics. The lock primitives themselves are inline in
+ * sync.h; locks defined with DEFINE_SPINLOCK / DEFINE_RWLOCK land in the
+ * .data.locks / .data.rwlocks sections, which kernel.ld brackets with
+ * symbols so they can be walked here.
+ */
+
+#include <stdint.h>
+#include "sync.h"
+#include "rprintf.h"
+
+extern int putc(int data);
+
+extern spinlock_t _start_locks[], _end_locks[];
+extern rwlock_t _start_rwlocks[], _end_rwlocks[];
+
+static void print_stats(const char *kind, const char *name, struct lock_stats *s) {
+    esp_printf(putc, "%-6s %-20s acq %10d cont %8d spins %10d\r\n",
+               kind, name, s->acquired, s->contended, s->spins);
+}
+
+void lock_stats_dump(void) {
+    esp_printf(putc, "lock statistics:\r\n");
+    for (spinlock_t *l = _start_locks; l < _end_locks; l++) {
+        print_stats("spin", l->name, &l->stats);
+    }
+    for (rwlock_t *l = _start_rwlocks; l < _end_rwlocks; l++) {
+        print_stats("rw", l->name, &l->stats);
+    }
+}
+
+void lock_stats_reset(void) {
+    for (spinlock_t *l = _start_locks; l < _end_locks; l++) {
+        l->stats.acquired = l->stats.contended = l->stats.spins = 0;
+    }
+    for (rwlock_t *l = _start_rwlocks; l < _end_rwlocks; l++) {
+        l->stats.acquired = l->stats.contended = l->stats.spins = 0;
+    }
+}
@@ -0,0 +1,214 @@
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/*
+ * Locks for state shared between CPUs.
+ *
+ * spinlock_t is a ticket lock: each CPU takes a ticket with one xadd and
+ * waits, with pause, until the owner field reaches it, so waiters get the
+ * lock in arrival order. Locks that an interrupt handler also takes must be
+ * held with interrupts disabled, through the _irqsave variants.
+ *
+ * Every lock counts its acquisitions and how often and how long it had to
+ * wait. Locks defined with DEFINE_SPINLOCK / DEFINE_RWLOCK are collected in
+ * a linker section so lock_stats_dump() can list them.
+ */
+
+static inline uint32_t atomic_xadd(volatile uint32_t *p, uint32_t v) {
+    asm volatile("lock xadd %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+    return v;
+}
+
+static inline uint32_t atomic_cmpxchg(volatile uint32_t *p, uint32_t old, uint32_t new) {
+    uint32_t prev;
+    asm volatile("lock cmpxchg %2, %1" : "=a"(prev), "+m"(*p) : "r"(new), "0"(old) : "memory");
+    return prev;
+}
+
+static inline void atomic_inc(volatile uint32_t *p) {
+    asm volatile("lock incl %0" : "+m"(*p) : : "memory");
+}
+
+static inline void atomic_dec(volatile uint32_t *p) {
+    asm volatile("lock decl %0" : "+m"(*p) : : "memory");
+}
+
+static inline void atomic_or(volatile uint32_t *p, uint32_t v) {
+    asm volatile("lock orl %1, %0" : "+m"(*p) : "r"(v) : "memory");
+}
+
+static inline void atomic_and(volatile uint32_t *p, uint32_t v) {
+    asm volatile("lock andl %1, %0" : "+m"(*p) : "r"(v) : "memory");
+}
+
+static inline void cpu_relax(void) {
+    asm volatile("pause" : : : "memory");
+}
+
+struct lock_stats {
+    volatile uint32_t acquired;
+    volatile uint32_t contended;   // Acquisitions that had to wait
+    volatile uint32_t spins;       // Total pause iterations spent waiting
+};
+
+typedef struct spinlock {
+    volatile uint32_t next;        // Next ticket to hand out
+    volatile uint32_t owner;       // Ticket being served
+    const char *name;
+    struct lock_stats stats;
+} spinlock_t;
+
+#define SPINLOCK_INIT(n) { 0, 0, n, { 0, 0, 0 } }
+#define DEFINE_SPINLOCK(var) \
+    spinlock_t var __attribute__((section(".data.locks"))) = SPINLOCK_INIT(#var)
+
+static inline void spin_lock_init(spinlock_t *l, const char *name) {
+    l->next = 0;
+    l->owner = 0;
+    l->name = name;
+    l->stats.acquired = l->stats.contended = l->stats.spins = 0;
+}
+
+static inline void spin_lock(spinlock_t *l) {
+    uint32_t ticket = atomic_xadd(&l->next, 1);
+
+    uint32_t spins = 0;
+    while (l->owner != ticket) {
+        cpu_relax();
+        spins++;
+    }
+    // Acquire: accesses to the protected data stay after the owner check
+    asm volatile("" : : : "memory");
+    if (spins != 0) {
+        l->stats.contended++;
+        l->stats.spins += spins;
+    }
+    l->stats.acquired++;
+}
+
+static inline int spin_trylock(spinlock_t *l) {
+    uint32_t owner = l->owner;
+
+    if (l->next != owner || atomic_cmpxchg(&l->next, owner, owner + 1) != owner) {
+        return 0;
+    }
+    l->stats.acquired++;
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    asm volatile("" : : : "memory");
+    l->owner++;  // Only the holder writes owner
+}
+
+static inline int spin_is_locked(spinlock_t *l) {
+    return l->next != l->owner;
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t *l) {
+    uint32_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint32_t flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+}
+
+/*
+ * Reader-writer spinlock. state counts the readers in its low bits. A writer
+ * that has to wait sets RW_WAITING, which keeps new readers out so writers
+ * are not starved by a steady stream of readers.
+ */
+#define RW_WRITER   0x80000000
+#define RW_WAITING  0x40000000
+
+typedef struct rwlock {
+    volatile uint32_t state;
+    const char *name;
+    struct lock_stats stats;
+} rwlock_t;
+
+#define RWLOCK_INIT(n) { 0, n, { 0, 0, 0 } }
+#define DEFINE_RWLOCK(var) \
+    rwlock_t var __attribute__((section(".data.rwlocks"))) = RWLOCK_INIT(#var)
+
+static inline void read_lock(rwlock_t *l) {
+    uint32_t spins = 0;
+
+    for (;;) {
+        uint32_t s = l->state;
+        if (!(s & (RW_WRITER | RW_WAITING)) && atomic_cmpxchg(&l->state, s, s + 1) == s) {
+            break;
+        }
+        cpu_relax();
+        spins++;
+    }
+    // Readers run concurrently, so their counters need locked updates
+    atomic_inc(&l->stats.acquired);
+    if (spins != 0) {
+        atomic_inc(&l->stats.contended);
+        atomic_xadd(&l->stats.spins, spins);
+    }
+}
+
+static inline void read_unlock(rwlock_t *l) {
+    atomic_dec(&l->state);
+}
+
+static inline void write_lock(rwlock_t *l) {
+    uint32_t spins = 0;
+
+    for (;;) {
+        uint32_t s = l->state;
+        if ((s & ~RW_WAITING) == 0) {
+            if (atomic_cmpxchg(&l->state, s, RW_WRITER) == s) {
+                break;
+            }
+        } else if (!(s & RW_WAITING)) {
+            atomic_or(&l->state, RW_WAITING);
+        }
+        cpu_relax();
+        spins++;
+    }
+    l->stats.acquired++;
+    if (spins != 0) {
+        l->stats.contended++;
+        l->stats.spins += spins;
+    }
+}
+
+static inline void write_unlock(rwlock_t *l) {
+    atomic_and(&l->state, ~RW_WRITER);  // Keeps RW_WAITING set by other writers
+}
+
+static inline uint32_t read_lock_irqsave(rwlock_t *l) {
+    uint32_t flags = irq_save();
+    read_lock(l);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *l, uint32_t flags) {
+    read_unlock(l);
+    irq_restore(flags);
+}
+
+static inline uint32_t write_lock_irqsave(rwlock_t *l) {
+    uint32_t flags = irq_save();
+    write_lock(l);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *l, uint32_t flags) {
+    write_unlock(l);
+    irq_restore(flags);
+}
+
+void lock_stats_dump(void);
+void lock_stats_reset(void);
+
+#endif
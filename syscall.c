@@ -0,0 +1,130 @@
+/*
+ * syscall.c
+ *
+ * System call table and the sysenter setup. The entry stubs in
+ * src/syscall_entry.s index syscall_table directly with the number in eax, so a
+ * call costs one bounds check and one indirect call on top of the trap.
+ */
+
+#include <stdint.h>
+#include "syscall.h"
+#include "proc.h"
+#include "page.h"
+#include "smp.h"
+#include "sched.h"
+#include "timer.h"
+#include "interrupt.h"
+#include "rprintf.h"
+
+extern int putc(int data);
+extern int sysenter_enabled;
+
+static int sys_exit(uint32_t code, uint32_t unused1, uint32_t unused2) {
+    proc_exit((int)code);
+    return 0;  // Not reached
+}
+
+static int sys_getpid(uint32_t unused0, uint32_t unused1, uint32_t unused2) {
+    struct process *p = current_process();
+    return p != NULL ? p->pid : 0;
+}
+
+/*
+ * Whether [addr, addr + len) lies in user space and every page of it is
+ * mapped for ring 3. The kernel can then touch it without faulting; a fault
+ * there would be taken as a kernel bug.
+ */
+static int user_range_ok(uint32_t addr, uint32_t len) {
+    if (addr < USER_BASE || addr + len < addr || addr + len > USER_TOP) {
+        return 0;
+    }
+    if (len == 0) {
+        return 1;
+    }
+    for (uint32_t v = addr & ~(PAGE_SIZE - 1); v < addr + len; v += PAGE_SIZE) {
+        struct page *pte = get_pte(this_cpu()->active_pd, v);
+        if (pte == NULL || !pte->present || !pte->user) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int sys_write(uint32_t buf, uint32_t len, uint32_t unused2) {
+    if (!user_range_ok(buf, len)) {
+        return -1;
+    }
+    const char *s = (const char *)buf;
+    for (uint32_t i = 0; i < len; i++) {
+        putc(s[i]);
+    }
+    return len;
+}
+
+static int sys_yield(uint32_t unused0, uint32_t unused1, uint32_t unused2) {
+    sched_yield();
+    return 0;
+}
+
+static int sys_sleep(uint32_t ms, uint32_t unused1, uint32_t unused2) {
+    kthread_sleep(ms);
+    return 0;
+}
+
+syscall_fn syscall_table[] = {
+    [SYS_exit]   = sys_exit,
+    [SYS_getpid] = sys_getpid,
+    [SYS_write]  = sys_write,
+    [SYS_yield]  = sys_yield,
+    [SYS_sleep]  = sys_sleep,
+};
+
+uint32_t nr_syscalls = sizeof(syscall_table) / sizeof(syscall_table[0]);
+
+/*
+ * Enables sysenter if the CPU has it. SYSENTER_ESP is reloaded with the
+ * running thread's kernel stack on every context switch.
+ */
+void syscall_init(void) {
+    uint32_t eax, edx;
+
+    asm volatile("cpuid" : "=a"(eax), "=d"(edx) : "a"(1) : "ebx", "ecx");
+
+    // Family 6 models before 3 report SEP but do not implement it
+    if (!(edx & (1 << 11)) || (((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3)) {
+        return;
+    }
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+    sysenter_enabled = 1;
+}
+
+// Code image that runs in ring 3, from src/usertest.s
+extern char user_test_start[], user_test_end[];
+extern char ubench_int80[], ubench_sysenter[];
+
+static int run_user_bench(const char *name, char *entry) {
+    int pid = proc_spawn_image(name, user_test_start, user_test_end - user_test_start,
+                               entry - user_test_start);
+    if (pid < 0) {
+        return -1;
+    }
+    return proc_wait(pid);
+}
+
+/*
+ * Measures the average round trip of a null system call (getpid) from ring 3
+ * through each entry path. The user code times its own loop with rdtsc and
+ * reports cycles per call as its exit code.
+ */
+void syscall_latency_test(void) {
+    int cycles = run_user_bench("ubench_int80", ubench_int80);
+    esp_printf(putc, "syscall round trip, int 0x80: %d cycles\r\n", cycles);
+
+    if (!sysenter_enabled) {
+        esp_printf(putc, "syscall round trip, sysenter: not supported\r\n");
+        return;
+    }
+    cycles = run_user_bench("ubench_sysenter", ubench_sysenter);
+    esp_printf(putc, "syscall round trip, sysenter: %d cycles\r\n", cycles);
+}
@@ -0,0 +1,34 @@
+#ifndef __SYSCALL_H__
+#define __SYSCALL_H__
+
+#include <stdint.h>
+
+/*
+ * System call ABI, shared by int 0x80 and sysenter:
+ *   eax        system call number, return value
+ *   ebx, esi, edi  arguments 1-3
+ *   ecx, edx   clobbered (sysenter takes the return esp/eip in them)
+ */
+#define SYS_exit    0
+#define SYS_getpid  1
+#define SYS_write   2
+#define SYS_yield   3
+#define SYS_sleep   4
+
+#define MSR_SYSENTER_CS   0x174
+#define MSR_SYSENTER_ESP  0x175
+#define MSR_SYSENTER_EIP  0x176
+
+typedef int (*syscall_fn)(uint32_t a1, uint32_t a2, uint32_t a3);
+
+extern syscall_fn syscall_table[];
+extern uint32_t nr_syscalls;
+
+void syscall_init(void);
+void syscall_latency_test(void);
+
+// Entry points in src/syscall_entry.s
+void syscall_entry(void);
+void sysenter_entry(void);
+
+#endif
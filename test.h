@@ -0,0 +1,43 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include "rprintf.h"
+#include "serial.h"
+
+/*
+ * In-kernel regression tests, run when the kernel is booted with "test".
+ * TEST(name) defines a function that returns 0 on success. The tests live
+ * in a linker section (_start_tests to _end_tests), like the benchmarks.
+ * Each one reports "TEST <name> PASS" or "TEST <name> FAIL" on COM1.
+ * Under QEMU with isa-debug-exit, qemu_exit() ends the run with an exit
+ * status the host can check.
+ */
+
+// isa-debug-exit,iobase=0xf4: QEMU exits with (value << 1) | 1
+#define QEMU_EXIT_PORT  0xF4
+#define QEMU_EXIT_PASS  0       // QEMU exit status 1
+#define QEMU_EXIT_FAIL  1       // QEMU exit status 3
+
+struct test {
+    const char *name;
+    int (*fn)(void);
+};
+
+#define TEST(_name)                                                            \
+    static int test_fn_##_name(void);                                          \
+    struct test test_##_name __attribute__((section(".data.tests"), used)) =  \
+        { #_name, test_fn_##_name };                                           \
+    static int test_fn_##_name(void)
+
+#define TEST_ASSERT(cond)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            esp_printf(serial_putc, "  %s:%d: %s\r\n", __FILE__, __LINE__, #cond); \
+            return -1;                                                         \
+        }                                                                      \
+    } while (0)
+
+int test_run_all(void);
+void qemu_exit(int code);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * tests.c
+ *
+ * The test runner and the built-in tests. The fixture tests read the disk
+ * that 'make test' attaches as -hdb (see mkfixtures.py): files of known
+ * sizes filled with fixture_byte(), and a run of small files. The image
+ * only holds the sizes that fit FIXTURE_MB; MANIFEST.TXT names them.
+ */
+
+#include "test.h"
+#include "blockdev.h"
+#include "fat.h"
+#include "page.h"
+#include "interrupt.h"
+#include <stddef.h>
+
+extern struct test _start_tests[];
+extern struct test _end_tests[];
+
+// Primary slave, where 'make test' puts fixtures.img
+#define FIXTURE_DEV     "ata1"
+#define FIXTURE_CHUNK   (64 * 1024)
+
+struct fixture {
+    const char *name;
+    uint32_t size;
+};
+
+static const struct fixture fixtures[] = {
+    { "F1K.BIN",   1024 },
+    { "F4K.BIN",   4 * 1024 },
+    { "F64K.BIN",  64 * 1024 },
+    { "F1M.BIN",   1024 * 1024 },
+    { "F16M.BIN",  16 * 1024 * 1024 },
+    { "F64M.BIN",  64 * 1024 * 1024 },
+};
+
+// Byte at offset i of every fixture; differs from page to page
+static inline uint8_t fixture_byte(uint32_t i) {
+    return (uint8_t)(i * 31 + (i >> 12));
+}
+
+void qemu_exit(int code) {
+    serial_flush();
+    outb(QEMU_EXIT_PORT, code);
+}
+
+// Runs every registered test; returns how many failed
+int test_run_all(void) {
+    int failed = 0, n = 0;
+
+    esp_printf(serial_putc, "TEST-BEGIN\r\n");
+    for (struct test *t = _start_tests; t < _end_tests; t++) {
+        int rc = t->fn();
+        esp_printf(serial_putc, "TEST %s %s\r\n", t->name, rc == 0 ? "PASS" : "FAIL");
+        if (rc != 0) {
+            failed++;
+        }
+        n++;
+    }
+    esp_printf(serial_putc, "TEST-END count=%d failed=%d\r\n", n, failed);
+    return failed;
+}
+
+// Reads a fixture to the end and checks its size and every byte
+static int check_fixture(const struct fixture *fx, char *buf) {
+    int fd = fatOpen(fx->name);
+    if (fd < 0) {
+        esp_printf(serial_putc, "  %s: not found\r\n", fx->name);
+        return -1;
+    }
+    uint32_t off = 0;
+    int n;
+    while ((n = fatRead(fd, buf, FIXTURE_CHUNK)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if ((uint8_t)buf[i] != fixture_byte(off + i)) {
+                esp_printf(serial_putc, "  %s: bad byte at %d\r\n", fx->name, off + i);
+                fatClose(fd);
+                return -1;
+            }
+        }
+        off += n;
+    }
+    fatClose(fd);
+    if (off != fx->size) {
+        esp_printf(serial_putc, "  %s: read %d of %d bytes\r\n", fx->name, off, fx->size);
+        return -1;
+    }
+    return 0;
+}
+
+// Mounts the fixture disk for the length of a test and puts the root back
+static struct blockdev *fixture_mount(void) {
+    struct blockdev *dev = blockdev_find(FIXTURE_DEV);
+    if (dev == NULL || fatInit(dev) != 0) {
+        esp_printf(serial_putc, "  no fixture volume on %s\r\n", FIXTURE_DEV);
+        return NULL;
+    }
+    return dev;
+}
+
+// Whether name is one of the lines of manifest (len bytes)
+static int fixture_listed(const char *manifest, int len, const char *name) {
+    int start = 0;
+    while (start < len) {
+        int i = 0;
+        while (name[i] != '\0' && start + i < len && manifest[start + i] == name[i]) {
+            i++;
+        }
+        if (name[i] == '\0' && (start + i == len || manifest[start + i] == '\n')) {
+            return 1;
+        }
+        while (start < len && manifest[start] != '\n') {
+            start++;
+        }
+        start++;
+    }
+    return 0;
+}
+
+TEST(fixture_contents) {
+    struct blockdev *root = fat_dev;
+    char manifest[128];
+    char *buf = kpage_alloc(FIXTURE_CHUNK / PAGE_SIZE);
+    TEST_ASSERT(buf != NULL);
+
+    int rc = fixture_mount() != NULL ? 0 : -1;
+    int len = -1;
+    if (rc == 0) {
+        int fd = fatOpen("MANIFEST.TXT");
+        len = fd >= 0 ? fatRead(fd, manifest, sizeof(manifest)) : -1;
+        if (fd >= 0) {
+            fatClose(fd);
+        }
+        if (len < 0) {
+            esp_printf(serial_putc, "  MANIFEST.TXT: not found\r\n");
+            rc = -1;
+        }
+    }
+    for (uint32_t i = 0; rc == 0 && i < sizeof(fixtures) / sizeof(fixtures[0]); i++) {
+        if (!fixture_listed(manifest, len, fixtures[i].name)) {
+            esp_printf(serial_putc, "  %s: not in this image, skipped\r\n", fixtures[i].name);
+            continue;
+        }
+        rc = check_fixture(&fixtures[i], buf);
+    }
+    kpage_free(buf);
+    fatInit(root);
+    return rc;
+}
+
+// Opens the first and last of the small files; each holds its own name
+static int check_small_file(uint32_t index) {
+    char name[13] = "N0000.TXT";
+    char buf[16];
+    for (int d = 4; d >= 1; d--) {
+        name[d] = '0' + index % 10;
+        index /= 10;
+    }
+    int fd = fatOpen(name);
+    if (fd < 0) {
+        return -1;
+    }
+    int n = fatRead(fd, buf, sizeof(buf));
+    fatClose(fd);
+    if (n != 9) {
+        return -1;
+    }
+    for (int i = 0; i < 9; i++) {
+        if (buf[i] != name[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+TEST(fixture_many_files) {
+    struct blockdev *root = fat_dev;
+    char buf[16];
+    uint32_t count = 0;
+    int rc = -1;
+
+    if (fixture_mount() != NULL) {
+        int fd = fatOpen("COUNT.TXT");
+        int n = fd >= 0 ? fatRead(fd, buf, sizeof(buf)) : -1;
+        if (fd >= 0) {
+            fatClose(fd);
+        }
+        for (int i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++) {
+            count = count * 10 + buf[i] - '0';
+        }
+        rc = (count > 0 && check_small_file(0) == 0 && check_small_file(count - 1) == 0) ? 0 : -1;
+    }
+    fatInit(root);
+    return rc;
+}
+
+// Reads after a seek match the same bytes read from the start
+TEST(fat_seek) {
+    char *buf = kpage_alloc(2);
+    TEST_ASSERT(buf != NULL);
+    int fd = fatOpen("kernel");
+    TEST_ASSERT(fd >= 0);
+
+    int n = fatRead(fd, buf, 6000);
+    int rc = n == 6000 ? 0 : -1;
+    if (rc == 0 && fatSeek(fd, 5000) == 0) {
+        rc = fatRead(fd, buf + 6000, 1000) == 1000 ? 0 : -1;
+        for (int i = 0; rc == 0 && i < 1000; i++) {
+            if (buf[5000 + i] != buf[6000 + i]) {
+                rc = -1;
+            }
+        }
+    }
+    fatClose(fd);
+    kpage_free(buf);
+    return rc;
+}
+
+TEST(blockdev_bounds) {
+    struct blockdev *dev = blockdev_boot();
+    char sector[512];
+    TEST_ASSERT(dev != NULL);
+    TEST_ASSERT(blockdev_read(dev, 0, sector, 1) == 0);
+    TEST_ASSERT(blockdev_read(dev, dev->sectors - 1, sector, 1) == 0);
+    TEST_ASSERT(blockdev_read(dev, dev->sectors, sector, 1) < 0);
+    TEST_ASSERT(blockdev_read(dev, dev->sectors - 1, sector, 2) < 0);
+    return 0;
+}
+
+TEST(frame_alloc_distinct) {
+    struct ppage *a = allocate_physical_pages(1);
+    struct ppage *b = allocate_physical_pages(1);
+    int rc = (a != NULL && b != NULL && a->physical_addr != b->physical_addr) ? 0 : -1;
+    if (a != NULL) {
+        free_physical_pages_list(a);
+    }
+    if (b != NULL) {
+        free_physical_pages_list(b);
+    }
+    return rc;
+}
+
+// kpage memory is the direct map of its frame, so both translations agree
+TEST(direct_map) {
+    char *buf = kpage_alloc(1);
+    TEST_ASSERT(buf != NULL);
+    uint32_t paddr = virt_to_phys(buf);
+    int rc = (is_direct_mapped(buf) && paddr != 0 && phys_to_virt(paddr) == buf) ? 0 : -1;
+    kpage_free(buf);
+    return rc;
+}
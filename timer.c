@@ -0,0 +1,276 @@
+/*
+ * timer.c
+ *
+ * PIT tick source, TSC-based monotonic clock and a hierarchical timer wheel.
+ *
+ * Timers are kept in five levels of buckets in the style of the classic BSD
+ * and Linux wheels. Arming and cancelling are O(1) list operations; timers in
+ * the upper levels are cascaded down one level each time the level below
+ * wraps around.
+ */
+
+#include <stdint.h>
+#include "timer.h"
+#include "interrupt.h"
+#include "rprintf.h"
+#include "smp.h"
+#include "profile.h"
+
+volatile uint32_t jiffies = 0;
+uint32_t timer_hz = CONFIG_HZ;
+uint32_t tsc_khz = 0;
+uint8_t timer_vector = IRQ_BASE + PIT_IRQ;  // Moved by apic_init()
+
+// ktime_ns() = ((tsc - tsc_base) * tsc_mult) >> TSC_SHIFT
+#define TSC_SHIFT 22
+static uint64_t tsc_base;
+static uint32_t tsc_mult;
+
+DEFINE_SPINLOCK(timer_lock);  // Guards the wheel; timers are armed from any CPU
+static struct timer_list *tv1[TVR_SIZE];
+static struct timer_list *tv2[TVN_SIZE];
+static struct timer_list *tv3[TVN_SIZE];
+static struct timer_list *tv4[TVN_SIZE];
+static struct timer_list *tv5[TVN_SIZE];
+static uint32_t timer_jiffies;  // Next tick the wheel has not processed yet
+
+int cpu_has_tsc(void) {
+    uint32_t before, after, edx;
+
+    // The CPUID instruction exists if the ID bit in EFLAGS can be toggled
+    asm volatile("pushfl\n"
+                 "pop %0\n"
+                 "mov %0, %1\n"
+                 "xor $0x200000, %1\n"
+                 "push %1\n"
+                 "popfl\n"
+                 "pushfl\n"
+                 "pop %1\n"
+                 "push %0\n"
+                 "popfl\n"
+                 : "=&r"(before), "=&r"(after));
+    if (((before ^ after) & 0x200000) == 0) {
+        return 0;
+    }
+    asm volatile("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+    return (edx >> 4) & 1;
+}
+
+/*
+ * Measures the TSC frequency against a 10 ms one-shot countdown on PIT
+ * channel 2, whose output can be polled through port 0x61.
+ */
+static void calibrate_tsc(void) {
+    const uint32_t ms = 10;
+    uint32_t count = PIT_BASE_HZ / (1000 / ms);
+
+    if (!cpu_has_tsc()) {
+        return;
+    }
+
+    // Gate high, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    uint64_t start = rdtsc();
+    while ((inb(PIT_GATE_PORT) & 0x20) == 0) {
+        // Wait for OUT2 to go high
+    }
+    uint64_t end = rdtsc();
+
+    tsc_khz = (uint32_t)(end - start) / ms;
+    if (tsc_khz == 0) {
+        return;
+    }
+    tsc_mult = (uint32_t)div64_32((uint64_t)1000000 << TSC_SHIFT, tsc_khz);
+    tsc_base = end;
+}
+
+/*
+ * Nanoseconds since the TSC was calibrated. The product is split into two
+ * 32x32 multiplies so it cannot overflow for any realistic uptime. Falls
+ * back to tick resolution if the CPU has no TSC.
+ */
+uint64_t ktime_ns(void) {
+    if (tsc_mult == 0) {
+        return (uint64_t)jiffies * (1000000000 / timer_hz);
+    }
+
+    uint64_t delta = rdtsc() - tsc_base;
+    uint64_t lo = (uint64_t)(uint32_t)delta * tsc_mult;
+    uint64_t hi = (uint64_t)(uint32_t)(delta >> 32) * tsc_mult;
+    return (hi << (32 - TSC_SHIFT)) + (lo >> TSC_SHIFT);
+}
+
+static int timer_irq(struct regs *r, void *ctx) {
+    profile_tick(r);
+
+    // Every CPU's local APIC timer shares the vector; only the boot CPU keeps time
+    if (cpu_id() != 0) {
+        return IRQ_HANDLED;
+    }
+    timer_interrupt();
+    return IRQ_HANDLED;
+}
+
+void timer_init(uint32_t hz) {
+    if (hz < 19 || hz > PIT_BASE_HZ) {
+        hz = CONFIG_HZ;  // The divisor has to fit in 16 bits
+    }
+    timer_hz = hz;
+    timer_jiffies = jiffies;
+
+    calibrate_tsc();
+
+    // Channel 0, lobyte/hibyte, mode 2 (rate generator)
+    uint32_t divisor = PIT_BASE_HZ / hz;
+    outb(PIT_COMMAND, 0x34);
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+    irq_register(timer_vector, timer_irq, NULL);
+}
+
+static void list_add(struct timer_list **head, struct timer_list *t) {
+    t->next = *head;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+}
+
+static void list_del(struct timer_list *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void internal_add_timer(struct timer_list *t) {
+    uint32_t expires = t->expires;
+    int32_t idx = expires - timer_jiffies;
+    struct timer_list **slot;
+
+    if (idx < 0) {
+        // Already expired: run on the next tick
+        slot = &tv1[timer_jiffies & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &tv1[expires & TVR_MASK];
+    } else if (idx < 1 << (TVR_BITS + TVN_BITS)) {
+        slot = &tv2[(expires >> TVR_BITS) & TVN_MASK];
+    } else if (idx < 1 << (TVR_BITS + 2 * TVN_BITS)) {
+        slot = &tv3[(expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+    } else if (idx < 1 << (TVR_BITS + 3 * TVN_BITS)) {
+        slot = &tv4[(expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK];
+    } else {
+        if (idx > TIMER_MAX_TIMEOUT) {
+            expires = timer_jiffies + TIMER_MAX_TIMEOUT;
+            t->expires = expires;
+        }
+        slot = &tv5[(expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK];
+    }
+    list_add(slot, t);
+}
+
+void timer_setup(struct timer_list *t, void (*fn)(void *), void *data) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->data = data;
+}
+
+// Arms (or re-arms) a timer to fire at the absolute time expires.
+void mod_timer(struct timer_list *t, uint32_t expires) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    if (t->pprev != NULL) {
+        list_del(t);
+    }
+    t->expires = expires;
+    internal_add_timer(t);
+
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void del_timer(struct timer_list *t) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    if (t->pprev != NULL) {
+        list_del(t);
+    }
+
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// Moves every timer in one upper-level bucket down to where it now belongs.
+static int cascade(struct timer_list **tv, int index) {
+    struct timer_list *t = tv[index];
+    tv[index] = NULL;
+
+    while (t != NULL) {
+        struct timer_list *next = t->next;
+        t->pprev = NULL;
+        internal_add_timer(t);
+        t = next;
+    }
+    return index;
+}
+
+#define TV_INDEX(n) ((timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+// Runs with timer_lock held; dropped around each callback so it can re-arm
+static void run_timers(void) {
+    while (!time_after(timer_jiffies, jiffies)) {
+        int index = timer_jiffies & TVR_MASK;
+
+        if (index == 0 &&
+            cascade(tv2, TV_INDEX(0)) == 0 &&
+            cascade(tv3, TV_INDEX(1)) == 0 &&
+            cascade(tv4, TV_INDEX(2)) == 0) {
+            cascade(tv5, TV_INDEX(3));
+        }
+        timer_jiffies++;
+
+        while (tv1[index] != NULL) {
+            struct timer_list *t = tv1[index];
+            list_del(t);
+            spin_unlock(&timer_lock);
+            t->fn(t->data);
+            spin_lock(&timer_lock);
+        }
+    }
+}
+
+// Called from the PIT interrupt handler on every tick.
+void timer_interrupt(void) {
+    jiffies++;
+    spin_lock(&timer_lock);
+    run_timers();
+    spin_unlock(&timer_lock);
+}
+
+// Busy-waits for at least us microseconds. Works with interrupts disabled.
+void udelay(uint32_t us) {
+    uint64_t until = ktime_ns() + (uint64_t)us * 1000;
+
+    while (ktime_ns() < until) {
+        asm volatile("pause");
+    }
+}
+
+// Sleeps for at least ms milliseconds. Requires interrupts to be enabled.
+void msleep(uint32_t ms) {
+    uint32_t until = jiffies + msecs_to_jiffies(ms) + 1;
+
+    while (time_after(until, jiffies)) {
+        asm("hlt");
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+#ifndef CONFIG_HZ
+#define CONFIG_HZ 1000
+#endif
+
+// 8253/8254 programmable interval timer
+#define PIT_BASE_HZ     1193182
+#define PIT_CHANNEL0    0x40
+#define PIT_CHANNEL2    0x42
+#define PIT_COMMAND     0x43
+#define PIT_GATE_PORT   0x61   // Channel 2 gate (bit 0) and output (bit 5)
+#define PIT_IRQ         0
+
+/*
+ * Timer wheel geometry. The first level has one slot per tick, each of the
+ * following levels covers 64 times the range of the one below it.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TIMER_MAX_TIMEOUT ((1 << (TVR_BITS + 3 * TVN_BITS)) - 1)
+
+/*
+ * A kernel timer. The callback runs from the timer interrupt with interrupts
+ * disabled, so it must be short and must not block.
+ */
+struct timer_list {
+    struct timer_list *next;
+    struct timer_list **pprev;   // NULL when the timer is not armed
+    uint32_t expires;            // Absolute expiry time in jiffies
+    void (*fn)(void *data);
+    void *data;
+};
+
+extern volatile uint32_t jiffies;
+extern uint32_t timer_hz;
+extern uint32_t tsc_khz;
+extern uint8_t timer_vector;
+
+void timer_init(uint32_t hz);
+void udelay(uint32_t us);
+void timer_interrupt(void);
+uint64_t ktime_ns(void);
+int cpu_has_tsc(void);
+void msleep(uint32_t ms);
+
+void timer_setup(struct timer_list *t, void (*fn)(void *), void *data);
+void mod_timer(struct timer_list *t, uint32_t expires);
+void del_timer(struct timer_list *t);
+
+static inline uint32_t msecs_to_jiffies(uint32_t ms) {
+    return (ms * timer_hz + 999) / 1000;
+}
+
+// Wrap-safe jiffies comparison: true if a is after b
+#define time_after(a, b) ((int32_t)((b) - (a)) < 0)
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Divides a 64-bit value by a 32-bit one without pulling in libgcc's
+ * __udivdi3, which this kernel does not link against.
+ */
+static inline uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = n >> 32, lo = n, qhi, qlo, rem;
+
+    qhi = hi / d;
+    rem = hi % d;
+    asm("divl %4" : "=a"(qlo), "=d"(rem) : "a"(lo), "d"(rem), "rm"(d));
+    return ((uint64_t)qhi << 32) | qlo;
+}
+
+#endif
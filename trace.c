@@ -0,0 +1,54 @@
+/*
+ * trace.c
+ *
+ * Per-CPU trace rings and the dump that trace2json.py reads:
+ *
+ *   TRACE-BEGIN tsc_khz=<kHz> cpus=<n>
+ *   TRACE-EVENT <id> <name> <arg0> <arg1> <arg2>
+ *   T <cpu> <tsc hex> <id> <arg0 hex> <arg1 hex> <arg2 hex>
+ *   TRACE-END records=<n>
+ */
+
+#include "trace.h"
+#include "serial.h"
+#include "rprintf.h"
+
+volatile int trace_enabled;
+struct trace_ring trace_rings[MAX_CPUS];
+
+#define TRACE_NAME(name, a0, a1, a2) { #name, #a0, #a1, #a2 },
+static const char *trace_names[TRACE_NR_EVENTS][4] = {
+    TRACE_EVENTS(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+void trace_enable(int on) {
+    trace_enabled = on;
+}
+
+// Prints every CPU's ring, oldest record first. Tracing is paused meanwhile
+// so the rings hold still.
+void trace_dump(void) {
+    int was_enabled = trace_enabled;
+    uint32_t total = 0;
+
+    trace_enabled = 0;
+    esp_printf(serial_putc, "TRACE-BEGIN tsc_khz=%d cpus=%d\r\n", tsc_khz, ncpus);
+    for (int e = 0; e < TRACE_NR_EVENTS; e++) {
+        esp_printf(serial_putc, "TRACE-EVENT %d %s %s %s %s\r\n", e, trace_names[e][0],
+                   trace_names[e][1], trace_names[e][2], trace_names[e][3]);
+    }
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        struct trace_ring *ring = &trace_rings[cpu];
+        uint32_t head = ring->head;
+        uint32_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint32_t i = first; i < head; i++) {
+            struct trace_record *r = &ring->records[i & (TRACE_RING_SIZE - 1)];
+            esp_printf(serial_putc, "T %d %x%08x %d %x %x %x\r\n", cpu, (uint32_t)(r->tsc >> 32),
+                       (uint32_t)r->tsc, r->event, r->args[0], r->args[1], r->args[2]);
+        }
+        total += head - first;
+    }
+    esp_printf(serial_putc, "TRACE-END records=%d\r\n", total);
+    trace_enabled = was_enabled;
+}
@@ -0,0 +1,81 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include "timer.h"
+#include "smp.h"
+
+/*
+ * Binary tracepoints. Each event is declared once in TRACE_EVENTS below.
+ * TRACE(id, a0, a1, a2) stores a TSC timestamp, the event id and three
+ * arguments in the current CPU's ring. A record is claimed with one atomic
+ * add and nothing is locked or printed, so tracepoints can sit on hot
+ * paths and in interrupt handlers. A full ring overwrites its oldest
+ * records. trace_dump() prints the rings to COM1 as text, and
+ * trace2json.py turns that into Chrome trace JSON (chrome://tracing,
+ * Perfetto).
+ *
+ * Tracing is off until trace_enable(1) (the "trace" boot option); a
+ * disabled tracepoint costs one load and a branch.
+ */
+
+// X(name, arg0, arg1, arg2): argument names are for the decoder
+#define TRACE_EVENTS(X)                                         \
+    X(IRQ_ENTRY,     vector,  eip,     cpl)                     \
+    X(IRQ_EXIT,      vector,  handled, unused)                  \
+    X(PAGE_FAULT,    addr,    eip,     err)                     \
+    X(ATA_ISSUE,     disk,    lba,     count)                   \
+    X(ATA_COMPLETE,  disk,    lba,     status)                  \
+    X(RA_HIT,        fd,      pos,     len)                     \
+    X(RA_MISS,       fd,      pos,     window)                  \
+    X(FAT_CLUSTER,   cluster, next,    unused)                  \
+    X(FAT_DIRENT,    sector,  index,   cluster)                 \
+    X(FAT_READ,      fd,      bytes,   size)
+
+#define TRACE_ENUM(name, a0, a1, a2) TRACE_##name,
+enum trace_event {
+    TRACE_EVENTS(TRACE_ENUM)
+    TRACE_NR_EVENTS
+};
+#undef TRACE_ENUM
+
+#define TRACE_RING_SIZE 2048    // Records per CPU; a power of two
+
+struct trace_record {
+    uint64_t tsc;
+    uint32_t event;
+    uint32_t args[3];
+};
+
+struct trace_ring {
+    volatile uint32_t head;     // Records ever claimed; head % size is the next slot
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+extern volatile int trace_enabled;
+extern struct trace_ring trace_rings[MAX_CPUS];
+
+static inline void trace_record(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2) {
+    struct trace_ring *ring = &trace_rings[cpu_id()];
+    // An interrupt may trace between the claim and the stores; it gets the next slot
+    uint32_t slot = atomic_xadd(&ring->head, 1) & (TRACE_RING_SIZE - 1);
+    struct trace_record *r = &ring->records[slot];
+    r->tsc = rdtsc();
+    r->event = event;
+    r->args[0] = a0;
+    r->args[1] = a1;
+    r->args[2] = a2;
+}
+
+#define TRACE(event, a0, a1, a2)                                               \
+    do {                                                                       \
+        if (trace_enabled) {                                                   \
+            trace_record(TRACE_##event, (uint32_t)(a0), (uint32_t)(a1),         \
+                         (uint32_t)(a2));                                      \
+        }                                                                      \
+    } while (0)
+
+void trace_enable(int on);
+void trace_dump(void);
+
+#endif
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+#
+# Turns a trace dump from the kernel's serial log (trace.c) into Chrome trace
+# JSON for chrome://tracing or ui.perfetto.dev.
+#
+#   trace2json.py <serial log> [<output.json>]
+#
+# Each CPU is a thread. Interrupts are duration slices from IRQ_ENTRY to
+# IRQ_EXIT. ATA commands are async slices from issue to completion, and
+# every other event is an instant carrying its named arguments.
+
+import json
+import sys
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit("usage: trace2json.py <serial log> [<output.json>]")
+
+    tsc_khz = 0
+    names = {}
+    records = []
+    with open(sys.argv[1], errors="replace") as f:
+        for line in f:
+            words = line.split()
+            if not words:
+                continue
+            if words[0] == "TRACE-BEGIN":
+                fields = dict(w.split("=", 1) for w in words[1:] if "=" in w)
+                tsc_khz = int(fields.get("tsc_khz", 0))
+            elif words[0] == "TRACE-EVENT" and len(words) == 6:
+                names[int(words[1])] = (words[2], words[3:6])
+            elif words[0] == "T" and len(words) == 7:
+                try:
+                    cpu, tsc, event = int(words[1]), int(words[2], 16), int(words[3])
+                    args = [int(w, 16) for w in words[4:7]]
+                except ValueError:
+                    continue  # A line another CPU's output broke up
+                records.append((tsc, cpu, event, args))
+
+    if not records or tsc_khz == 0:
+        sys.exit("trace2json: no trace dump in %s" % sys.argv[1])
+
+    records.sort()
+    base = records[0][0]
+    events = []
+    for tsc, cpu, event, args in records:
+        name, argnames = names.get(event, ("event%d" % event, ["a0", "a1", "a2"]))
+        ts = (tsc - base) * 1000.0 / tsc_khz  # Microseconds
+        named = {n: a for n, a in zip(argnames, args) if n != "unused"}
+        ev = {"name": name, "ts": ts, "pid": 0, "tid": cpu, "args": named}
+        if name == "IRQ_ENTRY":
+            ev.update(name="irq %d" % args[0], ph="B", cat="irq")
+        elif name == "IRQ_EXIT":
+            ev.update(name="irq %d" % args[0], ph="E", cat="irq")
+        elif name in ("ATA_ISSUE", "ATA_COMPLETE"):
+            ev.update(name="ata%d read" % args[0], cat="ata",
+                      ph="b" if name == "ATA_ISSUE" else "e",
+                      id="%d:%d" % (args[0], args[1]))
+        else:
+            ev.update(ph="i", s="t", cat="kernel")
+        events.append(ev)
+
+    for cpu in sorted({r[1] for r in records}):
+        events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": cpu,
+                       "args": {"name": "cpu%d" % cpu}})
+
+    out = open(sys.argv[2], "w") if len(sys.argv) == 3 else sys.stdout
+    json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, out)
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,276 @@
+/*
+ * virtio.c
+ *
+ * virtio-blk over the legacy PCI interface with one split virtqueue. Each
+ * merged group becomes a descriptor chain: the request header, one
+ * descriptor per page of data, and a status byte. blk_dispatch() places
+ * every group it can on the available ring, and the device is notified once
+ * at the end (the kick hook). With VIRTIO_RING_F_EVENT_IDX, each side tells
+ * the other how far it has got. The device then skips interrupts for
+ * completions we are about to see anyway. We skip notifications the device
+ * does not need while it is still working through the ring.
+ */
+
+#include "virtio.h"
+#include "pci.h"
+#include "page.h"
+#include "interrupt.h"
+#include "rprintf.h"
+#include <stddef.h>
+
+extern int putc(int data);
+extern uint8_t inb(uint16_t port);
+extern uint16_t inw(uint16_t port);
+extern void outb(uint16_t port, uint8_t val);
+extern void memset(char *s, char c, unsigned int n);
+
+static struct virtio_blk vblk;
+
+static inline void outw(uint16_t port, uint16_t val) {
+    asm volatile("outw %0, %1" : : "a"(val), "dN"(port));
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile("outl %0, %1" : : "a"(val), "dN"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t rv;
+    asm volatile("inl %1, %0" : "=a"(rv) : "dN"(port));
+    return rv;
+}
+
+// Full barrier; the index stores must be visible before we read the other side's
+static inline void virtio_mb(void) {
+    asm volatile("lock; addl $0, (%%esp)" : : : "memory");
+}
+
+#define USED_EVENT(v)   (*(volatile uint16_t *)&(v)->avail->ring[(v)->qsize])
+#define AVAIL_EVENT(v)  (*(volatile uint16_t *)&(v)->used->ring[(v)->qsize])
+
+// Legacy layout: descriptors, then the available ring, then the used ring
+// on the next page boundary
+static uint32_t vring_size(uint16_t qsize) {
+    uint32_t avail_end = 16 * qsize + 6 + 2 * qsize;
+    uint32_t used = (avail_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    return used + 6 + 8 * qsize;
+}
+
+// blk_queue start hook: builds the chain and publishes it. Called with the
+// queue lock held; the device is told in virtio_kick().
+static void virtio_start(struct blk_queue *q, struct blk_request *group) {
+    struct virtio_blk *v = (struct virtio_blk *)q->driver_data;
+    uint32_t flags = spin_lock_irqsave(&v->lock);
+
+    // The queue depth keeps at least VIRTIO_BLK_SEGMENTS + 2 descriptors free
+    uint16_t head = v->free_head;
+    uint16_t d = head;
+    struct virtio_blk_hdr *hdr = &v->hdrs[head];
+
+    hdr->type = VIRTIO_BLK_T_IN;
+    hdr->reserved = 0;
+    hdr->sector = group->lba;
+    hdr->sector_hi = 0;
+    v->desc[d].addr = virt_to_phys(hdr);
+    v->desc[d].addr_hi = 0;
+    v->desc[d].len = sizeof(struct virtio_blk_hdr);
+    v->desc[d].flags = VIRTQ_DESC_F_NEXT;
+    int used = 1;
+
+    for (struct blk_request *r = group; r != NULL; r = r->chain) {
+        char *buf = r->buf;
+        uint32_t left = r->count * 512;
+        while (left > 0) {
+            uint32_t n = PAGE_SIZE - ((uint32_t)buf & (PAGE_SIZE - 1));
+            if (n > left) {
+                n = left;
+            }
+            d = v->desc[d].next;
+            v->desc[d].addr = virt_to_phys(buf);
+            v->desc[d].addr_hi = 0;
+            v->desc[d].len = n;
+            v->desc[d].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+            used++;
+            buf += n;
+            left -= n;
+        }
+    }
+
+    d = v->desc[d].next;
+    v->status[head] = 0xFF;
+    v->desc[d].addr = virt_to_phys(&v->status[head]);
+    v->desc[d].addr_hi = 0;
+    v->desc[d].len = 1;
+    v->desc[d].flags = VIRTQ_DESC_F_WRITE;
+    used++;
+
+    v->free_head = v->desc[d].next;
+    v->num_free -= used;
+    v->head_req[head] = group;
+
+    v->avail->ring[v->avail->idx % v->qsize] = head;
+    asm volatile("" : : : "memory");   // Entry before index; x86 keeps stores in order
+    v->avail->idx++;
+    spin_unlock_irqrestore(&v->lock, flags);
+}
+
+// Notifies the device of everything published since the last kick, unless
+// it has said it does not need to hear about it
+static void virtio_kick(struct blk_queue *q) {
+    struct virtio_blk *v = (struct virtio_blk *)q->driver_data;
+    uint32_t flags = spin_lock_irqsave(&v->lock);
+    uint16_t new_idx = v->avail->idx;
+    uint16_t old_idx = v->kicked_idx;
+    int notify;
+
+    virtio_mb();
+    if (v->event_idx) {
+        uint16_t event = AVAIL_EVENT(v);
+        notify = (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+    } else {
+        notify = !(v->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    v->kicked_idx = new_idx;
+    spin_unlock_irqrestore(&v->lock, flags);
+
+    if (notify) {
+        outw(v->iobase + VIRTIO_QUEUE_NOTIFY, 0);
+    }
+}
+
+// Returns a chain to the free list
+static void virtio_free_chain(struct virtio_blk *v, uint16_t head) {
+    uint16_t d = head;
+    int n = 1;
+    while (v->desc[d].flags & VIRTQ_DESC_F_NEXT) {
+        d = v->desc[d].next;
+        n++;
+    }
+    v->desc[d].next = v->free_head;
+    v->free_head = head;
+    v->num_free += n;
+}
+
+// Completes everything on the used ring
+static void virtio_service(struct virtio_blk *v) {
+    struct blk_request *done[VIRTIO_BLK_MAX_DEPTH];
+    int status[VIRTIO_BLK_MAX_DEPTH];
+    int ndone = 0;
+
+    uint32_t flags = spin_lock_irqsave(&v->lock);
+    for (;;) {
+        while (v->last_used != v->used->idx && ndone < VIRTIO_BLK_MAX_DEPTH) {
+            uint16_t head = v->used->ring[v->last_used % v->qsize].id;
+            done[ndone] = v->head_req[head];
+            status[ndone] = v->status[head] == VIRTIO_BLK_S_OK ? 0 : -1;
+            ndone++;
+            v->head_req[head] = NULL;
+            virtio_free_chain(v, head);
+            v->last_used++;
+        }
+        if (!v->event_idx || ndone == VIRTIO_BLK_MAX_DEPTH) {
+            break;
+        }
+        // Ask for an interrupt at the next completion, then make sure none
+        // slipped in before the device could see the request
+        USED_EVENT(v) = v->last_used;
+        virtio_mb();
+        if (v->last_used == v->used->idx) {
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&v->lock, flags);
+
+    for (int i = 0; i < ndone; i++) {
+        blk_complete(&v->queue, done[i], status[i]);
+    }
+}
+
+static int virtio_irq(struct regs *r, void *ctx) {
+    struct virtio_blk *v = (struct virtio_blk *)ctx;
+
+    // Reading the ISR status acknowledges the interrupt; 0 means not ours
+    if (inb(v->iobase + VIRTIO_ISR_STATUS) == 0) {
+        return IRQ_NONE;
+    }
+    virtio_service(v);
+    return IRQ_HANDLED;
+}
+
+static void virtio_poll(struct blk_queue *q) {
+    virtio_service((struct virtio_blk *)q->driver_data);
+}
+
+int virtio_blk_init(void) {
+    struct pci_dev *dev = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_ID, NULL);
+    struct virtio_blk *v = &vblk;
+    if (dev == NULL) {
+        return -1;
+    }
+
+    pci_enable(dev, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    v->iobase = pci_bar(dev, 0);
+    outb(v->iobase + VIRTIO_DEVICE_STATUS, 0);  // Reset
+    outb(v->iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACK);
+    outb(v->iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inl(v->iobase + VIRTIO_DEVICE_FEATURES);
+    v->event_idx = (features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    outl(v->iobase + VIRTIO_GUEST_FEATURES, features & VIRTIO_RING_F_EVENT_IDX);
+
+    outw(v->iobase + VIRTIO_QUEUE_SELECT, 0);
+    v->qsize = inw(v->iobase + VIRTIO_QUEUE_SIZE);
+    if (v->qsize == 0 || v->qsize > VIRTQ_MAX_SIZE) {
+        outb(v->iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    // Ring first, then the request headers and status bytes
+    uint32_t ring_bytes = (vring_size(v->qsize) + 15) & ~15;
+    uint32_t bytes = ring_bytes + v->qsize * (sizeof(struct virtio_blk_hdr) + 1);
+    char *mem = kpage_alloc((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (mem == NULL) {
+        outb(v->iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    memset(mem, 0, bytes);
+    v->desc = (struct virtq_desc *)mem;
+    v->avail = (struct virtq_avail *)(mem + 16 * v->qsize);
+    v->used = (struct virtq_used *)(mem + ((16 * v->qsize + 6 + 2 * v->qsize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)));
+    v->hdrs = (struct virtio_blk_hdr *)(mem + ring_bytes);
+    v->status = (uint8_t *)(v->hdrs + v->qsize);
+
+    for (int i = 0; i < v->qsize; i++) {
+        v->desc[i].next = (i + 1) % v->qsize;
+    }
+    v->free_head = 0;
+    v->num_free = v->qsize;
+    spin_lock_init(&v->lock, "virtio_blk");
+    outl(v->iobase + VIRTIO_QUEUE_PFN, virt_to_phys(mem) >> 12);
+
+    v->sectors = inl(v->iobase + VIRTIO_BLK_CAPACITY);
+    if (inl(v->iobase + VIRTIO_BLK_CAPACITY + 4) != 0) {
+        v->sectors = 0xFFFFFFFF;
+    }
+
+    // Every in-flight group may need a header, a full set of segments and a status
+    uint32_t depth = v->qsize / (VIRTIO_BLK_SEGMENTS + 2);
+    if (depth > VIRTIO_BLK_MAX_DEPTH) {
+        depth = VIRTIO_BLK_MAX_DEPTH;
+    }
+    blk_queue_init(&v->queue, "virtio_blk", VIRTIO_BLK_SEGMENTS * PAGE_SIZE / 512,
+                   virtio_start, virtio_poll);
+    v->queue.driver_data = v;
+    v->queue.kick = virtio_kick;
+    v->queue.depth = depth;
+    v->queue.max_segments = VIRTIO_BLK_SEGMENTS;
+
+    irq_register(IRQ_BASE + dev->irq_line, virtio_irq, v);
+    outb(v->iobase + VIRTIO_DEVICE_STATUS,
+         VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    blockdev_init_queue(&v->bdev, "virtio0", &v->queue, v->sectors);
+    esp_printf(putc, "virtio-blk: %d sectors, queue %d, depth %d%s\r\n", v->sectors,
+               v->qsize, depth, v->event_idx ? ", event idx" : "");
+    return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef __VIRTIO_H__
+#define __VIRTIO_H__
+
+#include <stdint.h>
+#include "blk.h"
+#include "blockdev.h"
+#include "sync.h"
+
+#define VIRTIO_VENDOR_ID        0x1AF4
+#define VIRTIO_BLK_LEGACY_ID    0x1001
+
+// Legacy PCI register block (I/O BAR 0)
+#define VIRTIO_DEVICE_FEATURES  0x00
+#define VIRTIO_GUEST_FEATURES   0x04
+#define VIRTIO_QUEUE_PFN        0x08
+#define VIRTIO_QUEUE_SIZE       0x0C
+#define VIRTIO_QUEUE_SELECT     0x0E
+#define VIRTIO_QUEUE_NOTIFY     0x10
+#define VIRTIO_DEVICE_STATUS    0x12
+#define VIRTIO_ISR_STATUS       0x13
+#define VIRTIO_BLK_CAPACITY     0x14   // Device config, without MSI-X
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED    0x80
+
+#define VIRTIO_RING_F_EVENT_IDX (1u << 29)
+
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2      // Device writes this buffer
+#define VIRTQ_USED_F_NO_NOTIFY  1
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_S_OK         0
+
+#define VIRTQ_MAX_SIZE          256
+#define VIRTIO_BLK_SEGMENTS     16     // Data descriptors per request
+#define VIRTIO_BLK_MAX_DEPTH    16
+
+struct virtq_desc {
+    uint32_t addr;
+    uint32_t addr_hi;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];                   // Followed by used_event
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    struct virtq_used_elem ring[];     // Followed by avail_event
+};
+
+struct virtio_blk_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint32_t sector;
+    uint32_t sector_hi;
+};
+
+struct virtio_blk {
+    uint16_t iobase;
+    uint16_t qsize;
+    int event_idx;                     // VIRTIO_RING_F_EVENT_IDX negotiated
+    spinlock_t lock;                   // Guards the rings and the free list
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t last_used;                // Next used entry to look at
+    uint16_t kicked_idx;               // avail->idx at the last notify
+    struct blk_request *head_req[VIRTQ_MAX_SIZE];  // Group by head descriptor
+    struct virtio_blk_hdr *hdrs;       // One per descriptor slot, DMA memory
+    uint8_t *status;
+    uint32_t sectors;
+    struct blk_queue queue;
+    struct blockdev bdev;
+};
+
+int virtio_blk_init(void);
+
+#endif